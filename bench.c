@@ -0,0 +1,262 @@
+#include "maxwell.h"
+
+#ifndef MX_COMMIT
+#define MX_COMMIT "unknown"
+#endif
+
+#define MX_BENCH_SCHEMA 2
+#define MX_BENCH_WARMUP_STEPS 3
+#define MX_BENCH_REPEATS 3
+#define MX_BENCH_CELL_STEPS (1L << 26)
+#define MX_BENCH_MIN_STEPS 10
+#define MX_BENCH_MAX_STEPS 1000
+
+typedef enum {
+	BS_VACUUM = 0,
+	BS_DENSE,
+	BS_PML,
+	BS_SOURCES,
+	BS_MAX
+} BenchScene;
+
+typedef enum {
+	BE_SCALAR = 0,
+	BE_THREADED,
+	BE_OPENCL,
+	BE_MAX
+} BenchEngine;
+
+const char* scene_names[BS_MAX] = {"vacuum", "dense", "pml", "sources"};
+const char* engine_names[BE_MAX] = {"cpu", "cpu_threads", "opencl"};
+
+// Each engine's bandwidth roof in bytes per second, measured the first 
+// time it runs: the host triad on one or all threads, or the device copy
+double peak_bandwidth[BE_MAX];
+
+double enginePeak(BenchEngine engine, Simulation* simulation, int threads) {
+	double copy, triad;
+	if (peak_bandwidth[engine] == 0) {
+		if (engine == BE_OPENCL) {
+			peak_bandwidth[engine] = measureDeviceBandwidth(simulation);
+		} else if (measureHostBandwidth(threads, &copy, &triad)) {
+			peak_bandwidth[engine] = triad;
+		}
+	}
+	return peak_bandwidth[engine];
+}
+
+// Scenes are generated from a fixed seed, so every run and every commit
+// benchmarks exactly the same geometry
+unsigned nextRandom(unsigned* state) {
+	*state = *state * 1664525u + 1013904223u;
+	return *state >> 8;
+}
+
+int randomRange(unsigned* state, int lo, int hi) {
+	return lo + (int)(nextRandom(state) % (unsigned)(hi - lo + 1));
+}
+
+bool addBenchScene(Scene* scene, Simulation* simulation, BenchScene kind) {
+	int width = simulation->width;
+	int height = simulation->height;
+	unsigned state = 12345;
+	SineLinFreqParams sine = {1e6, 0};
+
+	simulation->boundary_condition = kind == BS_PML ? BC_PML
+			: kind == BS_DENSE ? BC_PEC : BC_NAT;
+	simulation->pml_layers = max(width, height) / 4;
+	simulation->pml_conductivity = MX_BC_PML_DEF_SIGMA;
+	simulation->pml_sigma_polyorder = 2;
+
+	if (addSineLinFreq(&scene->sources, FC_EZ, width / 2, height / 2,
+			sine) < 0) {
+		return false;
+	}
+
+	// Roughly one material per 400 cells, overlapping freely
+	if (kind == BS_DENSE) {
+		int count = width * height / 400;
+		int r = max(max(width, height) / 40, 2);
+		for (int m = 0; m < count; m++) {
+			float rel_eps = 1.5f + (float)randomRange(&state, 0, 250) / 100;
+			int x = randomRange(&state, 0, width - 1);
+			int y = randomRange(&state, 0, height - 1);
+			if (m % 2 == 0) {
+				CircleParams circle = {x, y, randomRange(&state, 1, r)};
+				if (addCircle(&scene->materials, rel_eps, 1, 0, circle) < 0) {
+					return false;
+				}
+			} else {
+				TriangleParams tri = {x, y,
+						x + randomRange(&state, -2 * r, 2 * r),
+						y + randomRange(&state, -2 * r, 2 * r),
+						x + randomRange(&state, -2 * r, 2 * r),
+						y + randomRange(&state, -2 * r, 2 * r)};
+				if (addTriangle(&scene->materials, rel_eps, 1, 0, tri) < 0) {
+					return false;
+				}
+			}
+		}
+	}
+
+	// One source per 64 cells, at a spread of frequencies
+	if (kind == BS_SOURCES) {
+		int count = width * height / 64;
+		for (int i = 0; i < count; i++) {
+			sine.frequency = 1e6f * (1 + randomRange(&state, 0, 99) / 100.0f);
+			sine.phase = (float)randomRange(&state, 0, 359);
+			if (addSineLinFreq(&scene->sources, FC_EZ,
+					randomRange(&state, 1, width - 2),
+					randomRange(&state, 1, height - 2), sine) < 0) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// The solver reports progress on stdout, which is kept for JSON records, so
+// it is pointed at stderr while a scene is set up
+int quietStdout(void) {
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+	return saved;
+}
+
+void restoreStdout(int saved) {
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+}
+
+int compareDoubles(const void* a, const void* b) {
+	double da = *(const double*)a;
+	double db = *(const double*)b;
+	return (da > db) - (da < db);
+}
+
+double runSteps(Field* field, Simulation* simulation, Scene* scene,
+		int steps) {
+	double start = wallTime();
+	for (int s = 0; s < steps; s++) {
+		updateFields(field, simulation, &scene->injection);
+	}
+	if (gpu_support) clFinish(simulation->queue);
+	return wallTime() - start;
+}
+
+// Returns false if the engine isn't available on this machine
+bool benchmark(BenchScene kind, BenchEngine engine, int size,
+		const char* host) {
+	Simulation simulation;
+	Scene scene;
+	Field field;
+	initSimulation(&simulation);
+	memset(&scene, 0, sizeof(Scene));
+	simulation.width = size;
+	simulation.height = size;
+	simulation.threads = engine == BE_SCALAR ? 1
+			: min(max(simulation.threads, 1), MX_MAX_THREADS);
+
+	// The engine is chosen first, since CPU pools start with the fields
+	trying_gpu = engine == BE_OPENCL;
+	int saved = quietStdout();
+	bool ok = addBenchScene(&scene, &simulation, kind)
+			&& buildScene(&field, &scene, &simulation);
+	if (!ok) {
+		restoreStdout(saved);
+		fprintf(stderr, "Failed to set up %s scene at %dx%d\n",
+				scene_names[kind], size, size);
+		freeScene(&scene);
+		return false;
+	}
+	initOpenCL(&field, &scene, &simulation);
+	restoreStdout(saved);
+	if (engine == BE_OPENCL && !gpu_support) {
+		releaseOpenCL(&simulation);
+		freeFields(&field, &simulation);
+		freeScene(&scene);
+		return false;
+	}
+
+	long cells = (long)size * size;
+	int steps = (int)(MX_BENCH_CELL_STEPS / cells);
+	steps = min(max(steps, MX_BENCH_MIN_STEPS), MX_BENCH_MAX_STEPS);
+	runSteps(&field, &simulation, &scene, MX_BENCH_WARMUP_STEPS);
+	double seconds[MX_BENCH_REPEATS];
+	for (int r = 0; r < MX_BENCH_REPEATS; r++) {
+		seconds[r] = runSteps(&field, &simulation, &scene, steps);
+	}
+	qsort(seconds, MX_BENCH_REPEATS, sizeof(double), compareDoubles);
+
+	// Rates come from the median repeat; the best is kept for reference
+	double median = seconds[MX_BENCH_REPEATS / 2];
+	int threads = engine == BE_OPENCL ? 0 : simulation.pool != NULL
+			? simulation.pool->threads : 1;
+
+	// Achieved bandwidth assumes only compulsory traffic, as in the 
+	// roofline model, and is compared with the engine's roof
+	KernelCost e_cost = kernelCost(&simulation, PH_E);
+	KernelCost h_cost = kernelCost(&simulation, PH_H);
+	double bytes = e_cost.bytes + h_cost.bytes;
+	double flops = e_cost.flops + h_cost.flops;
+	double achieved = bytes * cells * steps / median;
+	double peak = enginePeak(engine, &simulation, threads);
+	printf("{\"schema\": %d, \"commit\": \"%s\", \"host\": \"%s\", "
+			"\"scene\": \"%s\", \"engine\": \"%s\", \"threads\": %d, "
+			"\"width\": %d, \"height\": %d, \"sources\": %d, "
+			"\"materials\": %d, \"steps\": %d, \"repeats\": %d, "
+			"\"ns_per_step\": %.1f, \"best_ns_per_step\": %.1f, "
+			"\"mcells_per_s\": %.2f, \"bytes_per_cell\": %.1f, "
+			"\"flops_per_cell\": %.1f, \"gb_per_s\": %.3f, "
+			"\"gflops\": %.3f, \"peak_gb_per_s\": %.3f, "
+			"\"peak_fraction\": %.3f}\n",
+			MX_BENCH_SCHEMA, MX_COMMIT, host, scene_names[kind],
+			engine_names[engine], threads, size, size, scene.sources.count,
+			scene.materials.count, steps, MX_BENCH_REPEATS,
+			median / steps * 1e9, seconds[0] / steps * 1e9,
+			cells * steps / median / 1e6, bytes, flops, achieved / 1e9,
+			flops * cells * steps / median / 1e9, peak / 1e9,
+			peak > 0 ? achieved / peak : 0);
+	fflush(stdout);
+
+	releaseOpenCL(&simulation);
+	freeFields(&field, &simulation);
+	freeScene(&scene);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	int sizes[] = {256, 512, 1024, 2048};
+	int nsizes = sizeof(sizes) / sizeof(int);
+	for (int a = 1; a < argc; a++) {
+		if (strcmp(argv[a], "--quick") == 0) {
+			nsizes = 2;
+		} else {
+			fprintf(stderr, "Usage: %s [--quick]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	char host[256] = "unknown";
+	gethostname(host, sizeof(host) - 1);
+	host[sizeof(host) - 1] = '\0';
+
+	// Skip the OpenCL engine for good once it turns out to be unavailable
+	bool have_gpu = true;
+	for (int s = 0; s < nsizes; s++) {
+		for (int kind = 0; kind < BS_MAX; kind++) {
+			for (int engine = 0; engine < BE_MAX; engine++) {
+				if (engine == BE_OPENCL && !have_gpu) continue;
+				if (!benchmark(kind, engine, sizes[s], host)
+						&& engine == BE_OPENCL) {
+					fprintf(stderr, "OpenCL unavailable - skipping the "
+							"opencl engine.\n");
+					have_gpu = false;
+				}
+			}
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
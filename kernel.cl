@@ -1,69 +1,357 @@
-__kernel void updateEFields(__global float* Hx, __global float* Hy, 
-		__global float* Ez, __global float* Epsilon, __global float* Mu, 
-		float dt, float dy, float dx, int width, int height, 
-		__global float* Sigma) {
-	int x = get_global_id(0);
-	int y = get_global_id(1);
-	int index = y * width + x;
+// The program is specialized when it is built. The grid size and layout,
+// tile size and step constants are -D options. Field grids hold ghost 
+// cells around the grid, with rows MX_PITCH floats apart and cell (0, 0) 
+// MX_ORIGIN floats in, so neighbors past the edge are always in bounds.
+inline int fieldCell(int x, int y) {
+	return MX_ORIGIN + y * MX_PITCH + x;
+}
+
+// Each field update variant is launched over the list of tiles whose every
+// cell it handles exactly: work item (i, j) takes row j, column 
+// i % MX_TILE of tile i / MX_TILE. Cells within ring of the grid's edge 
+// are skipped: the E updates leave Ez on the outer ring alone, as the CPU
+// engines do, except along periodic axes, whose edges wrap, and at mirror
+// planes, which take the far edge's place. MX_PERIODIC_X and MX_PERIODIC_Y
+// flag the periodic axes, and MX_BLOCH_X and MX_BLOCH_Y give the sign the 
+// fields take across them. MX_MIRROR_X and MX_MIRROR_Y are 1 or -1 where 
+// Ez is even or odd in a mirror plane, and 0 where there is none.
+#define MX_WALLS_X (MX_PERIODIC_X ? 0 : MX_MIRROR_X ? 1 : 2)
+#define MX_WALLS_Y (MX_PERIODIC_Y ? 0 : MX_MIRROR_Y ? 1 : 2)
 
-	Ez[index] += (dt / Epsilon[index]) * ((Hy[index] - Hy[index - 1])
-			/ dx - (Hx[index] - Hx[(y - 1) * width + x]) / dy)
-			- (dt * Sigma[index] * Ez[index] / Epsilon[index]);
+inline int2 tilePos(__global const int* tiles) {
+	int tile = get_global_id(0) / MX_TILE;
+	return (int2)(tiles[2 * tile] + get_global_id(0) % MX_TILE, 
+			tiles[2 * tile + 1] + get_global_id(1));
 }
 
-__kernel void updateHFields(__global float* Hx, __global float* Hy, 
-		__global float* Ez, __global float* Epsilon, __global float* Mu, 
-		float dt, float dy, float dx, int width, int height) {
-	int x = get_global_id(0);
-	int y = get_global_id(1);
-	int index = y * width + x;
+inline int tileCell(__global const int* tiles, int ring) {
+	int2 p = tilePos(tiles);
+	int rx = MX_PERIODIC_X ? 0 : ring;
+	int ry = MX_PERIODIC_Y ? 0 : ring;
+	if (p.x < rx || p.y < ry || p.x >= MX_WIDTH - (MX_MIRROR_X ? 0 : rx) 
+			|| p.y >= MX_HEIGHT - (MX_MIRROR_Y ? 0 : ry)) {
+		return -1;
+	}
+	return fieldCell(p.x, p.y);
+}
 
-	Hx[index] -= dt / (Mu[index] * dy) * (Ez[index + width] - Ez[index]);
-	Hy[index] += dt / (Mu[index] * dx) * (Ez[index + 1] - Ez[index]);
+// The ghost cells beyond periodic edges mirror the far edge: H before the
+// E update, which reads it to the left and above, and Ez before the H 
+// update, which reads it to the right and below. Past a mirror plane, the
+// Ez ghosts reflect the last cells instead.
+__kernel void wrapH(__global float* Hx, __global float* Hy) {
+	int i = get_global_id(0);
+	if (MX_PERIODIC_X && i < MX_HEIGHT) {
+		Hy[fieldCell(-1, i)] = MX_BLOCH_X * Hy[fieldCell(MX_WIDTH - 1, i)];
+	}
+	if (MX_PERIODIC_Y && i < MX_WIDTH) {
+		Hx[fieldCell(i, -1)] = MX_BLOCH_Y * Hx[fieldCell(i, MX_HEIGHT - 1)];
+	}
 }
 
-__kernel void visualizeTE1(__global float* image, __global float* Hx, 
-		__global float* Hy, __global float* Ez, float minField, 
-		float maxField, int width) {
-	int x = get_global_id(0);
-	int y = get_global_id(1);
-	int index = y * width + x;
-	
-	float normVal = (Ez[index] - minField) / (maxField - minField);
+__kernel void wrapEz(__global float* Ez) {
+	int i = get_global_id(0);
+	if (MX_PERIODIC_X && i < MX_HEIGHT) {
+		Ez[fieldCell(MX_WIDTH, i)] = MX_BLOCH_X * Ez[fieldCell(0, i)];
+	} else if (MX_MIRROR_X && i < MX_HEIGHT) {
+		Ez[fieldCell(MX_WIDTH, i)] = MX_MIRROR_X 
+				* Ez[fieldCell(MX_WIDTH - 1, i)];
+	}
+	if (MX_PERIODIC_Y && i < MX_WIDTH) {
+		Ez[fieldCell(i, MX_HEIGHT)] = MX_BLOCH_Y * Ez[fieldCell(i, 0)];
+	} else if (MX_MIRROR_Y && i < MX_WIDTH) {
+		Ez[fieldCell(i, MX_HEIGHT)] = MX_MIRROR_Y 
+				* Ez[fieldCell(i, MX_HEIGHT - 1)];
+	}
+}
+
+inline float curlH(__global const float* Hx, __global const float* Hy, 
+		int index) {
+	return (Hy[index] - Hy[index - 1]) / MX_DX 
+			- (Hx[index] - Hx[index - MX_PITCH]) / MX_DY;
+}
+
+// Vacuum: epsilon is the free-space value and there is no loss
+__kernel void updateEVacuum(__global const float* Hx, 
+		__global const float* Hy, __global float* Ez, 
+		__global const float* Epsilon, __global const float* Sigma, 
+		__global const int* tiles) {
+	int index = tileCell(tiles, 1);
+	if (index < 0) return;
+
+	Ez[index] += (MX_DT / MX_EPS0) * curlH(Hx, Hy, index);
+}
+
+// Lossless dielectric: any epsilon, no conductivity
+__kernel void updateEDielectric(__global const float* Hx, 
+		__global const float* Hy, __global float* Ez, 
+		__global const float* Epsilon, __global const float* Sigma, 
+		__global const int* tiles) {
+	int index = tileCell(tiles, 1);
+	if (index < 0) return;
+
+	Ez[index] += (MX_DT / Epsilon[index]) * curlH(Hx, Hy, index);
+}
+
+// Lossy materials and the PML
+__kernel void updateELossy(__global const float* Hx, 
+		__global const float* Hy, __global float* Ez, 
+		__global const float* Epsilon, __global const float* Sigma, 
+		__global const int* tiles) {
+	int index = tileCell(tiles, 1);
+	if (index < 0) return;
+
+	Ez[index] += (MX_DT / Epsilon[index]) * curlH(Hx, Hy, index)
+			- (MX_DT * Sigma[index] * Ez[index] / Epsilon[index]);
+}
+
+inline void updateHCell(__global float* Hx, __global float* Hy, 
+		__global const float* Ez, float mu, int index) {
+	Hx[index] -= MX_DT / (mu * MX_DY) * (Ez[index + MX_PITCH] - Ez[index]);
+	Hy[index] += MX_DT / (mu * MX_DX) * (Ez[index + 1] - Ez[index]);
+}
+
+__kernel void updateHVacuum(__global float* Hx, __global float* Hy, 
+		__global const float* Ez, __global const float* Mu, 
+		__global const int* tiles) {
+	int index = tileCell(tiles, 0);
+	if (index < 0) return;
+
+	updateHCell(Hx, Hy, Ez, MX_MU0, index);
+}
+
+__kernel void updateHMaterial(__global float* Hx, __global float* Hy, 
+		__global const float* Ez, __global const float* Mu, 
+		__global const int* tiles) {
+	int index = tileCell(tiles, 0);
+	if (index < 0) return;
+
+	updateHCell(Hx, Hy, Ez, Mu[index], index);
+}
+
+// Flags the tiles of the list holding any nonzero field. The flags are 
+// cleared beforehand, and tiles are numbered row by row.
+__kernel void markLiveTiles(__global const float* Ez, 
+		__global const float* Hx, __global const float* Hy, 
+		__global const int* tiles, __global int* live) {
+	int2 p = tilePos(tiles);
+	if (p.x >= MX_WIDTH || p.y >= MX_HEIGHT) return;
+	int index = fieldCell(p.x, p.y);
+	if (Ez[index] != 0 || Hx[index] != 0 || Hy[index] != 0) {
+		live[p.y / MX_TILE * ((MX_WIDTH + MX_TILE - 1) / MX_TILE) 
+				+ p.x / MX_TILE] = 1;
+	}
+}
+
+// Reference for the roofline report: a plain copy sets the device's
+// achievable bandwidth
+__kernel void copyBuffer(__global const float* src, __global float* dst) {
+	int i = get_global_id(0);
+	dst[i] = src[i];
+}
+
+inline void colorTE1(__global float* image, int index, float ez, 
+		float minField, float maxField) {
+	float normVal = (ez - minField) / (maxField - minField);
 	image[3 * index] = normVal < 0.5 ? 2 * normVal : 2 * (1 - normVal);
 	image[3 * index + 1] = normVal > 0.5 ? 2 * (normVal - 0.5) : 0.0;
 	image[3 * index + 2] = normVal < 0.5 ? 2 * normVal : 1.0;
 }
 
-__kernel void visualizeTE2(__global float* image, __global float* Hx, 
-		__global float* Hy, __global float* Ez, float minField, 
-		float maxField, int width) {
-	int x = get_global_id(0);
-	int y = get_global_id(1);
-	int index = y * width + x;
-
-	image[3 * index] = (Ez[index]*Ez[index] - minField) 
-			/ (maxField - minField);
-	image[3 * index + 1] = (Hx[index]*Hx[index] - minField) 
-			/ (maxField - minField);
-	image[3 * index + 2] = (Hy[index]*Hy[index] - minField)
-			/ (maxField - minField);
+inline void colorTE2(__global float* image, int index, float ez, float hx,
+		float hy, float minField, float maxField) {
+	image[3 * index] = (ez*ez - minField) / (maxField - minField);
+	image[3 * index + 1] = (hx*hx - minField) / (maxField - minField);
+	image[3 * index + 2] = (hy*hy - minField) / (maxField - minField);
 }
 
-__kernel void drawMaterialBoundaries(__global float* image, 
-		__global float* boundMask, int width) {
-	int x = get_global_id(0);
-	int y = get_global_id(1);
-	int index = y * width + x;
+// Material boundaries are drawn in black or white, whichever stands out 
+// from the pixel beneath
+inline void overlayBoundary(__global float* image, 
+		__global const uint* boundMask, int maskPitch, int x, int y, 
+		int index) {
+	if (((boundMask[y * maskPitch + x / 32] >> (x % 32)) & 1) == 0) return;
 
 	float maskColor = 0;
 	float L = (image[3 * index] + image[3 * index + 1] 
 			+ image[3 * index + 2]) / 3;
 	if (L < 0.5) maskColor = 1;
+	image[3 * index] = maskColor;
+	image[3 * index + 1] = maskColor;
+	image[3 * index + 2] = maskColor;
+}
 
-	if (boundMask[index] == 1) {
-		image[3 * index] = maskColor;
-		image[3 * index + 1] = maskColor;
-		image[3 * index + 2] = maskColor;
+// The image shows the grid and its reflections in any mirror planes. The 
+// bits of m pick the planes to reflect in, bit 0 for x and bit 1 for y, 
+// and reflection 0 is the cell itself.
+#define MX_IMAGE_WIDTH (MX_MIRROR_X ? 2 * MX_WIDTH : MX_WIDTH)
+
+inline bool hasReflection(int m) {
+	return (!(m & 1) || MX_MIRROR_X) && (!(m & 2) || MX_MIRROR_Y);
+}
+
+inline int reflectPixel(int2 p, int m) {
+	int x = m & 1 ? 2 * MX_WIDTH - 1 - p.x : p.x;
+	int y = m & 2 ? 2 * MX_HEIGHT - 1 - p.y : p.y;
+	return y * MX_IMAGE_WIDTH + x;
+}
+
+// The fields of a reflection, as (Ez, Hx, Hy). Hx and Hy lie half a cell 
+// above and right of Ez, so their reflections come from the cell below or
+// to the left.
+inline float3 reflectFields(__global const float* Hx, 
+		__global const float* Hy, __global const float* Ez, int index, 
+		int m) {
+	float sx = m & 1 ? MX_MIRROR_X : 1;
+	float sy = m & 2 ? MX_MIRROR_Y : 1;
+	return (float3)(sx * sy * Ez[index], 
+			sx * (m & 2 ? -sy : 1) * Hx[index - (m & 2 ? MX_PITCH : 0)],
+			(m & 1 ? -sx : 1) * sy * Hy[index - (m & 1)]);
+}
+
+__kernel void visualizeTE1(__global float* image, __global float* Hx, 
+		__global float* Hy, __global float* Ez, float minField, 
+		float maxField, int width, int height) {
+	int2 p = (int2)(get_global_id(0), get_global_id(1));
+	if (p.x >= width || p.y >= height) return;
+
+	for (int m = 0; m < 4; m++) {
+		if (!hasReflection(m)) continue;
+		colorTE1(image, reflectPixel(p, m), reflectFields(Hx, Hy, Ez, 
+				fieldCell(p.x, p.y), m).x, minField, maxField);
+	}
+}
+
+__kernel void visualizeTE2(__global float* image, __global float* Hx, 
+		__global float* Hy, __global float* Ez, float minField, 
+		float maxField, int width, int height) {
+	int2 p = (int2)(get_global_id(0), get_global_id(1));
+	if (p.x >= width || p.y >= height) return;
+
+	for (int m = 0; m < 4; m++) {
+		if (!hasReflection(m)) continue;
+		float3 f = reflectFields(Hx, Hy, Ez, fieldCell(p.x, p.y), m);
+		colorTE2(image, reflectPixel(p, m), f.x, f.y, f.z, minField, 
+				maxField);
+	}
+}
+
+__kernel void drawMaterialBoundaries(__global float* image, 
+		__global const uint* boundMask, int width, int maskPitch, 
+		int height) {
+	int2 p = (int2)(get_global_id(0), get_global_id(1));
+	if (p.x >= width || p.y >= height) return;
+
+	for (int m = 0; m < 4; m++) {
+		if (!hasReflection(m)) continue;
+		overlayBoundary(image, boundMask, maskPitch, p.x, p.y, 
+				reflectPixel(p, m));
+	}
+}
+
+// The last H update of a frame can color each cell's pixel while its 
+// fields are at hand, sparing visualization a pass over the grids. With 
+// MX_PEC, the walls that are zeroed after the update are shown as zero.
+inline void emitPixel(__global float* image, __global const uint* boundMask,
+		int maskPitch, __global const float* Hx, __global const float* Hy, 
+		__global const float* Ez, int2 p, int index, int vis, int overlay, 
+		float minField, float maxField) {
+	bool wall = false;
+#if MX_PEC
+	wall = (MX_WALLS_X > 0 && p.x == 0) 
+			|| (MX_WALLS_X > 1 && p.x == MX_WIDTH - 1)
+			|| (MX_WALLS_Y > 0 && p.y == 0) 
+			|| (MX_WALLS_Y > 1 && p.y == MX_HEIGHT - 1);
+#endif
+	for (int m = 0; m < 4; m++) {
+		if (!hasReflection(m)) continue;
+		float3 f = wall ? (float3)(0) : reflectFields(Hx, Hy, Ez, index, m);
+		int pixel = reflectPixel(p, m);
+		if (vis == 0) {
+			colorTE1(image, pixel, f.x, minField, maxField);
+		} else {
+			colorTE2(image, pixel, f.x, f.y, f.z, minField, maxField);
+		}
+		if (overlay) {
+			overlayBoundary(image, boundMask, maskPitch, p.x, p.y, pixel);
+		}
+	}
+}
+
+__kernel void updateHVacuumImage(__global float* Hx, __global float* Hy, 
+		__global const float* Ez, __global const float* Mu, 
+		__global const int* tiles, __global float* image, 
+		__global const uint* boundMask, int maskPitch, int vis, 
+		int overlay, float minField, float maxField) {
+	int index = tileCell(tiles, 0);
+	if (index < 0) return;
+
+	updateHCell(Hx, Hy, Ez, MX_MU0, index);
+	emitPixel(image, boundMask, maskPitch, Hx, Hy, Ez, tilePos(tiles), 
+			index, vis, overlay, minField, maxField);
+}
+
+__kernel void updateHMaterialImage(__global float* Hx, __global float* Hy, 
+		__global const float* Ez, __global const float* Mu, 
+		__global const int* tiles, __global float* image, 
+		__global const uint* boundMask, int maskPitch, int vis, 
+		int overlay, float minField, float maxField) {
+	int index = tileCell(tiles, 0);
+	if (index < 0) return;
+
+	updateHCell(Hx, Hy, Ez, Mu[index], index);
+	emitPixel(image, boundMask, maskPitch, Hx, Hy, Ez, tilePos(tiles), 
+			index, vis, overlay, minField, maxField);
+}
+
+// Zeroes the fields on the grid's outer edge, one cell per work item: the 
+// bottom and top rows first, then the left and right ends of the rows 
+// between them. Periodic edges and mirror planes have no wall.
+__kernel void applyPEC(__global float* Ez, __global float* Hx, 
+		__global float* Hy, int width, int height) {
+	int i = get_global_id(0);
+	int index;
+	if (i < MX_WALLS_Y * width) {
+		index = fieldCell(i % width, i / width * (height - 1));
+	} else if (MX_WALLS_X == 2) {
+		i -= MX_WALLS_Y * width;
+		index = fieldCell((i % 2) * (width - 1), (MX_WALLS_Y > 0) + i / 2);
+	} else {
+		i -= MX_WALLS_Y * width;
+		index = fieldCell(0, (MX_WALLS_Y > 0) + i);
+	}
+
+	Ez[index] = 0;
+	Hx[index] = 0;
+	Hy[index] = 0;
+}
+
+__kernel void injectSources(__global float* field, __global const int* cells,
+		__global const int* first, __global float* phasorRe, 
+		__global float* phasorIm, __global const float* rotationRe, 
+		__global const float* rotationIm, __global const float* amplitude, 
+		__global const int* ramp, __global const int* tableFirst, 
+		__global const int* tableOffset, __global const int* tableLength, 
+		__global const float* samples, int sample) {
+	int c = get_global_id(0);
+
+	float sum = 0;
+	for (int s = first[c]; s < first[c + 1]; s++) {
+		float re = phasorRe[s];
+		float im = phasorIm[s];
+		float ease = sample < ramp[s] 
+				? 0.5f - 0.5f * cospi((float)sample / ramp[s]) : 1;
+		sum += ease * amplitude[s] * im;
+
+		// Advance by one step, pulling the magnitude back towards 1
+		float nextRe = re * rotationRe[s] - im * rotationIm[s];
+		float nextIm = re * rotationIm[s] + im * rotationRe[s];
+		float norm = 1.5f - 0.5f * (nextRe * nextRe + nextIm * nextIm);
+		phasorRe[s] = nextRe * norm;
+		phasorIm[s] = nextIm * norm;
+	}
+	for (int w = tableFirst[c]; w < tableFirst[c + 1]; w++) {
+		if (sample < tableLength[w]) sum += samples[tableOffset[w] + sample];
 	}
+	field[MX_ORIGIN + cells[c]] += sum;
 }
@@ -6,7 +6,16 @@ bool cycle_vis = false;
 bool draw_material_boundaries = true;
 bool report_framerate = false;
 bool just_resumed = false;
+bool probe_requested = false;
+bool toggle_profiling = false;
+double probe_x, probe_y;
 bool gpu_support = true;
+
+// The CPUs this process may use, captured before any thread is pinned, and
+// the same CPUs grouped by socket
+cpu_set_t process_cpus;
+int cpu_order[MX_MAX_THREADS];
+int cpu_count = 0;
 bool trying_gpu = true;
 
 int min(int a, int b) {
@@ -17,6 +26,1028 @@ int max (int a, int b) {
 	return a ^ ((a ^ b) & -(a < b));
 }
 
+void markBoundary(Simulation* simulation, int x, int y) {
+	simulation->matBoundMask[y * simulation->mask_pitch 
+			+ x / MX_MASK_WORD_BITS] |= 1u << (x % MX_MASK_WORD_BITS);
+}
+
+bool isBoundary(Simulation* simulation, int x, int y) {
+	return (simulation->matBoundMask[y * simulation->mask_pitch 
+			+ x / MX_MASK_WORD_BITS] >> (x % MX_MASK_WORD_BITS)) & 1;
+}
+
+int nextCapacity(int capacity) {
+	return capacity < MX_SCENE_MIN_CAPACITY ? MX_SCENE_MIN_CAPACITY 
+			: 2 * capacity;
+}
+
+bool resizeArray(void** array, int capacity, size_t size) {
+	// On failure the array is left untouched at its old size
+	void* resized = realloc(*array, (size_t)capacity * size);
+	if (resized == NULL) return false;
+	*array = resized;
+	return true;
+}
+
+int addMaterial(MaterialTable* materials, MaterialGeometry geom, 
+		float rel_eps, float rel_mu, float sigma, int param, 
+		BoundingBox bbox) {
+	if (materials->count == materials->capacity) {
+		int capacity = nextCapacity(materials->capacity);
+		if (!resizeArray((void**)&materials->geom, capacity, 
+				sizeof(MaterialGeometry))
+				|| !resizeArray((void**)&materials->param, capacity, 
+				sizeof(int))
+				|| !resizeArray((void**)&materials->rel_eps, capacity, 
+				sizeof(float))
+				|| !resizeArray((void**)&materials->rel_mu, capacity, 
+				sizeof(float))
+				|| !resizeArray((void**)&materials->sigma, capacity, 
+				sizeof(float))
+				|| !resizeArray((void**)&materials->bbox, capacity, 
+				sizeof(BoundingBox))) {
+			return -1;
+		}
+		materials->capacity = capacity;
+	}
+
+	int m = materials->count++;
+	materials->geom[m] = geom;
+	materials->param[m] = param;
+	materials->rel_eps[m] = rel_eps;
+	materials->rel_mu[m] = rel_mu;
+	materials->sigma[m] = sigma;
+	materials->bbox[m] = bbox;
+	return m;
+}
+
+int addTriangle(MaterialTable* materials, float rel_eps, float rel_mu, 
+		float sigma, TriangleParams triangle) {
+	if (materials->trianglec == materials->triangle_capacity) {
+		int capacity = nextCapacity(materials->triangle_capacity);
+		if (!resizeArray((void**)&materials->triangles, capacity, 
+				sizeof(TriangleParams))) {
+			return -1;
+		}
+		materials->triangle_capacity = capacity;
+	}
+
+	BoundingBox bbox;
+	bbox.x0 = min(triangle.x1, min(triangle.x2, triangle.x3));
+	bbox.y0 = min(triangle.y1, min(triangle.y2, triangle.y3));
+	bbox.x1 = max(triangle.x1, max(triangle.x2, triangle.x3));
+	bbox.y1 = max(triangle.y1, max(triangle.y2, triangle.y3));
+
+	int m = addMaterial(materials, MG_TRIANGLE, rel_eps, rel_mu, sigma, 
+			materials->trianglec, bbox);
+	if (m >= 0) materials->triangles[materials->trianglec++] = triangle;
+	return m;
+}
+
+int addCircle(MaterialTable* materials, float rel_eps, float rel_mu, 
+		float sigma, CircleParams circle) {
+	if (materials->circlec == materials->circle_capacity) {
+		int capacity = nextCapacity(materials->circle_capacity);
+		if (!resizeArray((void**)&materials->circles, capacity, 
+				sizeof(CircleParams))) {
+			return -1;
+		}
+		materials->circle_capacity = capacity;
+	}
+
+	// The boundary ring |d - R| < 1 never reaches past |R| in whole cells,
+	// so the same box covers the disc and its boundary
+	BoundingBox bbox;
+	bbox.x0 = circle.x - abs(circle.R);
+	bbox.y0 = circle.y - abs(circle.R);
+	bbox.x1 = circle.x + abs(circle.R);
+	bbox.y1 = circle.y + abs(circle.R);
+
+	int m = addMaterial(materials, MG_CIRCLE, rel_eps, rel_mu, sigma, 
+			materials->circlec, bbox);
+	if (m >= 0) materials->circles[materials->circlec++] = circle;
+	return m;
+}
+
+uint64_t hashBytes(uint64_t hash, const void* data, size_t length) {
+	// 64-bit FNV-1a
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= MX_FNV_PRIME;
+	}
+	return hash;
+}
+
+// Hash of a file's device, inode, size and modification time, which 
+// changes whenever the file is written or replaced
+uint64_t fileIdentity(struct stat* info) {
+	uint64_t hash = hashBytes(MX_FNV_OFFSET, &info->st_dev, 
+			sizeof(info->st_dev));
+	hash = hashBytes(hash, &info->st_ino, sizeof(info->st_ino));
+	hash = hashBytes(hash, &info->st_size, sizeof(info->st_size));
+	return hashBytes(hash, &info->st_mtim, sizeof(info->st_mtim));
+}
+
+bool openMaterialMap(MaterialMap* map, const char* path, 
+		Simulation* simulation) {
+	int fd = open(path, O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+		fprintf(stderr, "Error: Failed to open material map %s\n", path);
+		if (fd >= 0) close(fd);
+		return false;
+	}
+
+	map->identity = fileIdentity(&info);
+
+	map->length = info.st_size;
+	map->mapping = mmap(NULL, map->length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map->mapping == MAP_FAILED) {
+		fprintf(stderr, "Error: Failed to map material map %s\n", path);
+		map->mapping = NULL;
+		return false;
+	}
+
+	// Files either start with a header giving their size and format, or are
+	// raw values covering the placement (by default the whole grid)
+	GridType type = map->quantity == MQ_INDEXED ? GT_UINT8 : GT_FLOAT32;
+	size_t offset = 0;
+	map->si_units = false;
+	if (map->length >= MX_GRID_HEADER_BYTES 
+			&& memcmp(map->mapping, MX_GRID_MAGIC, 4) == 0) {
+		uint32_t header[4];
+		memcpy(header, map->mapping + 4, sizeof(header));
+		map->file_width = header[0] <= INT_MAX ? (int)header[0] : 0;
+		map->file_height = header[1] <= INT_MAX ? (int)header[1] : 0;
+		map->si_units = header[3] & MX_GRID_SI_UNITS;
+		offset = MX_GRID_HEADER_BYTES;
+		if (header[2] != type) {
+			fprintf(stderr, "Error: Material map %s holds %s values\n", 
+					path, header[2] == GT_FLOAT32 ? "float" 
+					: header[2] == GT_UINT8 ? "indexed" : "unknown");
+			munmap(map->mapping, map->length);
+			map->mapping = NULL;
+			return false;
+		}
+	} else {
+		map->file_width = map->width > 0 ? map->width : simulation->width;
+		map->file_height = map->height > 0 ? map->height 
+				: simulation->height;
+	}
+	if (map->width <= 0) map->width = map->file_width;
+	if (map->height <= 0) map->height = map->file_height;
+	map->type = type;
+	map->data = map->mapping + offset;
+
+	size_t cells = (size_t)max(map->file_width, 0) * max(map->file_height, 0);
+	size_t bytes = cells * (type == GT_UINT8 ? sizeof(uint8_t) 
+			: sizeof(float));
+	if (map->file_width <= 0 || map->file_height <= 0 
+			|| map->width <= 0 || map->height <= 0 
+			|| map->length - offset < bytes 
+			|| (offset == 0 && map->length != bytes)) {
+		fprintf(stderr, "Error: Size of material map %s doesn't match its "
+				"%dx%d grid\n", path, map->file_width, map->file_height);
+		munmap(map->mapping, map->length);
+		map->mapping = NULL;
+		return false;
+	}
+	madvise(map->mapping, map->length, MADV_SEQUENTIAL);
+	return true;
+}
+
+int addMaterialMap(MapTable* maps, MaterialMap map) {
+	if (maps->count == maps->capacity) {
+		int capacity = nextCapacity(maps->capacity);
+		if (!resizeArray((void**)&maps->maps, capacity, 
+				sizeof(MaterialMap))) {
+			return -1;
+		}
+		maps->capacity = capacity;
+	}
+	maps->maps[maps->count] = map;
+	return maps->count++;
+}
+
+bool setMapIndex(MapTable* maps, int i, float rel_eps, float rel_mu, 
+		float sigma) {
+	if (i < 0 || i >= MX_MAP_PALETTE) return false;
+	maps->palette_set[i] = true;
+	maps->palette_eps[i] = rel_eps;
+	maps->palette_mu[i] = rel_mu;
+	maps->palette_sigma[i] = sigma;
+	return true;
+}
+
+uint64_t sceneCacheKey(Scene* scene, Simulation* simulation) {
+	MaterialTable* materials = &scene->materials;
+	MapTable* maps = &scene->maps;
+	int version = MX_CACHE_VERSION;
+
+	// Everything that feeds rasterization, except the thread count, which
+	// doesn't change the result
+	uint64_t hash = hashBytes(MX_FNV_OFFSET, &version, sizeof(int));
+	hash = hashBytes(hash, &simulation->width, sizeof(int));
+	hash = hashBytes(hash, &simulation->height, sizeof(int));
+	hash = hashBytes(hash, &simulation->dx, sizeof(simulation->dx));
+	hash = hashBytes(hash, &simulation->dy, sizeof(simulation->dy));
+	hash = hashBytes(hash, &simulation->boundary_condition, 
+			sizeof(BoundaryCondition));
+	hash = hashBytes(hash, &simulation->pml_layers, sizeof(int));
+	hash = hashBytes(hash, &simulation->pml_conductivity, sizeof(float));
+	hash = hashBytes(hash, &simulation->pml_sigma_polyorder, sizeof(int));
+	hash = hashBytes(hash, simulation->periodic, sizeof(simulation->periodic));
+	hash = hashBytes(hash, simulation->mirrored, sizeof(simulation->mirrored));
+	hash = hashBytes(hash, &simulation->smoothing, sizeof(int));
+
+	hash = hashBytes(hash, &materials->count, sizeof(int));
+	hash = hashBytes(hash, materials->geom, 
+			materials->count * sizeof(MaterialGeometry));
+	hash = hashBytes(hash, materials->param, materials->count * sizeof(int));
+	hash = hashBytes(hash, materials->rel_eps, 
+			materials->count * sizeof(float));
+	hash = hashBytes(hash, materials->rel_mu, 
+			materials->count * sizeof(float));
+	hash = hashBytes(hash, materials->sigma, 
+			materials->count * sizeof(float));
+	hash = hashBytes(hash, materials->triangles, 
+			materials->trianglec * sizeof(TriangleParams));
+	hash = hashBytes(hash, materials->circles, 
+			materials->circlec * sizeof(CircleParams));
+
+	// Map files are identified by their metadata rather than read in full
+	hash = hashBytes(hash, &maps->count, sizeof(int));
+	for (int j = 0; j < maps->count; j++) {
+		MaterialMap* map = &maps->maps[j];
+		hash = hashBytes(hash, &map->quantity, sizeof(MapQuantity));
+		hash = hashBytes(hash, &map->type, sizeof(GridType));
+		hash = hashBytes(hash, &map->si_units, sizeof(bool));
+		hash = hashBytes(hash, &map->file_width, sizeof(int));
+		hash = hashBytes(hash, &map->file_height, sizeof(int));
+		hash = hashBytes(hash, &map->x, sizeof(int));
+		hash = hashBytes(hash, &map->y, sizeof(int));
+		hash = hashBytes(hash, &map->width, sizeof(int));
+		hash = hashBytes(hash, &map->height, sizeof(int));
+		hash = hashBytes(hash, &map->identity, sizeof(uint64_t));
+	}
+	hash = hashBytes(hash, maps->palette_set, sizeof(maps->palette_set));
+	hash = hashBytes(hash, maps->palette_eps, sizeof(maps->palette_eps));
+	hash = hashBytes(hash, maps->palette_mu, sizeof(maps->palette_mu));
+	hash = hashBytes(hash, maps->palette_sigma, sizeof(maps->palette_sigma));
+	return hash;
+}
+
+char* sceneCachePath(SceneCache* cache, const char* suffix) {
+	size_t length = strlen(cache->dir) + strlen(suffix) + 32;
+	char* path = (char*)malloc(length);
+	if (path != NULL) {
+		snprintf(path, length, "%s/%016llx.mxc%s", cache->dir, 
+				(unsigned long long)cache->key, suffix);
+	}
+	return path;
+}
+
+// Floats in one grid of the field arena, ghost cells included
+size_t gridFloats(Simulation* simulation) {
+	return (size_t)simulation->pitch * (simulation->height + 2);
+}
+
+size_t sceneCacheLength(Simulation* simulation) {
+	return sizeof(SceneCacheHeader) + sizeof(float) * MX_MAP_GRIDS 
+			* gridFloats(simulation) + sizeof(uint32_t) 
+			* simulation->mask_pitch * simulation->height;
+}
+
+// Written to a temporary file and renamed into place, so that concurrent 
+// runs never see a partial cache
+void saveSceneCache(SceneCache* cache, Field* field, 
+		Simulation* simulation) {
+	char* path = sceneCachePath(cache, "");
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%d", (int)getpid());
+	char* temp_path = sceneCachePath(cache, suffix);
+	if (path == NULL || temp_path == NULL) {
+		free(path);
+		free(temp_path);
+		return;
+	}
+
+	SceneCacheHeader header;
+	memset(&header, 0, sizeof(SceneCacheHeader));
+	memcpy(header.magic, MX_CACHE_MAGIC, 4);
+	header.version = MX_CACHE_VERSION;
+	header.key = cache->key;
+	header.width = simulation->width;
+	header.height = simulation->height;
+	header.mask_pitch = simulation->mask_pitch;
+	header.pitch = simulation->pitch;
+
+	// The material grids are adjacent in the arena, so they are stored as 
+	// one block laid out as they are there, row padding and ghost cells 
+	// included
+	size_t floats = MX_MAP_GRIDS * gridFloats(simulation);
+	size_t words = (size_t)simulation->mask_pitch * simulation->height;
+	mkdir(cache->dir, 0755);
+	FILE* cache_file = fopen(temp_path, "wb");
+	bool ok = cache_file != NULL 
+			&& fwrite(&header, sizeof(SceneCacheHeader), 1, cache_file) == 1
+			&& fwrite(field->Epsilon - simulation->origin, sizeof(float), 
+			floats, cache_file) == floats;
+	ok = ok && fwrite(simulation->matBoundMask, sizeof(uint32_t), words, 
+			cache_file) == words;
+	if (cache_file != NULL && fclose(cache_file) != 0) ok = false;
+	if (ok && rename(temp_path, path) == 0) {
+		printf("Saved rasterized materials to %s\n", path);
+	} else {
+		fprintf(stderr, "Warning: Failed to write scene cache %s\n", path);
+		remove(temp_path);
+	}
+	free(path);
+	free(temp_path);
+}
+
+int addSource(SourceTable* sources, SourceFunction fxn, FieldComponent fc, 
+		int x, int y, int param) {
+	if (sources->count == sources->capacity) {
+		int capacity = nextCapacity(sources->capacity);
+		if (!resizeArray((void**)&sources->fxn, capacity, 
+				sizeof(SourceFunction))
+				|| !resizeArray((void**)&sources->fc, capacity, 
+				sizeof(FieldComponent))
+				|| !resizeArray((void**)&sources->x, capacity, sizeof(int))
+				|| !resizeArray((void**)&sources->y, capacity, sizeof(int))
+				|| !resizeArray((void**)&sources->param, capacity, 
+				sizeof(int))) {
+			return -1;
+		}
+		sources->capacity = capacity;
+	}
+
+	int i = sources->count++;
+	sources->fxn[i] = fxn;
+	sources->fc[i] = fc;
+	sources->x[i] = x;
+	sources->y[i] = y;
+	sources->param[i] = param;
+	return i;
+}
+
+int addSineLinFreq(SourceTable* sources, FieldComponent fc, int x, int y, 
+		SineLinFreqParams sine) {
+	if (sources->sinec == sources->sine_capacity) {
+		int capacity = nextCapacity(sources->sine_capacity);
+		if (!resizeArray((void**)&sources->sines, capacity, 
+				sizeof(SineLinFreqParams))) {
+			return -1;
+		}
+		sources->sine_capacity = capacity;
+	}
+
+	int i = addSource(sources, SINELINFREQ, fc, x, y, sources->sinec);
+	if (i >= 0) sources->sines[sources->sinec++] = sine;
+	return i;
+}
+
+int addPulse(SourceTable* sources, SourceFunction fxn, FieldComponent fc, 
+		int x, int y, PulseParams pulse) {
+	if (sources->pulsec == sources->pulse_capacity) {
+		int capacity = nextCapacity(sources->pulse_capacity);
+		if (!resizeArray((void**)&sources->pulses, capacity, 
+				sizeof(PulseParams))) {
+			return -1;
+		}
+		sources->pulse_capacity = capacity;
+	}
+
+	int i = addSource(sources, fxn, fc, x, y, sources->pulsec);
+	if (i >= 0) sources->pulses[sources->pulsec++] = pulse;
+	return i;
+}
+
+bool loadWaveFile(SourceTable* sources, const char* path, 
+		WaveFileParams* file) {
+	FILE* wave_file = fopen(path, "r");
+	if (wave_file == NULL) {
+		fprintf(stderr, "Error: Failed to open waveform file %s\n", path);
+		return false;
+	}
+
+	// Samples are whitespace-separated values, appended to the shared pool
+	float sample;
+	file->first = sources->samplec;
+	file->count = 0;
+	while (fscanf(wave_file, "%f", &sample) == 1) {
+		if (sources->samplec == sources->sample_capacity) {
+			int capacity = nextCapacity(sources->sample_capacity);
+			if (!resizeArray((void**)&sources->file_samples, capacity, 
+					sizeof(float))) {
+				fprintf(stderr, "Failed to allocate memory for waveform "
+						"file %s\n", path);
+				fclose(wave_file);
+				return false;
+			}
+			sources->sample_capacity = capacity;
+		}
+		sources->file_samples[sources->samplec++] = sample;
+		file->count++;
+	}
+	if (!feof(wave_file) || file->count == 0) {
+		fprintf(stderr, "Error: Invalid waveform file %s\n", path);
+		fclose(wave_file);
+		return false;
+	}
+	fclose(wave_file);
+	return true;
+}
+
+int addWaveFile(SourceTable* sources, FieldComponent fc, int x, int y, 
+		WaveFileParams file) {
+	if (sources->filec == sources->file_capacity) {
+		int capacity = nextCapacity(sources->file_capacity);
+		if (!resizeArray((void**)&sources->files, capacity, 
+				sizeof(WaveFileParams))) {
+			return -1;
+		}
+		sources->file_capacity = capacity;
+	}
+
+	int i = addSource(sources, WAVEFILE, fc, x, y, sources->filec);
+	if (i >= 0) sources->files[sources->filec++] = file;
+	return i;
+}
+
+int addLineSource(SourceTable* sources, LineSourceParams line) {
+	if (sources->linec == sources->line_capacity) {
+		int capacity = nextCapacity(sources->line_capacity);
+		if (!resizeArray((void**)&sources->lines, capacity, 
+				sizeof(LineSourceParams))) {
+			return -1;
+		}
+		sources->line_capacity = capacity;
+	}
+
+	bool along_x = line.direction == LD_POS_Y || line.direction == LD_NEG_Y;
+	int i = addSource(sources, LINESOURCE, FC_EZ, 
+			along_x ? line.start : line.position, 
+			along_x ? line.position : line.start, sources->linec);
+	if (i >= 0) sources->lines[sources->linec++] = line;
+	return i;
+}
+
+int injectionGroup(FieldComponent fc) {
+	switch (fc) {
+		case FC_EZ:
+			return 0;
+		case FC_HX:
+			return 1;
+		case FC_HY:
+			return 2;
+		default:
+			return -1;
+	}
+}
+
+int compareInjectionKeys(const void* a, const void* b) {
+	const InjectionKey* ka = (const InjectionKey*)a;
+	const InjectionKey* kb = (const InjectionKey*)b;
+	if (ka->key != kb->key) return ka->key < kb->key ? -1 : 1;
+	return ka->source - kb->source;
+}
+
+double waveformSample(SourceTable* sources, int i, double t) {
+	PulseParams* pulse;
+	WaveFileParams* file;
+	double u, a, b;
+	int j;
+	switch (sources->fxn[i]) {
+		case GAUSSIANPULSE:
+			pulse = &sources->pulses[sources->param[i]];
+			u = (t - pulse->delay) / pulse->width;
+			return pulse->amplitude * exp(-u * u);
+		case MODULATEDGAUSSIAN:
+			pulse = &sources->pulses[sources->param[i]];
+			u = (t - pulse->delay) / pulse->width;
+			return pulse->amplitude * exp(-u * u) * sin(2 * M_PI 
+					* pulse->frequency * (t - pulse->delay) + pulse->phase);
+		case RICKER:
+			pulse = &sources->pulses[sources->param[i]];
+			u = M_PI * pulse->frequency * (t - pulse->delay);
+			u *= u;
+			return pulse->amplitude * (1 - 2 * u) * exp(-u);
+		case WAVEFILE:
+			// Interpolate linearly between samples, starting from zero
+			file = &sources->files[sources->param[i]];
+			u = t / file->period - 1;
+			j = (int)floor(u);
+			if (j < -1 || j >= file->count) return 0;
+			a = j < 0 ? 0 : sources->file_samples[file->first + j];
+			b = j + 1 < file->count 
+					? sources->file_samples[file->first + j + 1] : 0;
+			return file->amplitude * (a + (u - j) * (b - a));
+		default:
+			return 0;
+	}
+}
+
+double waveformDuration(SourceTable* sources, int i) {
+	PulseParams* pulse;
+	WaveFileParams* file;
+	double a;
+	switch (sources->fxn[i]) {
+		case GAUSSIANPULSE:
+		case MODULATEDGAUSSIAN:
+			// The envelope exp(-u^2) falls below the cutoff here
+			pulse = &sources->pulses[sources->param[i]];
+			return pulse->delay + pulse->width * sqrt(-log(MX_WAVE_CUTOFF));
+		case RICKER:
+			// Bound |1 - 2a| e^-a by (1 + 2a) e^-a and solve for where it 
+			// reaches the cutoff by fixed-point iteration
+			pulse = &sources->pulses[sources->param[i]];
+			a = -log(MX_WAVE_CUTOFF);
+			for (int k = 0; k < 16; k++) a = log((1 + 2 * a) / MX_WAVE_CUTOFF);
+			return pulse->delay + sqrt(a) / (M_PI * pulse->frequency);
+		case WAVEFILE:
+			file = &sources->files[sources->param[i]];
+			return file->count * file->period;
+		default:
+			return 0;
+	}
+}
+
+// The image shows the whole domain: the grid, and its reflections in any 
+// mirror planes beyond it
+int imageWidth(Simulation* simulation) {
+	return simulation->mirrored[AX_X] ? 2 * simulation->width 
+			: simulation->width;
+}
+
+int imageHeight(Simulation* simulation) {
+	return simulation->mirrored[AX_Y] ? 2 * simulation->height 
+			: simulation->height;
+}
+
+bool lineSourceValid(LineSourceParams* line, Simulation* simulation) {
+	// The corrections touch the cell before the line, so keep one cell clear
+	// of the domain's edges. A periodic axis has no edge cells, so along one
+	// the line may cover the whole period.
+	bool along_x = line->direction == LD_POS_Y 
+			|| line->direction == LD_NEG_Y;
+	int length = along_x ? imageWidth(simulation) : imageHeight(simulation);
+	int depth = along_x ? imageHeight(simulation) : imageWidth(simulation);
+	int margin = simulation->periodic[along_x ? AX_X : AX_Y] ? 0 : 1;
+	return line->position >= 1 && line->position <= depth - 2 
+			&& line->start >= margin && line->end <= length - 1 - margin 
+			&& line->start <= line->end;
+}
+
+double numericalWavenumber(double omega, double v, double kx, double ky, 
+		Simulation* simulation) {
+	// Solve the grid's dispersion relation along (kx, ky) by Newton's 
+	// method, starting from the continuum wavenumber, so the injected wave 
+	// matches the one the grid actually propagates
+	double rhs = sin(omega * simulation->dt / 2) / (v * simulation->dt);
+	double k = omega / v, sx, sy, f, df;
+	rhs *= rhs;
+	for (int i = 0; i < 20; i++) {
+		sx = sin(k * kx * simulation->dx / 2) / simulation->dx;
+		sy = sin(k * ky * simulation->dy / 2) / simulation->dy;
+		f = sx * sx + sy * sy - rhs;
+		df = sx * cos(k * kx * simulation->dx / 2) * kx 
+				+ sy * cos(k * ky * simulation->dy / 2) * ky;
+		if (df == 0) break;
+		k -= f / df;
+	}
+	return k;
+}
+
+void expandLineSource(InjectionKey* keys, int* n, SourceTable* sources, 
+		int i, Field* field, Simulation* simulation) {
+	LineSourceParams* line = &sources->lines[sources->param[i]];
+	long cells = (long)simulation->pitch * simulation->height;
+	bool along_x = line->direction == LD_POS_Y 
+			|| line->direction == LD_NEG_Y;
+	double sign = line->direction == LD_POS_X 
+			|| line->direction == LD_POS_Y ? 1 : -1;
+	double d = along_x ? simulation->dy : simulation->dx;
+
+	// Unit propagation vector: the line's normal, rotated by the angle
+	double nx = along_x ? 0 : sign;
+	double ny = along_x ? sign : 0;
+	double theta = line->angle * M_PI / 180;
+	double kx = nx * cos(theta) - ny * sin(theta);
+	double ky = nx * sin(theta) + ny * cos(theta);
+	double omega = 2 * M_PI * line->frequency;
+	double mid = (line->start + line->end) / 2.0;
+
+	// Switching on abruptly sends a broadband transient through the 
+	// scattered-field side at oblique angles, so ease in over a few periods
+	int ramp = (int)ceil(MX_LINE_RAMP_PERIODS / (line->frequency 
+			* simulation->dt));
+
+	int x, y, e_index, h_index;
+	double eps, mu, admittance, k, profile, ex, ey, hx, hy;
+	for (int s = line->start; s <= line->end; s++) {
+		x = along_x ? s : line->position;
+		y = along_x ? line->position : s;
+
+		// Cells beyond a mirror plane are reflections of cells in the grid
+		if (x >= simulation->width || y >= simulation->height) continue;
+		e_index = y * simulation->pitch + x;
+		h_index = sign > 0 ? e_index - (along_x ? simulation->pitch : 1) 
+				: e_index;
+		eps = field->Epsilon[e_index];
+		mu = field->Mu[e_index];
+		k = numericalWavenumber(omega, 1 / sqrt(eps * mu), kx, ky, 
+				simulation);
+
+		// The grid's ratio of |H| to Ez for this wave, in place of 1 / eta
+		admittance = simulation->dt / (mu * d * sin(omega * simulation->dt 
+				/ 2)) * sin(k * (along_x ? ky : kx) * d / 2) 
+				/ (along_x ? ky : kx);
+		profile = line->amplitude;
+		if (line->waist > 0) {
+			profile *= exp(-((s - mid) * (s - mid)) 
+					/ (line->waist * line->waist));
+		}
+
+		// Positions relative to the line's center. The H component used by
+		// the Ez correction sits half a cell into the scattered region. 
+		// They aren't wrapped along a periodic axis: the ghost cells then 
+		// continue the wave across the seam as long as its phase over one 
+		// period matches the boundary's Bloch phase.
+		ex = (along_x ? s - mid : 0) * simulation->dx;
+		ey = (along_x ? 0 : s - mid) * simulation->dy;
+		hx = ex - (along_x ? 0 : sign * 0.5 * d);
+		hy = ey - (along_x ? sign * 0.5 * d : 0);
+
+		// Ez on the total-field side sees the incident H it is missing. 
+		// Corrections are applied with the other sources, before the E 
+		// update, so the H term is sampled half a step back.
+		keys[*n].key = injectionGroup(FC_EZ) * cells + e_index;
+		keys[*n].source = i;
+		keys[*n].amplitude = sign * simulation->dt / (eps * d) 
+				* (along_x ? ky : kx) * admittance * profile;
+		keys[*n].phase = line->phase - k * (kx * hx + ky * hy) 
+				- omega * simulation->dt / 2;
+		keys[*n].ramp = ramp;
+		(*n)++;
+
+		// H on the scattered-field side must not see the incident Ez. This
+		// is applied before the next E update, a full step later.
+		keys[*n].key = injectionGroup(along_x ? FC_HX : FC_HY) * cells 
+				+ h_index;
+		keys[*n].source = i;
+		keys[*n].amplitude = (along_x ? sign : -sign) * simulation->dt 
+				/ (mu * d) * profile;
+		keys[*n].phase = line->phase - k * (kx * ex + ky * ey) 
+				- omega * simulation->dt;
+		keys[*n].ramp = ramp;
+		(*n)++;
+	}
+}
+
+bool compileSources(SourceInjection* injection, SourceTable* sources, 
+		Field* field, Simulation* simulation) {
+	long cells = (long)simulation->pitch * simulation->height;
+	int n = 0;
+
+	// Line sources expand to two corrections per cell
+	long entries = 0;
+	for (int i = 0; i < sources->count; i++) {
+		if (sources->fxn[i] != LINESOURCE) {
+			entries++;
+		} else if (lineSourceValid(&sources->lines[sources->param[i]], 
+				simulation)) {
+			LineSourceParams* line = &sources->lines[sources->param[i]];
+			entries += 2 * (line->end - line->start + 1);
+		}
+	}
+	if (entries > INT_MAX) return false;
+	InjectionKey* keys = (InjectionKey*)malloc(sizeof(InjectionKey) 
+			* max(entries, 1));
+	if (keys == NULL) return false;
+
+	// Sort sources by field component and then by cell, so that sources 
+	// sharing a cell end up adjacent and can be summed by one work item
+	for (int i = 0; i < sources->count; i++) {
+		if (sources->fxn[i] == LINESOURCE) {
+			if (lineSourceValid(&sources->lines[sources->param[i]], 
+					simulation)) {
+				expandLineSource(keys, &n, sources, i, field, simulation);
+			} else {
+				fprintf(stderr, "Warning: Line source #%d does not fit "
+						"inside the simulation space - ignoring.\n", i);
+			}
+			continue;
+		}
+		int group = injectionGroup(sources->fc[i]);
+		if (group < 0) continue;
+
+		// Sources beyond a mirror plane are reflections of ones in the grid
+		if (sources->x[i] >= simulation->width 
+				&& sources->x[i] < imageWidth(simulation)) continue;
+		if (sources->y[i] >= simulation->height 
+				&& sources->y[i] < imageHeight(simulation)) continue;
+		if (sources->x[i] < 0 || sources->y[i] < 0 
+				|| sources->x[i] >= simulation->width 
+				|| sources->y[i] >= simulation->height) {
+			fprintf(stderr, "Warning: Source #%d at (%d, %d) lies outside "
+					"the simulation space - ignoring.\n", i, sources->x[i], 
+					sources->y[i]);
+			continue;
+		}
+		keys[n].key = group * cells + (long)sources->y[i] 
+				* simulation->pitch + sources->x[i];
+		keys[n].source = i;
+		keys[n].amplitude = 1;
+		keys[n].phase = sources->fxn[i] == SINELINFREQ 
+				? sources->sines[sources->param[i]].phase : 0;
+		keys[n].ramp = 0;
+		n++;
+	}
+	qsort(keys, n, sizeof(InjectionKey), compareInjectionKeys);
+
+	// Size the sample table; sinusoids run forever and use phasors instead
+	int wavec = 0, tablec = 0;
+	long samplec = 0;
+	int* lengths = (int*)malloc(sizeof(int) * max(n, 1));
+	if (lengths == NULL) {
+		free(keys);
+		return false;
+	}
+	for (int s = 0; s < n; s++) {
+		int i = keys[s].source;
+		if (sources->fxn[i] == SINELINFREQ || sources->fxn[i] == LINESOURCE) {
+			wavec++;
+			continue;
+		}
+		double steps = ceil(waveformDuration(sources, i) / simulation->dt);
+		if (steps > MX_WAVE_MAX_SAMPLES) {
+			fprintf(stderr, "Warning: Source #%d lasts longer than %d steps "
+					"- truncating.\n", i, MX_WAVE_MAX_SAMPLES);
+			steps = MX_WAVE_MAX_SAMPLES;
+		}
+		lengths[tablec] = steps > 0 ? (int)steps : 0;
+		samplec += lengths[tablec];
+		tablec++;
+	}
+
+	memset(injection, 0, sizeof(SourceInjection));
+	injection->cell = (int*)malloc(sizeof(int) * max(n, 1));
+	injection->first = (int*)malloc(sizeof(int) * (n + 1));
+	injection->phasor_re = (float*)malloc(sizeof(float) * max(wavec, 1));
+	injection->phasor_im = (float*)malloc(sizeof(float) * max(wavec, 1));
+	injection->rotation_re = (float*)malloc(sizeof(float) * max(wavec, 1));
+	injection->rotation_im = (float*)malloc(sizeof(float) * max(wavec, 1));
+	injection->amplitude = (float*)malloc(sizeof(float) * max(wavec, 1));
+	injection->ramp = (int*)malloc(sizeof(int) * max(wavec, 1));
+	injection->start_re = (float*)malloc(sizeof(float) * max(wavec, 1));
+	injection->start_im = (float*)malloc(sizeof(float) * max(wavec, 1));
+	injection->table_first = (int*)malloc(sizeof(int) * (n + 1));
+	injection->table_offset = (int*)malloc(sizeof(int) * max(tablec, 1));
+	injection->table_length = (int*)malloc(sizeof(int) * max(tablec, 1));
+	injection->samples = samplec > INT_MAX ? NULL 
+			: (float*)malloc(sizeof(float) * max(samplec, 1));
+	if (injection->cell == NULL || injection->first == NULL 
+			|| injection->phasor_re == NULL || injection->phasor_im == NULL 
+			|| injection->rotation_re == NULL 
+			|| injection->rotation_im == NULL || injection->amplitude == NULL
+			|| injection->ramp == NULL
+			|| injection->start_re == NULL || injection->start_im == NULL 
+			|| injection->table_first == NULL 
+			|| injection->table_offset == NULL 
+			|| injection->table_length == NULL 
+			|| injection->samples == NULL) {
+		free(lengths);
+		free(keys);
+		return false;
+	}
+
+	int group, i;
+	double omega, phase;
+	for (int s = 0; s < n; s++) {
+		i = keys[s].source;
+		if (s == 0 || keys[s].key != keys[s - 1].key) {
+			group = keys[s].key / cells;
+			injection->cell[injection->cellc] = keys[s].key % cells;
+			injection->first[injection->cellc] = injection->wavec;
+			injection->table_first[injection->cellc] = injection->tablec;
+			injection->group_start[group + 1]++;
+			injection->cellc++;
+		}
+
+		if (sources->fxn[i] == SINELINFREQ || sources->fxn[i] == LINESOURCE) {
+			// The first update adds the value at t = dt, as time is 
+			// advanced before sources are applied
+			omega = 2 * M_PI * (sources->fxn[i] == SINELINFREQ 
+					? sources->sines[sources->param[i]].frequency 
+					: sources->lines[sources->param[i]].frequency);
+			phase = keys[s].phase;
+			injection->start_re[injection->wavec] = cos(omega 
+					* simulation->dt + phase);
+			injection->start_im[injection->wavec] = sin(omega 
+					* simulation->dt + phase);
+			injection->amplitude[injection->wavec] = keys[s].amplitude;
+			injection->ramp[injection->wavec] = keys[s].ramp;
+			injection->rotation_re[injection->wavec] = cos(omega 
+					* simulation->dt);
+			injection->rotation_im[injection->wavec] = sin(omega 
+					* simulation->dt);
+			injection->wavec++;
+		} else {
+			// Evaluate the waveform once for every step it lasts
+			int w = injection->tablec++;
+			injection->table_offset[w] = injection->samplec;
+			injection->table_length[w] = lengths[w];
+			for (int k = 1; k <= lengths[w]; k++) {
+				injection->samples[injection->samplec++] = waveformSample(
+						sources, i, k * (double)simulation->dt);
+			}
+		}
+	}
+	injection->first[injection->cellc] = injection->wavec;
+	injection->table_first[injection->cellc] = injection->tablec;
+	for (int g = 0; g < MX_INJECT_GROUPS; g++) {
+		injection->group_start[g + 1] += injection->group_start[g];
+	}
+	memcpy(injection->phasor_re, injection->start_re, 
+			sizeof(float) * injection->wavec);
+	memcpy(injection->phasor_im, injection->start_im, 
+			sizeof(float) * injection->wavec);
+
+	free(lengths);
+	free(keys);
+	return true;
+}
+
+void freeInjection(SourceInjection* injection) {
+	free(injection->cell);
+	free(injection->first);
+	free(injection->phasor_re);
+	free(injection->phasor_im);
+	free(injection->rotation_re);
+	free(injection->rotation_im);
+	free(injection->amplitude);
+	free(injection->ramp);
+	free(injection->start_re);
+	free(injection->start_im);
+	free(injection->table_first);
+	free(injection->table_offset);
+	free(injection->table_length);
+	free(injection->samples);
+	memset(injection, 0, sizeof(SourceInjection));
+}
+
+void freeScene(Scene* scene) {
+	free(scene->sources.fxn);
+	free(scene->sources.fc);
+	free(scene->sources.x);
+	free(scene->sources.y);
+	free(scene->sources.param);
+	free(scene->sources.sines);
+	free(scene->sources.pulses);
+	free(scene->sources.files);
+	free(scene->sources.file_samples);
+	free(scene->sources.lines);
+	free(scene->materials.geom);
+	free(scene->materials.param);
+	free(scene->materials.rel_eps);
+	free(scene->materials.rel_mu);
+	free(scene->materials.sigma);
+	free(scene->materials.bbox);
+	free(scene->materials.triangles);
+	free(scene->materials.circles);
+	for (int j = 0; j < scene->maps.count; j++) {
+		MaterialMap* map = &scene->maps.maps[j];
+		if (map->mapping != NULL) munmap(map->mapping, map->length);
+	}
+	free(scene->maps.maps);
+	free(scene->cache.dir);
+	free(scene->index.start);
+	free(scene->index.items);
+	freeInjection(&scene->injection);
+	memset(scene, 0, sizeof(Scene));
+}
+
+bool binRange(BoundingBox* bbox, int width, int height, BoundingBox* bins) {
+	// Find the bins overlapped by a bounding box, clipped to the grid
+	if (bbox->x1 < 0 || bbox->y1 < 0 || bbox->x0 >= width 
+			|| bbox->y0 >= height) {
+		return false;
+	}
+	bins->x0 = max(bbox->x0, 0) / MX_INDEX_BIN_PX;
+	bins->y0 = max(bbox->y0, 0) / MX_INDEX_BIN_PX;
+	bins->x1 = min(bbox->x1, width - 1) / MX_INDEX_BIN_PX;
+	bins->y1 = min(bbox->y1, height - 1) / MX_INDEX_BIN_PX;
+	return true;
+}
+
+// The cells of a bin, clipped to the grid
+void binTile(SpatialIndex* index, int bin, Simulation* simulation, 
+		BoundingBox* tile) {
+	tile->x0 = (bin % index->cols) * MX_INDEX_BIN_PX;
+	tile->y0 = (bin / index->cols) * MX_INDEX_BIN_PX;
+	tile->x1 = min(tile->x0 + MX_INDEX_BIN_PX, simulation->width) - 1;
+	tile->y1 = min(tile->y0 + MX_INDEX_BIN_PX, simulation->height) - 1;
+}
+
+bool buildSpatialIndex(SpatialIndex* index, MaterialTable* materials, 
+		int width, int height) {
+	free(index->start);
+	free(index->items);
+	index->cols = (width + MX_INDEX_BIN_PX - 1) / MX_INDEX_BIN_PX;
+	index->rows = (height + MX_INDEX_BIN_PX - 1) / MX_INDEX_BIN_PX;
+	int nbins = index->cols * index->rows;
+	index->items = NULL;
+	index->start = (int*)calloc(nbins + 1, sizeof(int));
+	if (index->start == NULL) return false;
+
+	// Count the materials overlapping each bin into start[b + 1], then sum 
+	// so that start[b] is where bin b's list begins
+	BoundingBox bins;
+	for (int m = 0; m < materials->count; m++) {
+		if (!binRange(&materials->bbox[m], width, height, &bins)) {
+			continue;
+		}
+		for (int by = bins.y0; by <= bins.y1; by++) {
+			for (int bx = bins.x0; bx <= bins.x1; bx++) {
+				index->start[by * index->cols + bx + 1]++;
+			}
+		}
+	}
+	for (int b = 0; b < nbins; b++) {
+		index->start[b + 1] += index->start[b];
+	}
+
+	index->items = (int*)malloc((index->start[nbins] + 1) * sizeof(int));
+	if (index->items == NULL) return false;
+
+	// Fill the lists in scene order, using start[b] as the insertion point. 
+	// Afterwards each start[b] has advanced to the beginning of bin b + 1, 
+	// so shift them back by one.
+	for (int m = 0; m < materials->count; m++) {
+		if (!binRange(&materials->bbox[m], width, height, &bins)) {
+			continue;
+		}
+		for (int by = bins.y0; by <= bins.y1; by++) {
+			for (int bx = bins.x0; bx <= bins.x1; bx++) {
+				index->items[index->start[by * index->cols + bx]++] = m;
+			}
+		}
+	}
+	for (int b = nbins; b > 0; b--) {
+		index->start[b] = index->start[b - 1];
+	}
+	index->start[0] = 0;
+	return true;
+}
+
+bool materialCovers(MaterialTable* materials, int m, int x, int y) {
+	// Point versions of the inside tests used by the rasterizer
+	switch (materials->geom[m]) {
+		case MG_TRIANGLE:
+			TriangleParams* t = &materials->triangles[materials->param[m]];
+			long d1 = (long)(x - t->x2) * (t->y1 - t->y2) 
+					- (long)(t->x1 - t->x2) * (y - t->y2);
+			long d2 = (long)(x - t->x3) * (t->y2 - t->y3) 
+					- (long)(t->x2 - t->x3) * (y - t->y3);
+			long d3 = (long)(x - t->x1) * (t->y3 - t->y1) 
+					- (long)(t->x3 - t->x1) * (y - t->y1);
+			bool has_neg = (d1 < 0) || (d2 < 0) || (d3 < 0);
+			bool has_pos = (d1 > 0) || (d2 > 0) || (d3 > 0);
+			return !(has_neg && has_pos);
+		case MG_CIRCLE:
+			CircleParams* c = &materials->circles[materials->param[m]];
+			return (long)(x - c->x) * (x - c->x) + (long)(y - c->y) 
+					* (y - c->y) < (long)c->R * c->R;
+		default:
+			return false;
+	}
+}
+
+int queryMaterials(Scene* scene, int width, int height, int x, int y, 
+		int* found, int max_found) {
+	// Collect the materials covering (x, y) in scene order, returning how 
+	// many there are even if only max_found of them fit
+	if (x < 0 || y < 0 || x >= width || y >= height) return 0;
+	SpatialIndex* index = &scene->index;
+	int bin = (y / MX_INDEX_BIN_PX) * index->cols + x / MX_INDEX_BIN_PX;
+	int nfound = 0;
+	for (int i = index->start[bin]; i < index->start[bin + 1]; i++) {
+		int m = index->items[i];
+		BoundingBox* bbox = &scene->materials.bbox[m];
+		if (x < bbox->x0 || x > bbox->x1 || y < bbox->y0 || y > bbox->y1 
+				|| !materialCovers(&scene->materials, m, x, y)) {
+			continue;
+		}
+		if (nfound < max_found) found[nfound] = m;
+		nfound++;
+	}
+	return nfound;
+}
+
 void key_callback(GLFWwindow* window, int key, int __attribute__((unused)) 
 		scancode, int action, int mods) {
 	// Handle Ctrl+C to exit the program
@@ -52,6 +1083,11 @@ void key_callback(GLFWwindow* window, int key, int __attribute__((unused))
 		report_framerate = true;
 	}
 
+	// Toggle per-phase profiling with 'P' key
+	if (key == GLFW_KEY_P && action == GLFW_PRESS) {
+		toggle_profiling = true;
+	}
+
 	// Reset simulation with 'R' key
 	if (key == GLFW_KEY_R && action == GLFW_PRESS) {
 		printf("Resetting simulation.\n");
@@ -66,9 +1102,31 @@ void key_callback(GLFWwindow* window, int key, int __attribute__((unused))
 	}
 }
 
-int PMLayer(int x, int y, int layers, int width, int height) {
+void mouse_button_callback(GLFWwindow* window, int button, int action, 
+		int __attribute__((unused)) mods) {
+	// Probe the cell under the cursor with a left click
+	if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS) {
+		int window_width, window_height;
+		glfwGetCursorPos(window, &probe_x, &probe_y);
+		glfwGetWindowSize(window, &window_width, &window_height);
+		probe_x /= window_width;
+		probe_y /= window_height;
+		probe_requested = true;
+	}
+}
+
+// Periodic axes have no edges, so only the other axis counts, and a 
+// mirror plane takes the place of the far edge
+int PMLayer(Simulation* simulation, int x, int y) {
+	int layers = simulation->pml_layers;
+	int width = simulation->width;
+	int height = simulation->height;
 	int min_x = x < (width - x) ? x : (width - x - 1);
 	int min_y = y < (height - y) ? y : (height - y - 1);
+	if (simulation->mirrored[AX_X]) min_x = x;
+	if (simulation->mirrored[AX_Y]) min_y = y;
+	if (simulation->periodic[AX_X]) min_x = INT_MAX;
+	if (simulation->periodic[AX_Y]) min_y = INT_MAX;
 	int dist_to_edge = min_x < min_y ? min_x : min_y;
 
 	if (dist_to_edge < layers) {
@@ -84,1023 +1142,3088 @@ float conductivityPML(Simulation* simulation, int layer) {
 			simulation->pml_sigma_polyorder);
 }
 
-void initFields(Field* field, Simulation* simulation) {
-	int index, layer;
-	for (int y = 0; y < simulation->height; ++y) {
-		for (int x = 0; x < simulation->width; ++x) {
-			index = y * simulation->width + x;
-			field->Epsilon[index] = VACUUM_PERMITTIVITY;
-			field->Mu[index] = VACUUM_PERMEABILITY;
-			field->Ex[index] = 0;
-			field->Ey[index] = 0;
-			field->Ez[index] = 0;
-			field->Hx[index] = 0;
-			field->Hy[index] = 0;
-			field->Hz[index] = 0;
-
-			if (simulation->boundary_condition == BC_PML
-					&& (layer = PMLayer(x, y, simulation->pml_layers, 
-					simulation->width, simulation->height)) >= 0) {
-				field->Sigma[index] = conductivityPML(simulation, layer);
-			} else {
-				field->Sigma[index] = 0;
+float boundaryConductivity(Simulation* simulation, int x, int y) {
+	int layer;
+	if (simulation->boundary_condition == BC_PML
+			&& (layer = PMLayer(simulation, x, y)) >= 0) {
+		return conductivityPML(simulation, layer);
+	}
+	return 0;
+}
+
+// Applies the maps over the cells of clip
+void applyMaterialMaps(Field* field, Simulation* simulation, 
+		MapTable* maps, BoundingBox* clip) {
+	for (int j = 0; j < maps->count; j++) {
+		MaterialMap* map = &maps->maps[j];
+		bool indexed = map->quantity == MQ_INDEXED;
+		bool eps = indexed || map->quantity == MQ_EPSILON;
+		bool mu = indexed || map->quantity == MQ_MU;
+		bool sigma = indexed || map->quantity == MQ_SIGMA;
+		float eps_scale = map->si_units ? 1 : VACUUM_PERMITTIVITY;
+		float mu_scale = map->si_units ? 1 : VACUUM_PERMEABILITY;
+		const float* values = (const float*)map->data;
+		const uint8_t* indices = (const uint8_t*)map->data;
+
+		// Sample each covered cell's center from the nearest file value
+		int x_lo = max(map->x, clip->x0);
+		int y_lo = max(map->y, clip->y0);
+		int x_hi = min(map->x + map->width, clip->x1 + 1);
+		int y_hi = min(map->y + map->height, clip->y1 + 1);
+		int index, row, source, i;
+		for (int y = y_lo; y < y_hi; y++) {
+			row = (int)((2L * (y - map->y) + 1) * map->file_height 
+					/ (2L * map->height)) * map->file_width;
+			for (int x = x_lo; x < x_hi; x++) {
+				index = y * simulation->pitch + x;
+				source = row + (int)((2L * (x - map->x) + 1) 
+						* map->file_width / (2L * map->width));
+				if (!indexed) {
+					if (eps) field->Epsilon[index] = values[source] 
+							* eps_scale;
+					if (mu) field->Mu[index] = values[source] * mu_scale;
+					if (sigma) field->Sigma[index] = values[source] 
+							+ boundaryConductivity(simulation, x, y);
+					continue;
+				}
+
+				// Indices without a palette entry leave the cell alone
+				i = indices[source];
+				if (!maps->palette_set[i]) continue;
+				if (eps) field->Epsilon[index] = maps->palette_eps[i] 
+						* VACUUM_PERMITTIVITY;
+				if (mu) field->Mu[index] = maps->palette_mu[i] 
+						* VACUUM_PERMEABILITY;
+				if (sigma) field->Sigma[index] = maps->palette_sigma[i] 
+						+ boundaryConductivity(simulation, x, y);
 			}
 		}
 	}
 }
 
-void addMaterials(Field* field, Simulation* simulation, Material* materials) {
-	// For each user-specified material
-	for (int m = 0; m < simulation->materialc; m++) {
-		printf("\rApplying material characteristics... (%d/%d)", m, 
-			simulation->materialc);
-	
-	int index;
-	float rel_eps, rel_mu, sigma;
-	
-		// We will implement the properties in a region determined by the 
-		// geometry
-		switch (materials[m].geom) {
-			case MG_UNKNOWN:
-				break;
-			case MG_TRIANGLE:
-				// Extract the relative permittivity and permeability for the
-				// triangular region
-				rel_eps = materials[m].argv[0].value.floatVal;
-				rel_mu = materials[m].argv[1].value.floatVal;
-				sigma = materials[m].argv[2].value.floatVal;
-
-				// Extract the bounding vertices of the triangle
-				int x1, y1, x2, y2, x3, y3;
-				x1 = materials[m].argv[3].value.intVal;	
-				y1 = materials[m].argv[4].value.intVal;	
-				x2 = materials[m].argv[5].value.intVal;	
-				y2 = materials[m].argv[6].value.intVal;	
-				x3 = materials[m].argv[7].value.intVal;	
-				y3 = materials[m].argv[8].value.intVal;	
-				
-				float d1, d2, d3;
-				bool has_neg, has_pos;
-				for (int y = 0; y < simulation->height; y++) {
-					for (int x = 0; x < simulation->width; x++) {
-						index = y * simulation->width + x;
-						
-						// Calculate barycentric coordinates for the point
-						// (x, y) in the simulation grid
-						d1 = (x - x2) * (y1 - y2) - (x1 - x2) * (y - y2);
-						d2 = (x - x3) * (y2 - y3) - (x2 - x3) * (y - y3);
-						d3 = (x - x1) * (y3 - y1) - (x3 - x1) * (y - y1);
-
-						has_neg = (d1 < 0) || (d2 < 0) || (d3 < 0);
-						has_pos = (d1 > 0) || (d2 > 0) || (d3 > 0);
-						
-						// Check if (x, y) is inside the triangular region
-						if (!(has_neg && has_pos)) {
-							field->Epsilon[index] *= rel_eps;
-							field->Mu[index] *= rel_mu;
-							field->Sigma[index] += sigma;
-						}
-					}
-				}
-				break;
-			case MG_CIRCLE:
-				rel_eps = materials[m].argv[0].value.floatVal;
-				rel_mu = materials[m].argv[1].value.floatVal;
-				sigma = materials[m].argv[2].value.floatVal;
-
-				int cx, cy, R;
-				cx = materials[m].argv[3].value.intVal;
-				cy = materials[m].argv[4].value.intVal;
-				R = materials[m].argv[5].value.intVal;
-				
-				float d;
-				for (int y = 0; y < simulation->height; y++) {
-					for (int x = 0; x < simulation->width; x++) {
-						index = y * simulation->width + x;
-						d = (x - cx) * (x - cx);
-						d += (y - cy) * (y - cy);
-						if (d < R * R) {
-							field->Epsilon[index] *= rel_eps;
-							field->Mu[index] *= rel_mu;
-							field->Sigma[index] += sigma;
-						}
-					}
-				}
-				break;
-			default:
-				break;
+float randNormalFloat(void) {
+	return (float)rand() / (float)RAND_MAX;
+}
+
+void glfw_error_callback(int error, const char* desc) {
+	// Log GLFW errors to stderr
+	fprintf(stderr, "GLFW error %d: %s\n", error, desc);
+}
+
+double wallTime(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+const char* phase_names[PH_MAX] = {"inject", "E", "H", "boundary", 
+		"transfer", "colorize", "texture", "swap", "frame"};
+
+void recordSample(Histogram* hist, double ns) {
+	int b = ns < 1 ? 0 : (int)(log2(ns) * MX_PROFILE_SUBBUCKETS);
+	b = min(b, MX_PROFILE_BUCKETS - 1);
+	if (hist->count == 0 || ns < hist->min) hist->min = ns;
+	if (ns > hist->max) hist->max = ns;
+	hist->count++;
+	hist->total += ns;
+	hist->buckets[b]++;
+}
+
+// Upper edge of the bucket holding the given fraction of samples, kept 
+// within the range actually seen
+double histogramPercentile(Histogram* hist, double fraction) {
+	long rank = (long)ceil(fraction * hist->count);
+	long seen = 0;
+	for (int b = 0; b < MX_PROFILE_BUCKETS; b++) {
+		seen += hist->buckets[b];
+		if (seen >= rank) {
+			double edge = exp2((double)(b + 1) / MX_PROFILE_SUBBUCKETS);
+			return fmin(fmax(edge, hist->min), hist->max);
+		}
+	}
+	return hist->max;
+}
+
+// Host timers. Both are no-ops while profiling is off.
+double profileStart(Simulation* simulation) {
+	return simulation->profiler.enabled ? wallTime() : 0;
+}
+
+void profileEnd(Simulation* simulation, ProfilePhase phase, double start) {
+	Profiler* profiler = &simulation->profiler;
+	if (!profiler->enabled) return;
+	profiler->frame[phase] += (wallTime() - start) * 1e9;
+	profiler->seen[phase] = true;
+}
+
+// Waits for the pending device commands, adds their durations to the frame
+// and releases their events
+void resolveProfileEvents(Simulation* simulation) {
+	Profiler* profiler = &simulation->profiler;
+	cl_ulong start, end;
+	for (int e = 0; e < profiler->eventc; e++) {
+		cl_event event = profiler->events[e];
+		ProfilePhase phase = profiler->event_phase[e];
+		if (event == NULL) continue;
+		if (clWaitForEvents(1, &event) == CL_SUCCESS 
+				&& clGetEventProfilingInfo(event, 
+				CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL) 
+				== CL_SUCCESS && clGetEventProfilingInfo(event, 
+				CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL) 
+				== CL_SUCCESS) {
+			profiler->frame[phase] += (double)(end - start);
+			profiler->seen[phase] = true;
+		}
+		clReleaseEvent(event);
+	}
+	profiler->eventc = 0;
+}
+
+// Event to pass to a device command in the given phase, or NULL while 
+// profiling is off
+cl_event* profileEvent(Simulation* simulation, ProfilePhase phase) {
+	Profiler* profiler = &simulation->profiler;
+	if (!profiler->enabled) return NULL;
+	if (profiler->eventc == MX_PROFILE_EVENTS) {
+		resolveProfileEvents(simulation);
+	}
+	profiler->events[profiler->eventc] = NULL;
+	profiler->event_phase[profiler->eventc] = phase;
+	return &profiler->events[profiler->eventc++];
+}
+
+// Compulsory traffic and arithmetic per cell of each update variant. The 
+// general E update reads Hx, Hy, epsilon and sigma and reads and writes 
+// Ez; dielectric cells skip sigma and vacuum cells epsilon too. The 
+// general H update reads mu and Ez and reads and writes Hx and Hy; vacuum
+// cells skip mu. Neighbor values are assumed to hit cache.
+const int E_cell_bytes[TC_MAX] = {16, 20, 24};
+const int E_cell_flops[TC_MAX] = {7, 8, 12};
+const int H_cell_bytes[TC_MAX] = {20, 24, 24};
+const int H_cell_flops[TC_MAX] = {6, 10, 10};
+
+// The E or H update of the active engine. On the GPU the cost is averaged
+// over the variants, weighted by their tiles.
+KernelCost kernelCost(Simulation* simulation, ProfilePhase phase) {
+	bool electric = phase == PH_E;
+	const int* bytes = electric ? E_cell_bytes : H_cell_bytes;
+	const int* flops = electric ? E_cell_flops : H_cell_flops;
+	KernelCost cost = {electric ? "updateEBlock" : "updateHBlock", 
+			bytes[TC_LOSSY], flops[TC_LOSSY]};
+	if (gpu_support) {
+		const int* start = electric ? simulation->E_tile_start 
+				: simulation->H_tile_start;
+		int tiles = max(start[TC_MAX] - start[0], 1);
+		cost.name = electric ? "updateE tiles" : "updateH tiles";
+		cost.bytes = 0;
+		cost.flops = 0;
+		for (int c = 0; c < TC_MAX; c++) {
+			double share = (double)(start[c + 1] - start[c]) / tiles;
+			cost.bytes += share * bytes[c];
+			cost.flops += share * flops[c];
+		}
+	}
+
+	// A fused H update also writes each cell's pixel
+	if (!electric && simulation->fused_colorize) {
+		cost.bytes += 3 * sizeof(float);
+	}
+	return cost;
+}
+
+int cpuSocket(int cpu) {
+	char path[96];
+	snprintf(path, sizeof(path), 
+			"/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+	FILE* file = fopen(path, "r");
+	int socket = 0;
+	if (file != NULL) {
+		if (fscanf(file, "%d", &socket) != 1) socket = 0;
+		fclose(file);
+	}
+	return socket;
+}
+
+// The CPU for thread t of a pool or STREAM run, or -1 if unknown. Threads 
+// with neighboring numbers own neighboring bands of rows, so they are kept 
+// on one socket, and so on one NUMA node, for as long as it has CPUs.
+int threadCPU(int t) {
+	if (cpu_count == 0) {
+		if (sched_getaffinity(0, sizeof(cpu_set_t), &process_cpus) != 0) {
+			return -1;
+		}
+		int sockets[MX_MAX_THREADS];
+		for (int c = 0; c < CPU_SETSIZE && cpu_count < MX_MAX_THREADS; c++) {
+			if (!CPU_ISSET(c, &process_cpus)) continue;
+			int socket = cpuSocket(c);
+			int i = cpu_count++;
+			for (; i > 0 && sockets[i - 1] > socket; i--) {
+				sockets[i] = sockets[i - 1];
+				cpu_order[i] = cpu_order[i - 1];
+			}
+			sockets[i] = socket;
+			cpu_order[i] = c;
+		}
+		if (cpu_count == 0) return -1;
+	}
+	return cpu_order[t % cpu_count];
+}
+
+void pinThread(pthread_t thread, int cpu) {
+	if (cpu < 0) return;
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpus);
+}
+
+// Starts a thread on cpu, or on any of the process's CPUs if cpu is 
+// negative, whatever the affinity of the thread starting it
+int startThread(pthread_t* thread, void* (*run)(void*), void* arg, 
+		int cpu) {
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+	} else if (threadCPU(0) >= 0) {
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), 
+				&process_cpus);
+	}
+	int err = pthread_create(thread, &attr, run, arg);
+	pthread_attr_destroy(&attr);
+	return err;
+}
+
+void* streamWorker(void* arg) {
+	StreamTask* task = (StreamTask*)arg;
+	float* restrict a = task->a;
+	float* restrict b = task->b;
+	float* restrict c = task->c;
+	switch (task->kernel) {
+		case SK_INIT:
+			for (long i = task->first; i < task->last; i++) {
+				a[i] = 1;
+				b[i] = 2;
+				c[i] = 0;
+			}
+			break;
+		case SK_COPY:
+			for (long i = task->first; i < task->last; i++) c[i] = a[i];
+			break;
+		case SK_TRIAD:
+			for (long i = task->first; i < task->last; i++) {
+				a[i] = b[i] + 3.0f * c[i];
+			}
+			break;
+	}
+	return NULL;
+}
+
+// Runs a kernel with each thread on its own part of the arrays and returns
+// the time taken. Parts whose thread fails to start run on this one.
+double runStream(StreamTask* tasks, int threads, StreamKernel kernel) {
+	pthread_t workers[MX_MAX_THREADS];
+	bool started[MX_MAX_THREADS];
+	double start = wallTime();
+	for (int t = 0; t < threads; t++) tasks[t].kernel = kernel;
+	for (int t = 1; t < threads; t++) {
+		started[t] = startThread(&workers[t], streamWorker, &tasks[t], 
+				threadCPU(t)) == 0;
+	}
+	streamWorker(&tasks[0]);
+	for (int t = 1; t < threads; t++) {
+		if (started[t]) {
+			pthread_join(workers[t], NULL);
+		} else {
+			streamWorker(&tasks[t]);
+		}
+	}
+	return wallTime() - start;
+}
+
+// Best copy and triad bandwidth over MX_STREAM_REPEATS runs, in bytes per 
+// second. As in STREAM, only the bytes each kernel names are counted. The
+// arrays are first touched by the threads that later use them.
+bool measureHostBandwidth(int threads, double* copy, double* triad) {
+	size_t size = sizeof(float) * MX_STREAM_LENGTH;
+	float* a = (float*)malloc(size);
+	float* b = (float*)malloc(size);
+	float* c = (float*)malloc(size);
+	if (a == NULL || b == NULL || c == NULL) {
+		free(a);
+		free(b);
+		free(c);
+		return false;
+	}
+
+	StreamTask tasks[MX_MAX_THREADS];
+	threads = min(max(threads, 1), MX_MAX_THREADS);
+	for (int t = 0; t < threads; t++) {
+		tasks[t].a = a;
+		tasks[t].b = b;
+		tasks[t].c = c;
+		tasks[t].first = MX_STREAM_LENGTH * t / threads;
+		tasks[t].last = MX_STREAM_LENGTH * (t + 1) / threads;
+	}
+	runStream(tasks, threads, SK_INIT);
+	double best_copy = INFINITY;
+	double best_triad = INFINITY;
+	for (int r = 0; r < MX_STREAM_REPEATS; r++) {
+		best_copy = fmin(best_copy, runStream(tasks, threads, SK_COPY));
+		best_triad = fmin(best_triad, runStream(tasks, threads, SK_TRIAD));
+	}
+	*copy = 2 * size / best_copy;
+	*triad = 3 * size / best_triad;
+
+	free(a);
+	free(b);
+	free(c);
+	return true;
+}
+
+// Best bandwidth of the copyBuffer kernel over MX_STREAM_REPEATS runs after
+// a warm-up, timed with profiling events, in bytes per second. Returns 0 if
+// it can't be run.
+double measureDeviceBandwidth(Simulation* simulation) {
+	size_t size = sizeof(float) * MX_STREAM_LENGTH;
+	size_t global_size = MX_STREAM_LENGTH;
+	cl_int err;
+	cl_kernel kernel = clCreateKernel(simulation->program, "copyBuffer", 
+			&err);
+	if (err != CL_SUCCESS) return 0;
+	cl_mem src = clCreateBuffer(simulation->context, CL_MEM_READ_ONLY, size,
+			NULL, &err);
+	cl_mem dst = clCreateBuffer(simulation->context, CL_MEM_WRITE_ONLY, 
+			size, NULL, &err);
+
+	double best = 0;
+	if (src != NULL && dst != NULL) {
+		float zero = 0;
+		cl_event event;
+		cl_ulong start, end;
+		clEnqueueFillBuffer(simulation->queue, src, &zero, sizeof(float), 0,
+				size, 0, NULL, NULL);
+		clSetKernelArg(kernel, 0, sizeof(cl_mem), &src);
+		clSetKernelArg(kernel, 1, sizeof(cl_mem), &dst);
+		for (int r = 0; r <= MX_STREAM_REPEATS; r++) {
+			if (clEnqueueNDRangeKernel(simulation->queue, kernel, 1, NULL, 
+					&global_size, NULL, 0, NULL, &event) != CL_SUCCESS) {
+				break;
+			}
+			clWaitForEvents(1, &event);
+			clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, 
+					sizeof(cl_ulong), &start, NULL);
+			clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, 
+					sizeof(cl_ulong), &end, NULL);
+			clReleaseEvent(event);
+			if (r > 0 && end > start) {
+				best = fmax(best, 2.0 * size / ((end - start) * 1e-9));
+			}
+		}
+	}
+	if (src != NULL) clReleaseMemObject(src);
+	if (dst != NULL) clReleaseMemObject(dst);
+	clReleaseKernel(kernel);
+	return best;
+}
+
+// Achieved bandwidth of the E and H phases against what the machine can 
+// sustain. At about half a flop per byte the stencil sits well below any 
+// machine's ridge point, so bandwidth is the roof that applies.
+void printRoofline(Simulation* simulation) {
+	Profiler* profiler = &simulation->profiler;
+	if (profiler->phases[PH_E].count == 0 
+			|| profiler->phases[PH_H].count == 0) {
+		return;
+	}
+	int threads = gpu_support ? 0 : simulation->pool != NULL 
+			? simulation->pool->threads : 1;
+	const char* reference = gpu_support ? "device copy" : "host triad";
+	if (profiler->peak_bandwidth == 0) {
+		printf("Measuring %s bandwidth...\n", reference);
+		double copy, triad;
+		if (gpu_support) {
+			profiler->peak_bandwidth = measureDeviceBandwidth(simulation);
+		} else if (measureHostBandwidth(threads, &copy, &triad)) {
+			profiler->peak_bandwidth = triad;
+		}
+	}
+	if (profiler->peak_bandwidth > 0) {
+		printf("Roofline against %.1f GB/s %s bandwidth", 
+				profiler->peak_bandwidth * 1e-9, reference);
+	} else {
+		printf("Roofline, %s bandwidth unavailable", reference);
+	}
+	if (threads > 0) {
+		printf(" on %d thread%s", threads, threads > 1 ? "s" : "");
+	}
+	printf(":\n%-10s %-14s %7s %10s %9s %9s %8s\n", "phase", "kernel", 
+			"B/cell", "flop/cell", "GB/s", "GFLOP/s", "of peak");
+
+	double cells = (double)simulation->width * simulation->height;
+	double bytes = 0, flops = 0;
+	ProfilePhase phases[2] = {PH_E, PH_H};
+	for (int p = 0; p < 2; p++) {
+		Histogram* hist = &profiler->phases[phases[p]];
+		KernelCost cost = kernelCost(simulation, phases[p]);
+		double seconds = hist->total / hist->count * 1e-9;
+		double achieved = cells * cost.bytes / seconds;
+		printf("%-10s %-14s %7.1f %10.1f %9.2f %9.2f", phase_names[phases[p]], 
+				cost.name, cost.bytes, cost.flops, achieved * 1e-9, 
+				cells * cost.flops / seconds * 1e-9);
+		if (profiler->peak_bandwidth > 0) {
+			printf(" %7.1f%%", 100 * achieved / profiler->peak_bandwidth);
+		}
+		printf("\n");
+		bytes += cost.bytes;
+		flops += cost.flops;
+	}
+	printf("Arithmetic intensity %.2f flop/B: bound by memory bandwidth.\n",
+			flops / bytes);
+}
+
+void resetProfile(Simulation* simulation) {
+	Profiler* profiler = &simulation->profiler;
+	memset(profiler->frame, 0, sizeof(profiler->frame));
+	memset(profiler->seen, 0, sizeof(profiler->seen));
+	memset(profiler->line_total, 0, sizeof(profiler->line_total));
+	memset(profiler->line_count, 0, sizeof(profiler->line_count));
+	memset(profiler->phases, 0, sizeof(profiler->phases));
+	profiler->frame_start = wallTime();
+	profiler->last_line = profiler->frame_start;
+}
+
+void printProfileLine(Profiler* profiler) {
+	printf("Profile, mean ms over %ld frames:", 
+			profiler->line_count[PH_FRAME]);
+	for (int p = 0; p < PH_MAX; p++) {
+		if (profiler->line_count[p] == 0) continue;
+		printf(" %s %.3f", phase_names[p], profiler->line_total[p] 
+				/ profiler->line_count[p] * 1e-6);
+	}
+	printf("\n");
+	memset(profiler->line_total, 0, sizeof(profiler->line_total));
+	memset(profiler->line_count, 0, sizeof(profiler->line_count));
+}
+
+void printProfileReport(Simulation* simulation) {
+	Profiler* profiler = &simulation->profiler;
+	Histogram* frames = &profiler->phases[PH_FRAME];
+	if (frames->count == 0) return;
+	printf("Profile over %ld frames, in microseconds:\n", frames->count);
+	printf("%-10s %8s %10s %10s %10s %10s %10s %7s\n", "phase", "frames", 
+			"mean", "min", "p50", "p99", "max", "share");
+	for (int p = 0; p < PH_MAX; p++) {
+		Histogram* hist = &profiler->phases[p];
+		if (hist->count == 0) continue;
+		printf("%-10s %8ld %10.1f %10.1f %10.1f %10.1f %10.1f %6.1f%%\n", 
+				phase_names[p], hist->count, hist->total / hist->count 
+				* 1e-3, hist->min * 1e-3, histogramPercentile(hist, 0.5) 
+				* 1e-3, histogramPercentile(hist, 0.99) * 1e-3, 
+				hist->max * 1e-3, 100 * hist->total / frames->total);
+	}
+	printRoofline(simulation);
+}
+
+// Closes the current frame: every phase that ran gets a sample, and the 
+// stats line is printed if it is due
+void endProfileFrame(Simulation* simulation) {
+	Profiler* profiler = &simulation->profiler;
+	if (!profiler->enabled) return;
+	resolveProfileEvents(simulation);
+	double now = wallTime();
+	profiler->frame[PH_FRAME] = (now - profiler->frame_start) * 1e9;
+	profiler->seen[PH_FRAME] = true;
+	profiler->frame_start = now;
+	for (int p = 0; p < PH_MAX; p++) {
+		if (!profiler->seen[p]) continue;
+		recordSample(&profiler->phases[p], profiler->frame[p]);
+		profiler->line_total[p] += profiler->frame[p];
+		profiler->line_count[p]++;
+		profiler->frame[p] = 0;
+		profiler->seen[p] = false;
+	}
+	if (profiler->period > 0 && now - profiler->last_line 
+			>= profiler->period) {
+		printProfileLine(profiler);
+		profiler->last_line = now;
+	}
+}
+
+// Turning profiling on starts from empty histograms; turning it off prints
+// the report for everything collected since
+void setProfiling(Simulation* simulation, bool enable) {
+	Profiler* profiler = &simulation->profiler;
+	if (enable == profiler->enabled) return;
+	if (enable) {
+		resetProfile(simulation);
+	} else {
+		resolveProfileEvents(simulation);
+		printProfileReport(simulation);
+	}
+	profiler->enabled = enable;
+}
+
+// Rows j0 to j1 - 1 of every grid, plus the ghost rows above the first and
+// below the last. Ghost cells start out as vacuum at rest too, like space 
+// continuing past the edge of the grid.
+void initFieldRows(Field* field, Simulation* simulation, int j0, int j1) {
+	int pitch = simulation->pitch;
+	int r0 = j0 == 0 ? -1 : j0;
+	int r1 = j1 == simulation->height ? j1 + 1 : j1;
+	size_t n = (size_t)(r1 - r0) * pitch;
+	size_t offset = (size_t)(r0 + 1) * pitch;
+	float* epsilon = field->Epsilon - simulation->origin + offset;
+	float* mu = field->Mu - simulation->origin + offset;
+	for (size_t i = 0; i < n; i++) {
+		epsilon[i] = VACUUM_PERMITTIVITY;
+		mu[i] = VACUUM_PERMEABILITY;
+	}
+	float* zeroed[] = {field->Sigma, field->Ex, field->Ey, field->Ez, 
+			field->Hx, field->Hy, field->Hz};
+	for (size_t g = 0; g < sizeof(zeroed) / sizeof(float*); g++) {
+		memset(zeroed[g] - simulation->origin + offset, 0, sizeof(float) * n);
+	}
+	if (simulation->boundary_condition != BC_PML) return;
+	for (int y = j0; y < j1; y++) {
+		for (int x = 0; x < simulation->width; x++) {
+			field->Sigma[y * pitch + x] = boundaryConductivity(simulation, x, 
+					y);
+		}
+	}
+}
+
+// Cells along an edge that the half-steps leave alone: the outer ring of
+// Ez, and the H that would read Ez beyond it. Periodic edges have none, 
+// and neither has the far edge of a mirrored axis, as the plane lies there.
+int edgeCells(Simulation* simulation, Axis axis, bool far) {
+	return simulation->periodic[axis] || (far && simulation->mirrored[axis])
+			? 0 : 1;
+}
+
+// Updates Ez over columns x0 to x1 - 1 of rows y0 to y1 - 1, skipping the
+// edge cells that edgeCells leaves alone. Every engine, serial, threaded or
+// tiled, steps cells through here, so they all produce the same fields.
+void updateECells(Field* field, Simulation* simulation, int x0, int y0, 
+		int x1, int y1) {
+	int pitch = simulation->pitch;
+	float dt = simulation->dt;
+	float dx = simulation->dx;
+	float dy = simulation->dy;
+	float* restrict Ez = field->Ez;
+	const float* restrict Hx = field->Hx;
+	const float* restrict Hy = field->Hy;
+	const float* restrict Epsilon = field->Epsilon;
+	const float* restrict Sigma = field->Sigma;
+	int index;
+	int i0 = max(x0, edgeCells(simulation, AX_X, false));
+	int i1 = min(x1, simulation->width - edgeCells(simulation, AX_X, true));
+	int j0 = max(y0, edgeCells(simulation, AX_Y, false));
+	int j1 = min(y1, simulation->height - edgeCells(simulation, AX_Y, true));
+	for (int j = j0; j < j1; j++) {
+		for (int i = i0; i < i1; i++) {
+			index = j * pitch + i;
+			Ez[index] += (dt / Epsilon[index]) * ((Hy[index] - Hy[index - 1])
+					/ dx - (Hx[index] - Hx[index - pitch]) / dy) 
+					- (dt * Sigma[index] * Ez[index] / Epsilon[index]);
+		}
+	}
+}
+
+// Across a periodic edge, the E update reads the H of the far edge from 
+// the ghost cells, so they are filled first for the block's cells there
+void wrapH(Field* field, Simulation* simulation, int x0, int y0, int x1, 
+		int y1) {
+	int width = simulation->width;
+	int height = simulation->height;
+	int pitch = simulation->pitch;
+	if (simulation->periodic[AX_X] && x0 <= 0) {
+		for (int j = max(y0, 0); j < min(y1, height); j++) {
+			field->Hy[j * pitch - 1] = simulation->bloch_sign[AX_X] 
+					* field->Hy[j * pitch + width - 1];
+		}
+	}
+	if (simulation->periodic[AX_Y] && y0 <= 0) {
+		for (int i = max(x0, 0); i < min(x1, width); i++) {
+			field->Hx[i - pitch] = simulation->bloch_sign[AX_Y] 
+					* field->Hx[(height - 1) * pitch + i];
+		}
+	}
+}
+
+// And the H update reads Ez from beyond the far edges, which is either the
+// near edge's or, across a mirror plane, the reflection of the last cells
+void wrapEz(Field* field, Simulation* simulation, int x0, int y0, int x1, 
+		int y1) {
+	int width = simulation->width;
+	int height = simulation->height;
+	int pitch = simulation->pitch;
+	if (simulation->periodic[AX_X] && x1 >= width) {
+		for (int j = max(y0, 0); j < min(y1, height); j++) {
+			field->Ez[j * pitch + width] = simulation->bloch_sign[AX_X] 
+					* field->Ez[j * pitch];
+		}
+	} else if (simulation->mirrored[AX_X] && x1 >= width) {
+		for (int j = max(y0, 0); j < min(y1, height); j++) {
+			field->Ez[j * pitch + width] = simulation->mirror_sign[AX_X] 
+					* field->Ez[j * pitch + width - 1];
+		}
+	}
+	if (simulation->periodic[AX_Y] && y1 >= height) {
+		for (int i = max(x0, 0); i < min(x1, width); i++) {
+			field->Ez[height * pitch + i] = simulation->bloch_sign[AX_Y] 
+					* field->Ez[i];
+		}
+	} else if (simulation->mirrored[AX_Y] && y1 >= height) {
+		for (int i = max(x0, 0); i < min(x1, width); i++) {
+			field->Ez[height * pitch + i] = simulation->mirror_sign[AX_Y] 
+					* field->Ez[(height - 1) * pitch + i];
+		}
+	}
+}
+
+void updateEBlock(Field* field, Simulation* simulation, int x0, int y0, 
+		int x1, int y1) {
+	wrapH(field, simulation, x0, y0, x1, y1);
+	updateECells(field, simulation, x0, y0, x1, y1);
+}
+
+// True for cells that PEC walls hold at zero
+bool onPECWall(Simulation* simulation, int x, int y) {
+	return simulation->boundary_condition == BC_PEC 
+			&& ((!simulation->periodic[AX_X] && (x == 0 
+			|| (x == simulation->width - 1 && !simulation->mirrored[AX_X])))
+			|| (!simulation->periodic[AX_Y] && (y == 0 
+			|| (y == simulation->height - 1 && !simulation->mirrored[AX_Y]))));
+}
+
+// Reflection m of a grid cell is its image in the mirror planes that m's 
+// bits pick, bit 0 for x and bit 1 for y; reflection 0 is the cell itself.
+// True if the planes exist, with the image's position and fields. Hx and 
+// Hy lie half a cell above and right of Ez, so their reflections come from
+// the cell below or to the left.
+bool reflectCell(Field* field, Simulation* simulation, int x, int y, int m,
+		int* px, int* py, float* ez, float* hx, float* hy) {
+	bool in_x = m & 1;
+	bool in_y = m & 2;
+	if ((in_x && !simulation->mirrored[AX_X]) 
+			|| (in_y && !simulation->mirrored[AX_Y])) {
+		return false;
+	}
+	int sx = in_x ? simulation->mirror_sign[AX_X] : 1;
+	int sy = in_y ? simulation->mirror_sign[AX_Y] : 1;
+	int index = y * simulation->pitch + x;
+	*px = in_x ? 2 * simulation->width - 1 - x : x;
+	*py = in_y ? 2 * simulation->height - 1 - y : y;
+	*ez = sx * sy * field->Ez[index];
+	*hx = sx * (in_y ? -sy : 1) 
+			* field->Hx[index - (in_y ? simulation->pitch : 0)];
+	*hy = (in_x ? -sx : 1) * sy * field->Hy[index - (in_x ? 1 : 0)];
+	return true;
+}
+
+// Normalizes a cell's field values into its pixel by the user-selected 
+// visualization function, drawing a material boundary over it if asked
+void colorPixel(Simulation* simulation, float* pixel, float ezVal, 
+		float hxVal, float hyVal, bool boundary) {
+	switch (simulation->vis_fxn) {
+		case VIS_TE_1:
+			float normVal = (ezVal - -1e1) / (1e2 - -1e1);
+			pixel[2] = normVal < 0.5 ? 2 * normVal : 1.0;
+			pixel[0] = normVal < 0.5 ? 2 * normVal : 2 * (1 - normVal);
+			pixel[1] = normVal > 0.5 ? 2 * (normVal - 0.5) : 0.0;
+			break;
+		case VIS_TE_2:
+			pixel[0] = (ezVal*ezVal - MIN_FIELD) / (MAX_FIELD - MIN_FIELD);
+			pixel[1] = (hxVal*hxVal - MIN_FIELD) / (MAX_FIELD - MIN_FIELD);
+			pixel[2] = (hyVal*hyVal - MIN_FIELD) / (MAX_FIELD - MIN_FIELD);
+			break;
+		default:
+			break;
+	}
+	if (boundary) {
+		pixel[0] = 0;
+		pixel[1] = 0;
+		pixel[2] = 0;
+	}
+}
+
+// Colors columns x0 to x1 - 1 of row y into the image, then their 
+// reflections in any mirror planes. Under PEC, the walls are shown as zero
+// whether or not they have been applied yet.
+void colorizeSpan(Field* field, Simulation* simulation, int y, int x0, 
+		int x1) {
+	int width = imageWidth(simulation);
+	bool pec = simulation->boundary_condition == BC_PEC;
+	float* image = simulation->image + 3 * y * width;
+	int i, px, py;
+	for (int x = x0; x < x1; x++) {
+		i = y * simulation->pitch + x;
+		float ezVal = field->Ez[i];
+		float hxVal = field->Hx[i];
+		float hyVal = field->Hy[i];
+		if (pec && onPECWall(simulation, x, y)) {
+			ezVal = hxVal = hyVal = 0;
+		}
+		colorPixel(simulation, image + 3 * x, ezVal, hxVal, hyVal, 
+				draw_material_boundaries && isBoundary(simulation, x, y));
+	}
+	if (!simulation->mirrored[AX_X] && !simulation->mirrored[AX_Y]) return;
+
+	float ezVal, hxVal, hyVal;
+	for (int m = 1; m < 4; m++) {
+		for (int x = x0; x < x1; x++) {
+			if (!reflectCell(field, simulation, x, y, m, &px, &py, &ezVal, 
+					&hxVal, &hyVal)) {
+				break;
+			}
+			if (pec && onPECWall(simulation, x, y)) {
+				ezVal = hxVal = hyVal = 0;
+			}
+			colorPixel(simulation, simulation->image + 3 * (py * width 
+					+ px), ezVal, hxVal, hyVal, draw_material_boundaries 
+					&& isBoundary(simulation, x, y));
+		}
+	}
+}
+
+// Updates Hx and Hy over columns x0 to x1 - 1 of rows y0 to y1 - 1, with
+// the same arithmetic for every engine. When the image is emitted, each row
+// is colored as soon as its H is final, while its fields are still in cache.
+void updateHCells(Field* field, Simulation* simulation, int x0, int y0, 
+		int x1, int y1) {
+	int pitch = simulation->pitch;
+	float dt = simulation->dt;
+	float dx = simulation->dx;
+	float dy = simulation->dy;
+	const float* restrict Ez = field->Ez;
+	float* restrict Hx = field->Hx;
+	float* restrict Hy = field->Hy;
+	const float* restrict Mu = field->Mu;
+	int index;
+	x1 = min(x1, simulation->width);
+	int i1 = min(x1, simulation->width - edgeCells(simulation, AX_X, true));
+	int j1 = min(y1, simulation->height - edgeCells(simulation, AX_Y, true));
+	for (int j = y0; j < j1; j++) {
+		for (int i = x0; i < i1; i++) {
+			index = j * pitch + i;
+			Hx[index] -= dt / (Mu[index] * dy) * (Ez[index + pitch] 
+					- Ez[index]);
+		}
+
+		// The last Hy of each row reads the ghost Ez past the edge
+		for (int i = x0; i < x1; i++) {
+			index = j * pitch + i;
+			Hy[index] += dt / (Mu[index] * dx) * (Ez[index + 1] - Ez[index]);
+		}
+		if (simulation->emit_image) colorizeSpan(field, simulation, j, x0, x1);
+	}
+
+	// Unless it wraps, the last row has no H update
+	if (simulation->emit_image && j1 < y1 && j1 == simulation->height - 1) {
+		colorizeSpan(field, simulation, j1, x0, x1);
+	}
+}
+
+void updateHBlock(Field* field, Simulation* simulation, int x0, int y0, 
+		int x1, int y1) {
+	wrapEz(field, simulation, x0, y0, x1, y1);
+	updateHCells(field, simulation, x0, y0, x1, y1);
+}
+
+// The cells of tile t, which the block updates clip to the grid
+void tileBlock(Simulation* simulation, int t, int* x0, int* y0) {
+	*x0 = t % simulation->activity.columns * MX_TILE_PX;
+	*y0 = t / simulation->activity.columns * MX_TILE_PX;
+}
+
+void updateETile(Field* field, Simulation* simulation, int t) {
+	int x0, y0;
+	tileBlock(simulation, t, &x0, &y0);
+	updateEBlock(field, simulation, x0, y0, x0 + MX_TILE_PX, 
+			y0 + MX_TILE_PX);
+}
+
+void updateHTile(Field* field, Simulation* simulation, int t) {
+	int x0, y0;
+	tileBlock(simulation, t, &x0, &y0);
+	updateHBlock(field, simulation, x0, y0, x0 + MX_TILE_PX, 
+			y0 + MX_TILE_PX);
+}
+
+// True if any field is nonzero in tile t
+bool tileLive(Field* field, Simulation* simulation, int t) {
+	int x0, y0;
+	tileBlock(simulation, t, &x0, &y0);
+	int x1 = min(x0 + MX_TILE_PX, simulation->width);
+	int y1 = min(y0 + MX_TILE_PX, simulation->height);
+	int index;
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			index = y * simulation->pitch + x;
+			if (field->Ez[index] != 0 || field->Hx[index] != 0 
+					|| field->Hy[index] != 0) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void freeActivity(TileActivity* activity) {
+	free(activity->seed);
+	free(activity->live);
+	free(activity->active);
+	free(activity->list);
+	free(activity->E_tiles);
+	free(activity->H_tiles);
+	free(activity->compact);
+	memset(activity, 0, sizeof(TileActivity));
+}
+
+// Marks the tiles that hold source cells, and only them, as seeds
+void seedActivity(TileActivity* activity, SourceInjection* injection, 
+		Simulation* simulation) {
+	int x, y;
+	memset(activity->seed, 0, 
+			sizeof(bool) * activity->columns * activity->rows);
+	for (int c = 0; c < injection->cellc; c++) {
+		x = injection->cell[c] % simulation->pitch;
+		y = injection->cell[c] / simulation->pitch;
+		activity->seed[y / MX_TILE_PX * activity->columns 
+				+ x / MX_TILE_PX] = true;
+	}
+}
+
+// Seeds the tiles that hold source cells. Returns false if out of memory.
+bool initActivity(TileActivity* activity, SourceInjection* injection, 
+		Simulation* simulation) {
+	memset(activity, 0, sizeof(TileActivity));
+	activity->columns = (simulation->width + MX_TILE_PX - 1) / MX_TILE_PX;
+	activity->rows = (simulation->height + MX_TILE_PX - 1) / MX_TILE_PX;
+	int tiles = activity->columns * activity->rows;
+	activity->seed = (bool*)calloc(tiles, sizeof(bool));
+	activity->live = (int*)calloc(tiles, sizeof(int));
+	activity->active = (bool*)calloc(tiles, sizeof(bool));
+	activity->list = (int*)malloc(sizeof(int) * tiles);
+	activity->compact = (int*)malloc(2 * sizeof(int) * tiles);
+	if (activity->seed == NULL || activity->live == NULL 
+			|| activity->active == NULL || activity->list == NULL 
+			|| activity->compact == NULL) {
+		freeActivity(activity);
+		return false;
+	}
+	seedActivity(activity, injection, simulation);
+	return true;
+}
+
+// After the fields are zeroed, only the seeds are live at the next step
+void resetActivity(TileActivity* activity) {
+	if (activity->list == NULL) return;
+	memset(activity->active, 0, 
+			sizeof(bool) * activity->columns * activity->rows);
+	activity->next_check = 0;
+}
+
+// Whether the steps skip any tiles
+bool sparseActivity(Simulation* simulation) {
+	TileActivity* activity = &simulation->activity;
+	return activity->list != NULL 
+			&& activity->count < activity->columns * activity->rows;
+}
+
+int sliceStart(int count, int t, int threads) {
+	return (int)((long)count * t / threads);
+}
+
+void resetTileQueue(TileQueue* queue, const int* tiles, int count, 
+		int threads) {
+	queue->tiles = tiles;
+	queue->count = count;
+	for (int t = 0; t < threads; t++) {
+		atomic_store(&queue->next[t], sliceStart(count, t, threads));
+	}
+}
+
+// The next tile for thread t, or -1 once every slice is drained
+int claimTile(TileQueue* queue, int t, int threads) {
+	int owner, end, i;
+	for (int k = 0; k < threads; k++) {
+		owner = (t + k) % threads;
+		end = sliceStart(queue->count, owner + 1, threads);
+		if (atomic_load(&queue->next[owner]) >= end) continue;
+		if ((i = atomic_fetch_add(&queue->next[owner], 1)) < end) {
+			return queue->tiles[i];
+		}
+	}
+	return -1;
+}
+
+void waitStepBarrier(StepPool* pool) {
+	pthread_mutex_lock(&pool->lock);
+	unsigned generation = pool->generation;
+	if (++pool->waiting == pool->threads) {
+		pool->waiting = 0;
+		pool->generation++;
+		pthread_cond_broadcast(&pool->wake);
+	} else {
+		while (generation == pool->generation) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// First row of thread t's band
+int bandStart(StepPool* pool, int t) {
+	return (int)((long)pool->simulation->height * t / pool->threads);
+}
+
+// The rows a thread initializes are the rows it steps, so on NUMA machines
+// their pages are allocated on its own node
+void initBand(StepPool* pool, int t) {
+	initFieldRows(pool->field, pool->simulation, bandStart(pool, t), 
+			bandStart(pool, t + 1));
+	waitStepBarrier(pool);
+}
+
+// Each thread owns a fixed band of rows. Barriers separate the start of a 
+// step, the E half-step and the H half-step, which reads Ez a row beyond its
+// band.
+void stepBand(StepPool* pool, int t) {
+	int j0 = bandStart(pool, t);
+	int j1 = bandStart(pool, t + 1);
+
+	// Thread 0 times each half-step up to its closing barrier
+	double start = t == 0 ? profileStart(pool->simulation) : 0;
+	updateEBlock(pool->field, pool->simulation, 0, j0, 
+			pool->simulation->width, j1);
+	waitStepBarrier(pool);
+	if (t == 0) {
+		profileEnd(pool->simulation, PH_E, start);
+		start = profileStart(pool->simulation);
+	}
+	updateHBlock(pool->field, pool->simulation, 0, j0, 
+			pool->simulation->width, j1);
+	waitStepBarrier(pool);
+	if (t == 0) profileEnd(pool->simulation, PH_H, start);
+}
+
+// While tiles are skipped, the threads share out the active ones instead
+// of keeping to their bands, with the same barriers
+void stepTiles(StepPool* pool, int t) {
+	Simulation* simulation = pool->simulation;
+	int tile;
+	double start = t == 0 ? profileStart(simulation) : 0;
+	while ((tile = claimTile(&pool->E_queue, t, pool->threads)) >= 0) {
+		updateETile(pool->field, simulation, tile);
+	}
+	waitStepBarrier(pool);
+	if (t == 0) {
+		profileEnd(simulation, PH_E, start);
+		start = profileStart(simulation);
+	}
+	while ((tile = claimTile(&pool->H_queue, t, pool->threads)) >= 0) {
+		updateHTile(pool->field, simulation, tile);
+	}
+	waitStepBarrier(pool);
+	if (t == 0) profileEnd(simulation, PH_H, start);
+}
+
+void* stepWorker(void* arg) {
+	StepPool* pool = ((StepTask*)arg)->pool;
+	int t = ((StepTask*)arg)->thread;
+	while (true) {
+		waitStepBarrier(pool);
+		if (pool->quit) break;
+		if (pool->job == SJ_INIT) {
+			initBand(pool, t);
+		} else if (pool->job == SJ_STEP_TILES) {
+			stepTiles(pool, t);
+		} else {
+			stepBand(pool, t);
+		}
+	}
+	return NULL;
+}
+
+StepPool* createStepPool(Simulation* simulation) {
+	StepPool* pool = (StepPool*)calloc(1, sizeof(StepPool));
+	if (pool == NULL) return NULL;
+	pool->simulation = simulation;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+
+	// The calling thread is thread 0. Workers block on the first barrier 
+	// until the pool is complete, so a failed start just shrinks the pool.
+	pthread_mutex_lock(&pool->lock);
+	pool->threads = 1;
+	for (int t = 1; t < simulation->threads; t++) {
+		pool->tasks[t].pool = pool;
+		pool->tasks[t].thread = t;
+		if (startThread(&pool->workers[t], stepWorker, &pool->tasks[t], 
+				threadCPU(t)) != 0) {
+			break;
+		}
+		pool->threads++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	pinThread(pthread_self(), threadCPU(0));
+	return pool;
+}
+
+void freeStepPool(StepPool* pool) {
+	if (pool == NULL) return;
+	pool->quit = true;
+	waitStepBarrier(pool);
+	for (int t = 1; t < pool->threads; t++) {
+		pthread_join(pool->workers[t], NULL);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	free(pool);
+	if (threadCPU(0) >= 0) {
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), 
+				&process_cpus);
+	}
+}
+
+// Vacuum and zero fields everywhere, with each band of rows first touched 
+// by the thread that steps it
+void initFields(Field* field, Simulation* simulation) {
+	StepPool* pool = simulation->pool;
+	resetActivity(&simulation->activity);
+	if (pool == NULL || pool->threads == 1) {
+		initFieldRows(field, simulation, 0, simulation->height);
+		return;
+	}
+	pool->field = field;
+	pool->job = SJ_INIT;
+	waitStepBarrier(pool);
+	initBand(pool, 0);
+}
+
+void iterateFieldsOnCPU(Field* field, Simulation* simulation) { 
+	if (simulation->threads > 1 && simulation->pool == NULL) {
+		simulation->pool = createStepPool(simulation);
+		if (simulation->pool == NULL) simulation->threads = 1;
+	}
+	TileActivity* activity = &simulation->activity;
+	bool sparse = sparseActivity(simulation);
+	StepPool* pool = simulation->pool;
+	if (pool == NULL || pool->threads == 1) {
+		double start = profileStart(simulation);
+		if (sparse) {
+			for (int i = 0; i < activity->count; i++) {
+				updateETile(field, simulation, activity->list[i]);
+			}
+		} else {
+			updateEBlock(field, simulation, 0, 0, simulation->width, 
+					simulation->height);
+		}
+		profileEnd(simulation, PH_E, start);
+		start = profileStart(simulation);
+		if (sparse) {
+			for (int i = 0; i < activity->count; i++) {
+				updateHTile(field, simulation, activity->list[i]);
+			}
+		} else {
+			updateHBlock(field, simulation, 0, 0, simulation->width, 
+					simulation->height);
+		}
+		profileEnd(simulation, PH_H, start);
+		return;
+	}
+	pool->field = field;
+	pool->job = sparse ? SJ_STEP_TILES : SJ_STEP;
+	if (sparse) {
+		resetTileQueue(&pool->E_queue, activity->list, activity->count, 
+				pool->threads);
+		resetTileQueue(&pool->H_queue, activity->list, activity->count, 
+				pool->threads);
+	}
+	waitStepBarrier(pool);
+	if (sparse) {
+		stepTiles(pool, 0);
+	} else {
+		stepBand(pool, 0);
+	}
+}
+
+void injectSourcesOnCPU(Field* field, Simulation* simulation, 
+		SourceInjection* injection) {
+	float* targets[MX_INJECT_GROUPS] = {field->Ez, field->Hx, field->Hy};
+	int sample = simulation->step - 1;
+	float sum, ramp;
+	for (int g = 0; g < MX_INJECT_GROUPS; g++) {
+		for (int c = injection->group_start[g]; 
+				c < injection->group_start[g + 1]; c++) {
+			sum = 0;
+			for (int s = injection->first[c]; s < injection->first[c + 1]; 
+					s++) {
+				ramp = sample < injection->ramp[s] ? 0.5f - 0.5f 
+						* cosf(M_PI * sample / injection->ramp[s]) : 1;
+				sum += ramp * injection->amplitude[s] 
+						* injection->phasor_im[s];
+			}
+			for (int w = injection->table_first[c]; 
+					w < injection->table_first[c + 1]; w++) {
+				if (sample < injection->table_length[w]) {
+					sum += injection->samples[injection->table_offset[w] 
+							+ sample];
+				}
+			}
+			targets[g][injection->cell[c]] += sum;
+		}
+	}
+
+	// Advance every phasor by one step, pulling its magnitude back towards 
+	// 1 so rounding errors don't accumulate
+	float re, im, norm;
+	for (int s = 0; s < injection->wavec; s++) {
+		re = injection->phasor_re[s] * injection->rotation_re[s] 
+				- injection->phasor_im[s] * injection->rotation_im[s];
+		im = injection->phasor_re[s] * injection->rotation_im[s] 
+				+ injection->phasor_im[s] * injection->rotation_re[s];
+		norm = 1.5f - 0.5f * (re * re + im * im);
+		injection->phasor_re[s] = re * norm;
+		injection->phasor_im[s] = im * norm;
+	}
+}
+
+void injectSourcesOnGPU(Simulation* simulation, SourceInjection* injection) {
+	cl_mem targets[MX_INJECT_GROUPS] = {simulation->Ez_kbuf, 
+			simulation->Hx_kbuf, simulation->Hy_kbuf};
+
+	clSetKernelArg(simulation->inject_kernel, 1, sizeof(cl_mem), 
+			&simulation->sourceCells_kbuf);
+	clSetKernelArg(simulation->inject_kernel, 2, sizeof(cl_mem), 
+			&simulation->sourceFirst_kbuf);
+	clSetKernelArg(simulation->inject_kernel, 3, sizeof(cl_mem), 
+			&simulation->phasorRe_kbuf);
+	clSetKernelArg(simulation->inject_kernel, 4, sizeof(cl_mem), 
+			&simulation->phasorIm_kbuf);
+	clSetKernelArg(simulation->inject_kernel, 5, sizeof(cl_mem), 
+			&simulation->rotationRe_kbuf);
+	clSetKernelArg(simulation->inject_kernel, 6, sizeof(cl_mem), 
+			&simulation->rotationIm_kbuf);
+	clSetKernelArg(simulation->inject_kernel, 7, sizeof(cl_mem), 
+			&simulation->amplitude_kbuf);
+	clSetKernelArg(simulation->inject_kernel, 8, sizeof(cl_mem), 
+			&simulation->ramp_kbuf);
+	clSetKernelArg(simulation->inject_kernel, 9, sizeof(cl_mem), 
+			&simulation->tableFirst_kbuf);
+	clSetKernelArg(simulation->inject_kernel, 10, sizeof(cl_mem), 
+			&simulation->tableOffset_kbuf);
+	clSetKernelArg(simulation->inject_kernel, 11, sizeof(cl_mem), 
+			&simulation->tableLength_kbuf);
+	clSetKernelArg(simulation->inject_kernel, 12, sizeof(cl_mem), 
+			&simulation->samples_kbuf);
+	int sample = simulation->step - 1;
+	clSetKernelArg(simulation->inject_kernel, 13, sizeof(int), &sample);
+
+	// One launch per field component, offset to that component's cells
+	size_t offset, size;
+	for (int g = 0; g < MX_INJECT_GROUPS; g++) {
+		offset = injection->group_start[g];
+		size = injection->group_start[g + 1] - injection->group_start[g];
+		if (size == 0) continue;
+		clSetKernelArg(simulation->inject_kernel, 0, sizeof(cl_mem), 
+				&targets[g]);
+		clEnqueueNDRangeKernel(simulation->queue, simulation->inject_kernel, 
+				1, &offset, &size, NULL, 0, NULL, 
+				profileEvent(simulation, PH_INJECT));
+	}
+}
+
+void resetInjection(SourceInjection* injection, Simulation* simulation) {
+	memcpy(injection->phasor_re, injection->start_re, 
+			sizeof(float) * injection->wavec);
+	memcpy(injection->phasor_im, injection->start_im, 
+			sizeof(float) * injection->wavec);
+	if (gpu_support && injection->wavec > 0) {
+		clEnqueueWriteBuffer(simulation->queue, simulation->phasorRe_kbuf, 
+				CL_TRUE, 0, sizeof(float) * injection->wavec, 
+				injection->phasor_re, 0, NULL, NULL);
+		clEnqueueWriteBuffer(simulation->queue, simulation->phasorIm_kbuf, 
+				CL_TRUE, 0, sizeof(float) * injection->wavec, 
+				injection->phasor_im, 0, NULL, NULL);
+	}
+}
+
+// Moves every phasor on to where steps updates would have left it, so that 
+// sources compiled while the simulation runs carry on from its current step
+void advanceInjection(SourceInjection* injection, int steps) {
+	double angle;
+	for (int s = 0; s < injection->wavec; s++) {
+		angle = atan2(injection->start_im[s], injection->start_re[s]) 
+				+ (double)steps * atan2(injection->rotation_im[s], 
+				injection->rotation_re[s]);
+		injection->phasor_re[s] = cos(angle);
+		injection->phasor_im[s] = sin(angle);
+	}
+}
+
+// Compiled sources; the buffers can't be empty, so they hold at least one 
+// (unused) entry
+void createSourceBuffers(Simulation* simulation, 
+		SourceInjection* injection) {
+	cl_context context = simulation->context;
+	int cellc = max(injection->cellc, 1);
+	int wavec = max(injection->wavec, 1);
+	int tablec = max(injection->tablec, 1);
+	int samplec = max(injection->samplec, 1);
+	cl_int err;
+	simulation->sourceCells_kbuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+			sizeof(int) * cellc, NULL, &err);
+	simulation->sourceFirst_kbuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+			sizeof(int) * (cellc + 1), NULL, &err);
+	simulation->phasorRe_kbuf = clCreateBuffer(context, CL_MEM_READ_WRITE,
+			sizeof(float) * wavec, NULL, &err);
+	simulation->phasorIm_kbuf = clCreateBuffer(context, CL_MEM_READ_WRITE,
+			sizeof(float) * wavec, NULL, &err);
+	simulation->rotationRe_kbuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+			sizeof(float) * wavec, NULL, &err);
+	simulation->rotationIm_kbuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+			sizeof(float) * wavec, NULL, &err);
+	simulation->amplitude_kbuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+			sizeof(float) * wavec, NULL, &err);
+	simulation->ramp_kbuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+			sizeof(int) * wavec, NULL, &err);
+	simulation->tableFirst_kbuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+			sizeof(int) * (cellc + 1), NULL, &err);
+	simulation->tableOffset_kbuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+			sizeof(int) * tablec, NULL, &err);
+	simulation->tableLength_kbuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+			sizeof(int) * tablec, NULL, &err);
+	simulation->samples_kbuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+			sizeof(float) * samplec, NULL, &err);
+}
+
+void releaseSourceBuffers(Simulation* simulation) {
+	cl_mem* buffers[] = {&simulation->sourceCells_kbuf, 
+			&simulation->sourceFirst_kbuf, &simulation->phasorRe_kbuf, 
+			&simulation->phasorIm_kbuf, &simulation->rotationRe_kbuf, 
+			&simulation->rotationIm_kbuf, &simulation->amplitude_kbuf, 
+			&simulation->ramp_kbuf, &simulation->tableFirst_kbuf, 
+			&simulation->tableOffset_kbuf, &simulation->tableLength_kbuf, 
+			&simulation->samples_kbuf};
+	for (size_t b = 0; b < sizeof(buffers) / sizeof(cl_mem*); b++) {
+		if (*buffers[b] != NULL) clReleaseMemObject(*buffers[b]);
+		*buffers[b] = NULL;
+	}
+}
+
+// Uploads the whole compiled table, phasors as they stand included
+void uploadSources(Simulation* simulation, SourceInjection* injection) {
+	cl_command_queue queue = simulation->queue;
+	if (injection->cellc > 0) {
+		clEnqueueWriteBuffer(queue, simulation->sourceCells_kbuf, CL_TRUE, 
+				0, sizeof(int) * injection->cellc, injection->cell, 0, NULL, 
+				NULL);
+		clEnqueueWriteBuffer(queue, simulation->sourceFirst_kbuf, CL_TRUE, 
+				0, sizeof(int) * (injection->cellc + 1), injection->first, 0, 
+				NULL, NULL);
+		clEnqueueWriteBuffer(queue, simulation->tableFirst_kbuf, CL_TRUE, 
+				0, sizeof(int) * (injection->cellc + 1), 
+				injection->table_first, 0, NULL, NULL);
+	}
+	if (injection->wavec > 0) {
+		size_t size = sizeof(float) * injection->wavec;
+		clEnqueueWriteBuffer(queue, simulation->phasorRe_kbuf, CL_TRUE, 0, 
+				size, injection->phasor_re, 0, NULL, NULL);
+		clEnqueueWriteBuffer(queue, simulation->phasorIm_kbuf, CL_TRUE, 0, 
+				size, injection->phasor_im, 0, NULL, NULL);
+		clEnqueueWriteBuffer(queue, simulation->rotationRe_kbuf, CL_TRUE, 0,
+				size, injection->rotation_re, 0, NULL, NULL);
+		clEnqueueWriteBuffer(queue, simulation->rotationIm_kbuf, CL_TRUE, 0,
+				size, injection->rotation_im, 0, NULL, NULL);
+		clEnqueueWriteBuffer(queue, simulation->amplitude_kbuf, CL_TRUE, 0, 
+				size, injection->amplitude, 0, NULL, NULL);
+		clEnqueueWriteBuffer(queue, simulation->ramp_kbuf, CL_TRUE, 0, 
+				sizeof(int) * injection->wavec, injection->ramp, 0, NULL, 
+				NULL);
+	}
+	if (injection->tablec > 0) {
+		clEnqueueWriteBuffer(queue, simulation->tableOffset_kbuf, CL_TRUE, 
+				0, sizeof(int) * injection->tablec, injection->table_offset, 
+				0, NULL, NULL);
+		clEnqueueWriteBuffer(queue, simulation->tableLength_kbuf, CL_TRUE, 
+				0, sizeof(int) * injection->tablec, injection->table_length, 
+				0, NULL, NULL);
+	}
+	if (injection->samplec > 0) {
+		clEnqueueWriteBuffer(queue, simulation->samples_kbuf, CL_TRUE, 0, 
+				sizeof(float) * injection->samplec, injection->samples, 0, 
+				NULL, NULL);
+	}
+}
+
+// Device grids have the same layout as the arena's, ghost cells included
+void uploadFields(Field* field, Simulation* simulation) {
+	size_t size = sizeof(float) * gridFloats(simulation);
+	cl_mem buffers[] = {simulation->Epsilon_kbuf, simulation->Mu_kbuf, 
+			simulation->Sigma_kbuf, simulation->Ez_kbuf, simulation->Hx_kbuf,
+			simulation->Hy_kbuf};
+	float* grids[] = {field->Epsilon, field->Mu, field->Sigma, field->Ez, 
+			field->Hx, field->Hy};
+	for (size_t b = 0; b < sizeof(buffers) / sizeof(cl_mem); b++) {
+		clEnqueueWriteBuffer(simulation->queue, buffers[b], CL_TRUE, 0, size,
+				grids[b] - simulation->origin, 0, NULL, NULL);
+	}
+}
+
+// Zeroes the dynamic fields, where they are stepped, to start over. Nothing
+// writes the materials once the scene is built, so they stay as they were 
+// rasterized and need neither rebuilding nor uploading again.
+void resetFields(Field* field, Simulation* simulation) {
+	size_t size = sizeof(float) * gridFloats(simulation);
+	resetActivity(&simulation->activity);
+	if (gpu_support) {
+		float zero = 0;
+		cl_mem buffers[] = {simulation->Ez_kbuf, simulation->Hx_kbuf, 
+				simulation->Hy_kbuf};
+		for (size_t b = 0; b < sizeof(buffers) / sizeof(cl_mem); b++) {
+			clEnqueueFillBuffer(simulation->queue, buffers[b], &zero, 
+					sizeof(float), 0, size, 0, NULL, NULL);
+		}
+		return;
+	}
+	float* grids[] = {field->Ex, field->Ey, field->Ez, field->Hx, field->Hy,
+			field->Hz};
+	for (size_t g = 0; g < sizeof(grids) / sizeof(float*); g++) {
+		memset(grids[g] - simulation->origin, 0, size);
+	}
+}
+
+// PEC walls only touch the 2 * (width + height) - 4 cells of the grid's 
+// edge, so neither engine visits the interior. Walls run along the edges
+// that don't wrap, except where a mirror plane takes the far edge's place:
+// the kernel takes the bottom and top rows first, then the ends of the 
+// rows between them.
+int wallCount(Simulation* simulation, Axis axis) {
+	return simulation->periodic[axis] ? 0 
+			: simulation->mirrored[axis] ? 1 : 2;
+}
+
+void applyPECOnGPU(Simulation* simulation) {
+	int rows = wallCount(simulation, AX_Y);
+	int columns = wallCount(simulation, AX_X);
+	size_t global_size = rows * simulation->width 
+			+ columns * max(simulation->height - rows, 0);
+	if (global_size == 0) return;
+	clSetKernelArg(simulation->PEC_kernel, 0, sizeof(cl_mem), 
+			&simulation->Ez_kbuf);
+	clSetKernelArg(simulation->PEC_kernel, 1, sizeof(cl_mem), 
+			&simulation->Hx_kbuf);
+	clSetKernelArg(simulation->PEC_kernel, 2, sizeof(cl_mem), 
+			&simulation->Hy_kbuf);
+	clSetKernelArg(simulation->PEC_kernel, 3, sizeof(int), 
+			&simulation->width);
+	clSetKernelArg(simulation->PEC_kernel, 4, sizeof(int), 
+			&simulation->height);
+	clEnqueueNDRangeKernel(simulation->queue, simulation->PEC_kernel, 1, 
+			NULL, &global_size, NULL, 0, NULL, 
+			profileEvent(simulation, PH_BOUNDARY));
+}
+
+void applyPECOnCPU(Field* field, Simulation* simulation) {
+	int width = simulation->width;
+	int height = simulation->height;
+	int pitch = simulation->pitch;
+	int rows = wallCount(simulation, AX_Y);
+	int columns = wallCount(simulation, AX_X);
+	float* fields[3] = {field->Ez, field->Hx, field->Hy};
+	for (int f = 0; f < 3; f++) {
+		for (int r = 0; r < rows; r++) {
+			memset(fields[f] + r * (height - 1) * pitch, 0, 
+					sizeof(float) * width);
+		}
+		for (int j = min(rows, 1); j < height - rows / 2; j++) {
+			for (int c = 0; c < columns; c++) {
+				fields[f][j * pitch + c * (width - 1)] = 0;
+			}
+		}
+	}
+}
+
+const char* tuned_kernel_names[TK_MAX] = {"updateETiles", "updateHTiles",
+		"visualizeTE1", "visualizeTE2", "drawMaterialBoundaries"};
+const char* E_kernel_names[TC_MAX] = {"updateEVacuum", "updateEDielectric",
+		"updateELossy"};
+const char* H_kernel_names[TC_MAX] = {"updateHVacuum", "updateHMaterial", 
+		NULL};
+const char* H_image_kernel_names[TC_MAX] = {"updateHVacuumImage", 
+		"updateHMaterialImage", NULL};
+
+// Field values mapped to the ends of each visualization's color scale
+const float vis_min_fields[VIS_MAX] = {-1e1, (float)MIN_FIELD};
+const float vis_max_fields[VIS_MAX] = {1e2, (float)MAX_FIELD};
+
+// Work-group shapes tried by the autotuner; {0, 0} leaves the shape to the
+// driver
+const size_t work_group_candidates[][2] = {{0, 0}, {8, 8}, {16, 4}, 
+		{16, 8}, {16, 16}, {32, 1}, {32, 4}, {32, 8}, {64, 1}, {64, 2}, 
+		{64, 4}, {128, 1}, {256, 1}};
+
+// The field updates are tuned as a whole, with the most general variant 
+// standing in for them where a single kernel is needed
+cl_kernel tunedKernel(Simulation* simulation, TunedKernel k) {
+	switch (k) {
+		case TK_E:
+			return simulation->E_kernels[TC_LOSSY];
+		case TK_H:
+			return simulation->H_kernels[TC_DIELECTRIC];
+		case TK_VIS_TE_1:
+			return simulation->VIS_TE_1_kernel;
+		case TK_VIS_TE_2:
+			return simulation->VIS_TE_2_kernel;
+		default:
+			return simulation->drawMatBounds_kernel;
+	}
+}
+
+bool tiledKernel(TunedKernel k) {
+	return k == TK_E || k == TK_H;
+}
+
+// The global size is padded up to whole work-groups; the kernels skip 
+// work items beyond the grid. Work-groups of the tiled field updates are 
+// kept within a tile.
+void setWorkGroup(Simulation* simulation, TunedKernel k, size_t x, 
+		size_t y) {
+	if (tiledKernel(k)) {
+		x = x < MX_TILE_PX ? x : MX_TILE_PX;
+		y = y < MX_TILE_PX ? y : MX_TILE_PX;
+	}
+	simulation->local_size[k][0] = x;
+	simulation->local_size[k][1] = y;
+	simulation->global_size[k][0] = x == 0 ? (size_t)simulation->width 
+			: (simulation->width + x - 1) / x * x;
+	simulation->global_size[k][1] = y == 0 ? (size_t)simulation->height 
+			: (simulation->height + y - 1) / y * y;
+}
+
+// Launches part of a tuned kernel: for the field updates, the variant for
+// one tile class, and otherwise the whole kernel as part 0. A part with 
+// nothing to do leaves the event NULL.
+cl_int enqueueTuned(Simulation* simulation, TunedKernel k, int part, 
+		cl_event* event) {
+	size_t* local = simulation->local_size[k][0] == 0 ? NULL 
+			: simulation->local_size[k];
+	if (!tiledKernel(k)) {
+		return clEnqueueNDRangeKernel(simulation->queue, 
+				tunedKernel(simulation, k), 2, NULL, 
+				simulation->global_size[k], local, 0, NULL, event);
+	}
+
+	int* start = k == TK_E ? simulation->E_tile_start 
+			: simulation->H_tile_start;
+	size_t offset[2] = {(size_t)start[part] * MX_TILE_PX, 0};
+	size_t global_size[2] = {(size_t)(start[part + 1] - start[part]) 
+			* MX_TILE_PX, MX_TILE_PX};
+	if (global_size[0] == 0) {
+		if (event != NULL) *event = NULL;
+		return CL_SUCCESS;
+	}
+	cl_kernel kernel = k == TK_E ? simulation->E_kernels[part] 
+			: simulation->emit_image ? simulation->H_image_kernels[part] 
+			: simulation->H_kernels[part];
+	return clEnqueueNDRangeKernel(simulation->queue, kernel, 2, offset, 
+			global_size, local, 0, NULL, event);
+}
+
+int tunedParts(TunedKernel k) {
+	return tiledKernel(k) ? TC_MAX : 1;
+}
+
+// The kernels' arguments never change, so they are set once, except for 
+// the fused H updates' view settings, which are set with each frame
+void setKernelArgs(Simulation* simulation) {
+	for (int c = 0; c < TC_MAX; c++) {
+		cl_kernel E_kernel = simulation->E_kernels[c];
+		clSetKernelArg(E_kernel, 0, sizeof(cl_mem), &simulation->Hx_kbuf);
+		clSetKernelArg(E_kernel, 1, sizeof(cl_mem), &simulation->Hy_kbuf);
+		clSetKernelArg(E_kernel, 2, sizeof(cl_mem), &simulation->Ez_kbuf);
+		clSetKernelArg(E_kernel, 3, sizeof(cl_mem), 
+				&simulation->Epsilon_kbuf);
+		clSetKernelArg(E_kernel, 4, sizeof(cl_mem), &simulation->Sigma_kbuf);
+		clSetKernelArg(E_kernel, 5, sizeof(cl_mem), 
+				&simulation->Etiles_kbuf);
+
+		cl_kernel H_kernel = simulation->H_kernels[c];
+		if (H_kernel == NULL) continue;
+		clSetKernelArg(H_kernel, 0, sizeof(cl_mem), &simulation->Hx_kbuf);
+		clSetKernelArg(H_kernel, 1, sizeof(cl_mem), &simulation->Hy_kbuf);
+		clSetKernelArg(H_kernel, 2, sizeof(cl_mem), &simulation->Ez_kbuf);
+		clSetKernelArg(H_kernel, 3, sizeof(cl_mem), &simulation->Mu_kbuf);
+		clSetKernelArg(H_kernel, 4, sizeof(cl_mem), 
+				&simulation->Htiles_kbuf);
+
+		H_kernel = simulation->H_image_kernels[c];
+		clSetKernelArg(H_kernel, 0, sizeof(cl_mem), &simulation->Hx_kbuf);
+		clSetKernelArg(H_kernel, 1, sizeof(cl_mem), &simulation->Hy_kbuf);
+		clSetKernelArg(H_kernel, 2, sizeof(cl_mem), &simulation->Ez_kbuf);
+		clSetKernelArg(H_kernel, 3, sizeof(cl_mem), &simulation->Mu_kbuf);
+		clSetKernelArg(H_kernel, 4, sizeof(cl_mem), 
+				&simulation->Htiles_kbuf);
+		clSetKernelArg(H_kernel, 5, sizeof(cl_mem), 
+				&simulation->image_kbuf);
+		clSetKernelArg(H_kernel, 6, sizeof(cl_mem), 
+				&simulation->matBoundMask_kbuf);
+		clSetKernelArg(H_kernel, 7, sizeof(int), &simulation->mask_pitch);
+	}
+
+	cl_kernel vis_kernels[VIS_MAX] = {simulation->VIS_TE_1_kernel, 
+			simulation->VIS_TE_2_kernel};
+	for (int v = 0; v < VIS_MAX; v++) {
+		clSetKernelArg(vis_kernels[v], 0, sizeof(cl_mem), 
+				&simulation->image_kbuf);
+		clSetKernelArg(vis_kernels[v], 1, sizeof(cl_mem), 
+				&simulation->Hx_kbuf);
+		clSetKernelArg(vis_kernels[v], 2, sizeof(cl_mem), 
+				&simulation->Hy_kbuf);
+		clSetKernelArg(vis_kernels[v], 3, sizeof(cl_mem), 
+				&simulation->Ez_kbuf);
+		clSetKernelArg(vis_kernels[v], 4, sizeof(float), 
+				&vis_min_fields[v]);
+		clSetKernelArg(vis_kernels[v], 5, sizeof(float), 
+				&vis_max_fields[v]);
+		clSetKernelArg(vis_kernels[v], 6, sizeof(int), &simulation->width);
+		clSetKernelArg(vis_kernels[v], 7, sizeof(int), &simulation->height);
+	}
+
+	clSetKernelArg(simulation->drawMatBounds_kernel, 0, sizeof(cl_mem),
+			&simulation->image_kbuf);
+	clSetKernelArg(simulation->drawMatBounds_kernel, 1, sizeof(cl_mem),
+			&simulation->matBoundMask_kbuf);
+	clSetKernelArg(simulation->drawMatBounds_kernel, 2, sizeof(int),
+			&simulation->width);
+	clSetKernelArg(simulation->drawMatBounds_kernel, 3, sizeof(int),
+			&simulation->mask_pitch);
+	clSetKernelArg(simulation->drawMatBounds_kernel, 4, sizeof(int),
+			&simulation->height);
+
+	if (simulation->wrapH_kernel != NULL) {
+		clSetKernelArg(simulation->wrapH_kernel, 0, sizeof(cl_mem), 
+				&simulation->Hx_kbuf);
+		clSetKernelArg(simulation->wrapH_kernel, 1, sizeof(cl_mem), 
+				&simulation->Hy_kbuf);
+		clSetKernelArg(simulation->wrapEz_kernel, 0, sizeof(cl_mem), 
+				&simulation->Ez_kbuf);
+	}
+
+	if (simulation->markLive_kernel != NULL) {
+		clSetKernelArg(simulation->markLive_kernel, 0, sizeof(cl_mem), 
+				&simulation->Ez_kbuf);
+		clSetKernelArg(simulation->markLive_kernel, 1, sizeof(cl_mem), 
+				&simulation->Hx_kbuf);
+		clSetKernelArg(simulation->markLive_kernel, 2, sizeof(cl_mem), 
+				&simulation->Hy_kbuf);
+		clSetKernelArg(simulation->markLive_kernel, 3, sizeof(cl_mem), 
+				&simulation->Etiles_kbuf);
+		clSetKernelArg(simulation->markLive_kernel, 4, sizeof(cl_mem), 
+				&simulation->live_kbuf);
+	}
+}
+
+// A file under $XDG_CACHE_HOME/maxwell or ~/.cache/maxwell. Returns NULL 
+// if there is nowhere to keep it.
+char* userCachePath(const char* name) {
+	const char* base = getenv("XDG_CACHE_HOME");
+	const char* dir = "maxwell";
+	if (base == NULL || base[0] == '\0') {
+		base = getenv("HOME");
+		dir = ".cache/maxwell";
+	}
+	if (base == NULL || base[0] == '\0') return NULL;
+	size_t length = strlen(base) + strlen(dir) + strlen(name) + 3;
+	char* path = (char*)malloc(length);
+	if (path != NULL) snprintf(path, length, "%s/%s/%s", base, dir, name);
+	return path;
+}
+
+// The cache file named in the simulation file, or by default the user's
+char* tuningCachePath(Simulation* simulation) {
+	if (simulation->tuning_path != NULL) {
+		return strdup(simulation->tuning_path);
+	}
+	return userCachePath("workgroups");
+}
+
+// Devices are told apart by name and driver version
+void deviceKey(cl_device_id device, char* key, size_t length) {
+	char driver[MX_TUNE_LINE_MAXL / 4] = "";
+	key[0] = '\0';
+	clGetDeviceInfo(device, CL_DEVICE_NAME, length - 1, key, NULL);
+	key[length - 1] = '\0';
+	clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver) - 1, driver, 
+			NULL);
+	size_t used = strlen(key);
+	snprintf(key + used, length - used, " %s", driver);
+	for (char* c = key; *c != '\0'; c++) {
+		if (*c == '\t' || *c == '\n') *c = ' ';
+	}
+}
+
+void makeParentDirs(const char* path) {
+	char* dir = strdup(path);
+	if (dir == NULL) return;
+	for (char* slash = strchr(dir + 1, '/'); slash != NULL; 
+			slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		mkdir(dir, 0755);
+		*slash = '/';
+	}
+	free(dir);
+}
+
+// Cache entries are lines of tab-separated device, kernel, grid width and 
+// height, and work-group width and height. Later entries win.
+bool findWorkGroup(FILE* cache, const char* device, TunedKernel k, 
+		Simulation* simulation, size_t* x, size_t* y) {
+	char line[MX_TUNE_LINE_MAXL];
+	char entry_device[MX_TUNE_LINE_MAXL];
+	char entry_kernel[MX_TUNE_LINE_MAXL];
+	int width, height;
+	size_t entry_x, entry_y;
+	bool found = false;
+	rewind(cache);
+	while (fgets(line, sizeof(line), cache) != NULL) {
+		if (sscanf(line, "%[^\t]\t%[^\t]\t%d\t%d\t%zu\t%zu", entry_device, 
+				entry_kernel, &width, &height, &entry_x, &entry_y) == 6
+				&& strcmp(entry_device, device) == 0 
+				&& strcmp(entry_kernel, tuned_kernel_names[k]) == 0
+				&& width == simulation->width 
+				&& height == simulation->height) {
+			*x = entry_x;
+			*y = entry_y;
+			found = true;
+		}
+	}
+	return found;
+}
+
+// Best time in nanoseconds of MX_TUNE_REPEATS runs after a warm-up, each
+// run launching every part of the kernel
+double timeWorkGroup(Simulation* simulation, TunedKernel k) {
+	double best = INFINITY;
+	cl_event event;
+	cl_ulong start, end;
+	for (int r = 0; r <= MX_TUNE_REPEATS; r++) {
+		double total = 0;
+		for (int part = 0; part < tunedParts(k); part++) {
+			if (enqueueTuned(simulation, k, part, &event) != CL_SUCCESS) {
+				return INFINITY;
+			}
+			if (event == NULL) continue;
+			if (clWaitForEvents(1, &event) == CL_SUCCESS 
+					&& clGetEventProfilingInfo(event, 
+					CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, 
+					NULL) == CL_SUCCESS && clGetEventProfilingInfo(event, 
+					CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL) 
+					== CL_SUCCESS) {
+				total += (double)(end - start);
+			}
+			clReleaseEvent(event);
+		}
+		if (r > 0) best = fmin(best, total);
+	}
+	return best;
+}
+
+// Picks each tuned kernel's work-group shape, from the cache when this 
+// device and grid size have been seen before and otherwise by timing the 
+// candidates, which runs the kernels on the device's fields. Returns true
+// if it did, so the fields need uploading again.
+bool autotuneKernels(Simulation* simulation) {
+	for (int k = 0; k < TK_MAX; k++) setWorkGroup(simulation, k, 0, 0);
+	if (!simulation->autotune) return false;
+
+	char device[MX_TUNE_LINE_MAXL / 2];
+	deviceKey(simulation->device, device, sizeof(device));
+	size_t max_items[3] = {0, 0, 0};
+	clGetDeviceInfo(simulation->device, CL_DEVICE_MAX_WORK_ITEM_SIZES, 
+			sizeof(max_items), max_items, NULL);
+
+	char* path = tuningCachePath(simulation);
+	FILE* cache = path != NULL ? fopen(path, "r") : NULL;
+	FILE* append = NULL;
+	bool ran = false;
+	size_t x, y;
+	for (int k = 0; k < TK_MAX; k++) {
+		if (cache != NULL 
+				&& findWorkGroup(cache, device, k, simulation, &x, &y)) {
+			setWorkGroup(simulation, k, x, y);
+			continue;
+		}
+
+		size_t max_group = 0;
+		clGetKernelWorkGroupInfo(tunedKernel(simulation, k), 
+				simulation->device, CL_KERNEL_WORK_GROUP_SIZE, 
+				sizeof(size_t), &max_group, NULL);
+		double best = INFINITY;
+		size_t best_x = 0, best_y = 0;
+		int candidates = sizeof(work_group_candidates) / (2 * sizeof(size_t));
+		size_t tried[sizeof(work_group_candidates) / (2 * sizeof(size_t))][2];
+		int triedc = 0;
+		for (int c = 0; c < candidates; c++) {
+			x = work_group_candidates[c][0];
+			y = work_group_candidates[c][1];
+			if (x != 0 && (x * y > max_group || x > max_items[0] 
+					|| y > max_items[1])) {
+				continue;
+			}
+
+			// Shapes clipped to a tile may repeat an earlier candidate
+			setWorkGroup(simulation, k, x, y);
+			x = simulation->local_size[k][0];
+			y = simulation->local_size[k][1];
+			bool repeat = false;
+			for (int t = 0; t < triedc; t++) {
+				repeat |= tried[t][0] == x && tried[t][1] == y;
+			}
+			if (repeat) continue;
+			tried[triedc][0] = x;
+			tried[triedc++][1] = y;
+			double time = timeWorkGroup(simulation, k);
+			ran = true;
+			if (time < best) {
+				best = time;
+				best_x = x;
+				best_y = y;
+			}
+		}
+		setWorkGroup(simulation, k, best_x, best_y);
+		if (best_x == 0) {
+			printf("Tuned %s: driver's work-groups are fastest.\n", 
+					tuned_kernel_names[k]);
+		} else {
+			printf("Tuned %s: %zux%zu work-groups.\n", tuned_kernel_names[k],
+					best_x, best_y);
+		}
+
+		if (append == NULL && path != NULL) {
+			makeParentDirs(path);
+			append = fopen(path, "a");
+		}
+		if (append != NULL) {
+			fprintf(append, "%s\t%s\t%d\t%d\t%zu\t%zu\n", device, 
+					tuned_kernel_names[k], simulation->width, 
+					simulation->height, best_x, best_y);
+		}
+	}
+	if (cache != NULL) fclose(cache);
+	if (append != NULL && fclose(append) != 0) {
+		fprintf(stderr, "Warning: Failed to write work-group cache %s\n", 
+				path);
+	}
+	free(path);
+	return ran;
+}
+
+// Grid shape, layout and step constants, compiled into the kernels
+void programBuildOptions(Simulation* simulation, char* options, 
+		size_t length) {
+	snprintf(options, length, "-D MX_WIDTH=%d -D MX_HEIGHT=%d -D MX_PITCH=%d "
+			"-D MX_ORIGIN=%d -D MX_TILE=%d -D MX_DT=%af -D MX_DX=%af "
+			"-D MX_DY=%af -D MX_EPS0=%af -D MX_MU0=%af -D MX_PEC=%d "
+			"-D MX_PERIODIC_X=%d -D MX_PERIODIC_Y=%d -D MX_BLOCH_X=%d "
+			"-D MX_BLOCH_Y=%d -D MX_MIRROR_X=%d -D MX_MIRROR_Y=%d", 
+			simulation->width, simulation->height, simulation->pitch, 
+			simulation->origin, MX_TILE_PX, simulation->dt, simulation->dx,
+			simulation->dy, (float)VACUUM_PERMITTIVITY, 
+			(float)VACUUM_PERMEABILITY, 
+			simulation->boundary_condition == BC_PEC, 
+			simulation->periodic[AX_X], simulation->periodic[AX_Y], 
+			simulation->bloch_sign[AX_X], simulation->bloch_sign[AX_Y],
+			simulation->mirrored[AX_X] ? simulation->mirror_sign[AX_X] : 0,
+			simulation->mirrored[AX_Y] ? simulation->mirror_sign[AX_Y] : 0);
+}
+
+// Built programs are kept under the user's cache directory, named for a 
+// hash of the source, the build options and the device, so each 
+// specialization is compiled once
+char* programCachePath(cl_device_id device, const char* source, 
+		const char* options) {
+	char key[MX_TUNE_LINE_MAXL / 2];
+	deviceKey(device, key, sizeof(key));
+	uint64_t hash = hashBytes(MX_FNV_OFFSET, source, strlen(source));
+	hash = hashBytes(hash, options, strlen(options));
+	hash = hashBytes(hash, key, strlen(key));
+	char name[64];
+	snprintf(name, sizeof(name), "programs/%016llx.bin", 
+			(unsigned long long)hash);
+	return userCachePath(name);
+}
+
+// Returns NULL if there is no usable binary at path
+cl_program loadProgramBinary(cl_context context, cl_device_id device, 
+		const char* path) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) return NULL;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	rewind(file);
+	unsigned char* binary = size > 0 ? (unsigned char*)malloc(size) : NULL;
+	bool ok = binary != NULL && fread(binary, 1, size, file) == (size_t)size;
+	fclose(file);
+	if (!ok) {
+		free(binary);
+		return NULL;
+	}
+
+	size_t length = size;
+	const unsigned char* binaries[] = {binary};
+	cl_int status, err;
+	cl_program program = clCreateProgramWithBinary(context, 1, &device, 
+			&length, binaries, &status, &err);
+	free(binary);
+	if (err != CL_SUCCESS || status != CL_SUCCESS) {
+		if (program != NULL) clReleaseProgram(program);
+		return NULL;
+	}
+	return program;
+}
+
+void saveProgramBinary(cl_program program, const char* path) {
+	size_t size;
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), 
+			&size, NULL) != CL_SUCCESS || size == 0) {
+		return;
+	}
+	unsigned char* binary = (unsigned char*)malloc(size);
+	size_t length = strlen(path) + 32;
+	char* temp_path = (char*)malloc(length);
+	if (binary == NULL || temp_path == NULL) {
+		free(binary);
+		free(temp_path);
+		return;
+	}
+	snprintf(temp_path, length, "%s.%d", path, (int)getpid());
+
+	bool ok = false;
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, 
+			sizeof(unsigned char*), &binary, NULL) == CL_SUCCESS) {
+		makeParentDirs(path);
+		FILE* file = fopen(temp_path, "wb");
+		ok = file != NULL && fwrite(binary, 1, size, file) == size;
+		if (file != NULL && fclose(file) != 0) ok = false;
+		ok = ok && rename(temp_path, path) == 0;
+		if (!ok) remove(temp_path);
+	}
+	if (!ok) {
+		fprintf(stderr, "Warning: Failed to cache OpenCL program in %s\n", 
+				path);
+	}
+	free(binary);
+	free(temp_path);
+}
+
+// The cheapest variant that updates every cell of the tile at (x0, y0) 
+// exactly. The E update depends on epsilon and sigma, the H update on mu.
+TileClass tileClass(Field* field, Simulation* simulation, int x0, int y0, 
+		bool magnetic) {
+	float eps0 = VACUUM_PERMITTIVITY;
+	float mu0 = VACUUM_PERMEABILITY;
+	int x1 = min(x0 + MX_TILE_PX, simulation->width);
+	int y1 = min(y0 + MX_TILE_PX, simulation->height);
+	TileClass tile_class = TC_VACUUM;
+	int index;
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			index = y * simulation->pitch + x;
+			if (magnetic) {
+				if (field->Mu[index] != mu0) return TC_DIELECTRIC;
+			} else if (field->Sigma[index] != 0) {
+				return TC_LOSSY;
+			} else if (field->Epsilon[index] != eps0) {
+				tile_class = TC_DIELECTRIC;
+			}
+		}
+	}
+	return tile_class;
+}
+
+// Lists the origins of the grid's tiles as (x, y) pairs, grouped by class;
+// class c's tiles start at start[c]. Returns NULL if out of memory.
+int* sortTiles(Field* field, Simulation* simulation, bool magnetic, 
+		int* start) {
+	int cols = (simulation->width + MX_TILE_PX - 1) / MX_TILE_PX;
+	int rows = (simulation->height + MX_TILE_PX - 1) / MX_TILE_PX;
+	int count = cols * rows;
+	int* tiles = (int*)malloc(2 * sizeof(int) * count);
+	TileClass* classes = (TileClass*)malloc(sizeof(TileClass) * count);
+	if (tiles == NULL || classes == NULL) {
+		free(tiles);
+		free(classes);
+		return NULL;
+	}
+
+	int next[TC_MAX] = {0};
+	for (int t = 0; t < count; t++) {
+		classes[t] = tileClass(field, simulation, t % cols * MX_TILE_PX, 
+				t / cols * MX_TILE_PX, magnetic);
+		next[classes[t]]++;
+	}
+	start[0] = 0;
+	for (int c = 0; c < TC_MAX; c++) {
+		start[c + 1] = start[c] + next[c];
+		next[c] = start[c];
+	}
+	for (int t = 0; t < count; t++) {
+		int slot = next[classes[t]]++;
+		tiles[2 * slot] = t % cols * MX_TILE_PX;
+		tiles[2 * slot + 1] = t / cols * MX_TILE_PX;
+	}
+	free(classes);
+	return tiles;
+}
+
+// The fused H updates color the image as the view is currently set up
+void setImageArgs(Simulation* simulation) {
+	int vis = simulation->vis_fxn;
+	int overlay = draw_material_boundaries;
+	for (int c = 0; c < TC_MAX; c++) {
+		cl_kernel kernel = simulation->H_image_kernels[c];
+		if (kernel == NULL) continue;
+		clSetKernelArg(kernel, 8, sizeof(int), &vis);
+		clSetKernelArg(kernel, 9, sizeof(int), &overlay);
+		clSetKernelArg(kernel, 10, sizeof(float), &vis_min_fields[vis]);
+		clSetKernelArg(kernel, 11, sizeof(float), &vis_max_fields[vis]);
+	}
+}
+
+void iterateFieldsOnGPU(Simulation* simulation) {
+	// Fields and materials stay resident on the device between steps, and
+	// the kernels' arguments are set once by setKernelArgs. Each half-step
+	// is one launch per tile class, after the ghost cells it reads past 
+	// periodic edges and mirror planes are filled.
+	bool periodic = simulation->periodic[AX_X] || simulation->periodic[AX_Y];
+	bool ghosts = simulation->wrapEz_kernel != NULL;
+	size_t edge = max(simulation->width, simulation->height);
+	if (periodic) {
+		clEnqueueNDRangeKernel(simulation->queue, simulation->wrapH_kernel, 
+				1, NULL, &edge, NULL, 0, NULL, 
+				profileEvent(simulation, PH_BOUNDARY));
+	}
+	for (int c = 0; c < TC_MAX; c++) {
+		enqueueTuned(simulation, TK_E, c, profileEvent(simulation, PH_E));
+	}
+	if (ghosts) {
+		clEnqueueNDRangeKernel(simulation->queue, simulation->wrapEz_kernel, 
+				1, NULL, &edge, NULL, 0, NULL, 
+				profileEvent(simulation, PH_BOUNDARY));
+	}
+	if (simulation->emit_image) setImageArgs(simulation);
+	for (int c = 0; c < TC_MAX; c++) {
+		enqueueTuned(simulation, TK_H, c, profileEvent(simulation, PH_H));
+	}
+}
+
+// Reads back which of the active tiles hold nonzero fields
+void markLiveTilesOnGPU(Simulation* simulation) {
+	TileActivity* activity = &simulation->activity;
+	size_t size = sizeof(int) * activity->columns * activity->rows;
+	memset(activity->live, 0, size);
+	clEnqueueWriteBuffer(simulation->queue, simulation->live_kbuf, CL_TRUE, 
+			0, size, activity->live, 0, NULL, NULL);
+	size_t global_size[2] = {(size_t)simulation->E_tile_start[TC_MAX] 
+			* MX_TILE_PX, MX_TILE_PX};
+	if (global_size[0] > 0) {
+		clEnqueueNDRangeKernel(simulation->queue, simulation->markLive_kernel,
+				2, NULL, global_size, NULL, 0, NULL, NULL);
+	}
+	clEnqueueReadBuffer(simulation->queue, simulation->live_kbuf, CL_TRUE, 
+			0, size, activity->live, 0, NULL, NULL);
+}
+
+// Narrows a class-sorted tile list to the active tiles, keeping their 
+// order, into the activity's scratch list
+void filterTiles(TileActivity* activity, const int* tiles, 
+		const int* start, int* active_start) {
+	int n = 0;
+	int t;
+	active_start[0] = 0;
+	for (int c = 0; c < TC_MAX; c++) {
+		for (int i = start[c]; i < start[c + 1]; i++) {
+			t = tiles[2 * i + 1] / MX_TILE_PX * activity->columns 
+					+ tiles[2 * i] / MX_TILE_PX;
+			if (!activity->active[t]) continue;
+			activity->compact[2 * n] = tiles[2 * i];
+			activity->compact[2 * n + 1] = tiles[2 * i + 1];
+			n++;
+		}
+		active_start[c + 1] = n;
+	}
+}
+
+void uploadActiveTiles(Simulation* simulation) {
+	TileActivity* activity = &simulation->activity;
+	filterTiles(activity, activity->E_tiles, activity->E_start, 
+			simulation->E_tile_start);
+	if (simulation->E_tile_start[TC_MAX] > 0) {
+		clEnqueueWriteBuffer(simulation->queue, simulation->Etiles_kbuf, 
+				CL_TRUE, 0, 2 * sizeof(int) * simulation->E_tile_start[TC_MAX],
+				activity->compact, 0, NULL, NULL);
+	}
+	filterTiles(activity, activity->H_tiles, activity->H_start, 
+			simulation->H_tile_start);
+	if (simulation->H_tile_start[TC_MAX] > 0) {
+		clEnqueueWriteBuffer(simulation->queue, simulation->Htiles_kbuf, 
+				CL_TRUE, 0, 2 * sizeof(int) * simulation->H_tile_start[TC_MAX],
+				activity->compact, 0, NULL, NULL);
+	}
+}
+
+// Uploads the material grids and boundary mask under the listed bins, 
+// which are in ascending order, one rectangle per run of adjacent bins 
+// along a row of them
+void uploadMaterialBins(Field* field, Simulation* simulation, 
+		SpatialIndex* index, const int* bins, int binc) {
+	cl_mem buffers[MX_MAP_GRIDS] = {simulation->Epsilon_kbuf, 
+			simulation->Mu_kbuf, simulation->Sigma_kbuf};
+	float* grids[MX_MAP_GRIDS] = {field->Epsilon, field->Mu, field->Sigma};
+	size_t pitch = sizeof(float) * simulation->pitch;
+	size_t mask_pitch = sizeof(uint32_t) * simulation->mask_pitch;
+	BoundingBox first, last;
+	int j;
+	for (int i = 0; i < binc; i = j) {
+		for (j = i + 1; j < binc && bins[j] == bins[j - 1] + 1 
+				&& bins[j] % index->cols != 0; j++);
+		binTile(index, bins[i], simulation, &first);
+		binTile(index, bins[j - 1], simulation, &last);
+
+		// Device rows start with the same line of ghost cells as the arena's
+		size_t origin[3] = {sizeof(float) * (MX_ROW_ALIGN + first.x0), 
+				first.y0 + 1, 0};
+		size_t region[3] = {sizeof(float) * (last.x1 - first.x0 + 1), 
+				first.y1 - first.y0 + 1, 1};
+		for (int q = 0; q < MX_MAP_GRIDS; q++) {
+			clEnqueueWriteBufferRect(simulation->queue, buffers[q], CL_TRUE, 
+					origin, origin, region, pitch, 0, pitch, 0, 
+					grids[q] - simulation->origin, 0, NULL, NULL);
+		}
+		size_t mask_origin[3] = {sizeof(uint32_t) * (first.x0 
+				/ MX_MASK_WORD_BITS), first.y0, 0};
+		size_t mask_region[3] = {sizeof(uint32_t) * (last.x1 
+				/ MX_MASK_WORD_BITS - first.x0 / MX_MASK_WORD_BITS + 1), 
+				region[1], 1};
+		clEnqueueWriteBufferRect(simulation->queue, 
+				simulation->matBoundMask_kbuf, CL_TRUE, mask_origin, 
+				mask_origin, mask_region, mask_pitch, 0, mask_pitch, 0, 
+				simulation->matBoundMask, 0, NULL, NULL);
+	}
+}
+
+// Sorts the tiles by class again after the materials have changed. Under 
+// ActiveTiles the full lists are swapped in for the next check to narrow; 
+// otherwise they go straight to the device. Returns false if out of memory,
+// leaving the old classes in place.
+bool resortTiles(Field* field, Simulation* simulation) {
+	TileActivity* activity = &simulation->activity;
+	int E_start[TC_MAX + 1], H_start[TC_MAX + 1];
+	int* E_tiles = sortTiles(field, simulation, false, E_start);
+	int* H_tiles = sortTiles(field, simulation, true, H_start);
+	if (E_tiles == NULL || H_tiles == NULL) {
+		free(E_tiles);
+		free(H_tiles);
+		return false;
+	}
+	if (activity->E_tiles != NULL) {
+		free(activity->E_tiles);
+		free(activity->H_tiles);
+		activity->E_tiles = E_tiles;
+		activity->H_tiles = H_tiles;
+		memcpy(activity->E_start, E_start, sizeof(E_start));
+		memcpy(activity->H_start, H_start, sizeof(H_start));
+		activity->next_check = 0;
+		return true;
+	}
+	memcpy(simulation->E_tile_start, E_start, sizeof(E_start));
+	memcpy(simulation->H_tile_start, H_start, sizeof(H_start));
+	clEnqueueWriteBuffer(simulation->queue, simulation->Etiles_kbuf, CL_TRUE,
+			0, 2 * sizeof(int) * E_start[TC_MAX], E_tiles, 0, NULL, NULL);
+	clEnqueueWriteBuffer(simulation->queue, simulation->Htiles_kbuf, CL_TRUE,
+			0, 2 * sizeof(int) * H_start[TC_MAX], H_tiles, 0, NULL, NULL);
+	free(E_tiles);
+	free(H_tiles);
+	return true;
+}
+
+// Every MX_TILE_PX steps, finds the live tiles among the active ones and 
+// activates them and their neighbors for the steps up to the next check
+void updateActiveTiles(Field* field, Simulation* simulation) {
+	TileActivity* activity = &simulation->activity;
+	if (activity->list == NULL || simulation->step < activity->next_check) {
+		return;
+	}
+	activity->next_check = simulation->step + MX_TILE_PX;
+
+	int columns = activity->columns;
+	int rows = activity->rows;
+	if (gpu_support) markLiveTilesOnGPU(simulation);
+	for (int t = 0; t < columns * rows; t++) {
+		if (!gpu_support) {
+			activity->live[t] = activity->active[t] 
+					&& tileLive(field, simulation, t);
+		}
+		activity->live[t] = activity->live[t] || activity->seed[t];
+	}
+
+	// Neighbors wrap around periodic edges
+	int x, y;
+	bool active;
+	activity->count = 0;
+	for (int t = 0; t < columns * rows; t++) {
+		active = false;
+		for (int k = 0; k < 9; k++) {
+			x = t % columns + k % 3 - 1;
+			y = t / columns + k / 3 - 1;
+			if (simulation->periodic[AX_X]) x = (x + columns) % columns;
+			if (simulation->periodic[AX_Y]) y = (y + rows) % rows;
+			if (x < 0 || y < 0 || x >= columns || y >= rows) continue;
+			active = active || activity->live[y * columns + x];
+		}
+		activity->active[t] = active;
+		if (active) activity->list[activity->count++] = t;
+	}
+	if (gpu_support && activity->E_tiles != NULL) {
+		uploadActiveTiles(simulation);
+	}
+}
+
+void updateFields(Field* field, Simulation* simulation, 
+		SourceInjection* injection) {
+	// Increment simulation time
+	simulation->time += simulation->dt;
+	simulation->frame++;
+	simulation->step++;
+
+	// Images are only fused into steps over the whole grid
+	updateActiveTiles(field, simulation);
+	if (sparseActivity(simulation)) simulation->emit_image = false;
+
+	// Add contributions from user-specified sources, then step the fields
+	if (gpu_support) {
+		injectSourcesOnGPU(simulation, injection);
+		iterateFieldsOnGPU(simulation);
+	} else {
+		double start = profileStart(simulation);
+		injectSourcesOnCPU(field, simulation, injection);
+		profileEnd(simulation, PH_INJECT, start);
+		iterateFieldsOnCPU(field, simulation);
+	}
+	
+	if (simulation->boundary_condition == BC_PEC && gpu_support) {
+		applyPECOnGPU(simulation);
+	} else if (simulation->boundary_condition == BC_PEC) {
+		double start = profileStart(simulation);
+		applyPECOnCPU(field, simulation);
+		profileEnd(simulation, PH_BOUNDARY, start);
+	}
+}
+
+void visualizeOnCPU(Field* field, Simulation* simulation) { 
+	for (int y = 0; y < simulation->height; y++) {
+		colorizeSpan(field, simulation, y, 0, simulation->width);
+	}
+}
+
+void visualizeOnGPU(Simulation* simulation) { 
+	TunedKernel vis_kernels[VIS_MAX] = {TK_VIS_TE_1, TK_VIS_TE_2};
+	size_t size = sizeof(float) * imageWidth(simulation) 
+			* imageHeight(simulation) * 3;
+
+	// The fused H update has already colored the image
+	if (simulation->emit_image) {
+		clEnqueueReadBuffer(simulation->queue, simulation->image_kbuf, 
+				CL_TRUE, 0, size, simulation->image, 0, NULL, 
+				profileEvent(simulation, PH_TRANSFER));
+		return;
+	}
+
+	cl_int err;
+	switch (err = clEnqueueWriteBuffer(simulation->queue, 
+			simulation->image_kbuf, CL_TRUE, 0, size, simulation->image, 0, 
+			NULL, profileEvent(simulation, PH_TRANSFER))) {
+		case CL_SUCCESS:
+			break;
+		default:
+			fprintf(stderr, "Error writing image_kbuf: %d\n", err);
+	}
+
+	// Boundaries are drawn over the image in place, so one read covers both
+	enqueueTuned(simulation, vis_kernels[simulation->vis_fxn], 0, 
+			profileEvent(simulation, PH_COLORIZE));
+	if (draw_material_boundaries) {
+		enqueueTuned(simulation, TK_MAT_BOUNDS, 0, 
+				profileEvent(simulation, PH_COLORIZE));
+	}
+	clEnqueueReadBuffer(simulation->queue, simulation->image_kbuf, CL_TRUE, 
+			0, size, simulation->image, 0, NULL, 
+			profileEvent(simulation, PH_TRANSFER));
+}
+
+void updateImage(Field* field, Simulation* simulation, 
+		SourceInjection* injection) { 
+	simulation->emit_image = simulation->fused_colorize;
+	updateFields(field, simulation, injection);	
+	
+	if (gpu_support) {
+		visualizeOnGPU(simulation);
+	} else if (!simulation->emit_image) {
+		double start = profileStart(simulation);
+		visualizeOnCPU(field, simulation);
+		profileEnd(simulation, PH_COLORIZE, start);
+	}
+	simulation->emit_image = false;
+
+	// Update OpenGL texture with the new image data
+	double start = profileStart(simulation);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, imageWidth(simulation), 
+			imageHeight(simulation), 0, GL_RGB, GL_FLOAT, simulation->image);
+	profileEnd(simulation, PH_TEXTURE, start);
+}
+
+void rasterizeTriangle(Field* field, Simulation* simulation, 
+		MaterialTable* materials, int m, BoundingBox* tile, bool apply) {
+	// Extract the relative permittivity and permeability for the triangular
+	// region
+	float rel_eps = materials->rel_eps[m];
+	float rel_mu = materials->rel_mu[m];
+	float sigma = materials->sigma[m];
+
+	// Extract the bounding vertices of the triangle
+	TriangleParams* triangle = &materials->triangles[materials->param[m]];
+	int x1, y1, x2, y2, x3, y3;
+	x1 = triangle->x1;
+	y1 = triangle->y1;
+	x2 = triangle->x2;
+	y2 = triangle->y2;
+	x3 = triangle->x3;
+	y3 = triangle->y3;
+
+	// Only visit the part of the bounding box inside this tile
+	BoundingBox* bbox = &materials->bbox[m];
+	int x_lo = max(bbox->x0, tile->x0);
+	int x_hi = min(bbox->x1, tile->x1);
+	int y_lo = max(bbox->y0, tile->y0);
+	int y_hi = min(bbox->y1, tile->y1);
+
+	// Each edge function d = A * (x - xa) - B * (y - ya) is zero along the
+	// edge and its magnitude over the edge length is the distance to it, so
+	// it serves for both the inside test and the boundary test. Stepping
+	// one cell in x adds A.
+	long A1 = y1 - y2, B1 = x1 - x2;
+	long A2 = y2 - y3, B2 = x2 - x3;
+	long A3 = y3 - y1, B3 = x3 - x1;
+	float len1 = sqrt(A1 * A1 + B1 * B1) * MX_MAT_BOUNDARY_PX;
+	float len2 = sqrt(A2 * A2 + B2 * B2) * MX_MAT_BOUNDARY_PX;
+	float len3 = sqrt(A3 * A3 + B3 * B3) * MX_MAT_BOUNDARY_PX;
+
+	// Store the min and max extent of the triangle edges
+	int L1x1 = min(x1, x2), L1x2 = max(x1, x2);
+	int L1y1 = min(y1, y2), L1y2 = max(y1, y2);
+	int L2x1 = min(x2, x3), L2x2 = max(x2, x3);
+	int L2y1 = min(y2, y3), L2y2 = max(y2, y3);
+	int L3x1 = min(x1, x3), L3x2 = max(x1, x3);
+	int L3y1 = min(y1, y3), L3y2 = max(y1, y3);
+
+	int index;
+	long d1, d2, d3;
+	bool has_neg, has_pos, on1, on2, on3;
+	for (int y = y_lo; y <= y_hi; y++) {
+		d1 = (x_lo - x2) * A1 - B1 * (y - y2);
+		d2 = (x_lo - x3) * A2 - B2 * (y - y3);
+		d3 = (x_lo - x1) * A3 - B3 * (y - y1);
+		on1 = y >= L1y1 && y <= L1y2;
+		on2 = y >= L2y1 && y <= L2y2;
+		on3 = y >= L3y1 && y <= L3y2;
+		for (int x = x_lo; x <= x_hi; x++) {
+			index = y * simulation->pitch + x;
+
+			// Check if (x, y) is inside the triangular region
+			has_neg = (d1 < 0) || (d2 < 0) || (d3 < 0);
+			has_pos = (d1 > 0) || (d2 > 0) || (d3 > 0);
+			if (apply && !(has_neg && has_pos)) {
+				field->Epsilon[index] *= rel_eps;
+				field->Mu[index] *= rel_mu;
+				field->Sigma[index] += sigma;
+			}
+
+			// Check if (x, y) lies within a pixel of one of the edges
+			if ((on1 && x >= L1x1 && x <= L1x2 && labs(d1) < len1)
+					|| (on2 && x >= L2x1 && x <= L2x2 && labs(d2) < len2)
+					|| (on3 && x >= L3x1 && x <= L3x2 && labs(d3) < len3)) {
+				markBoundary(simulation, x, y);
+			}
+
+			d1 += A1;
+			d2 += A2;
+			d3 += A3;
 		}
 	}
-	printf("\rApplying material characteristics... done.\n");
 }
 
-float randNormalFloat(void) {
-	return (float)rand() / (float)RAND_MAX;
+int spanHalfWidth(long rem) {
+	// Largest h with h * h < rem, or -1 if there is none
+	if (rem <= 0) return -1;
+	int h = (int)sqrt((double)rem);
+	while ((long)h * h >= rem) h--;
+	while ((long)(h + 1) * (h + 1) < rem) h++;
+	return h;
 }
 
-void glfw_error_callback(int error, const char* desc) {
-	// Log GLFW errors to stderr
-	fprintf(stderr, "GLFW error %d: %s\n", error, desc);
+void rasterizeCircle(Field* field, Simulation* simulation, 
+		MaterialTable* materials, int m, BoundingBox* tile, bool apply) {
+	float rel_eps = materials->rel_eps[m];
+	float rel_mu = materials->rel_mu[m];
+	float sigma = materials->sigma[m];
+
+	CircleParams* circle = &materials->circles[materials->param[m]];
+	int cx, cy, R;
+	cx = circle->x;
+	cy = circle->y;
+	R = circle->R;
+
+	BoundingBox* bbox = &materials->bbox[m];
+	int x_lo = max(bbox->x0, tile->x0);
+	int x_hi = min(bbox->x1, tile->x1);
+	int y_lo = max(bbox->y0, tile->y0);
+	int y_hi = min(bbox->y1, tile->y1);
+
+	int index, h, h_out, h_in;
+	long dy2;
+	for (int y = y_lo; y <= y_hi; y++) {
+		dy2 = (long)(y - cy) * (y - cy);
+		
+		// Fill the span of cells with d < R^2
+		h = apply ? spanHalfWidth((long)R * R - dy2) : -1;
+		for (int x = max(cx - h, x_lo); x <= min(cx + h, x_hi); x++) {
+			index = y * simulation->pitch + x;
+			field->Epsilon[index] *= rel_eps;
+			field->Mu[index] *= rel_mu;
+			field->Sigma[index] += sigma;
+		}
+
+		// The boundary |sqrt(d) - R| < 1 is the span with d < (R + 1)^2 
+		// minus the span with d <= (R - 1)^2
+		if (R + MX_MAT_BOUNDARY_PX <= 0) continue;
+		h_out = spanHalfWidth((long)(R + MX_MAT_BOUNDARY_PX) 
+				* (R + MX_MAT_BOUNDARY_PX) - dy2);
+		h_in = R - MX_MAT_BOUNDARY_PX < 0 ? -1 
+				: spanHalfWidth((long)(R - MX_MAT_BOUNDARY_PX) 
+				* (R - MX_MAT_BOUNDARY_PX) - dy2 + 1);
+		for (int x = max(cx - h_out, x_lo); x <= min(cx - h_in - 1, x_hi); 
+				x++) {
+			markBoundary(simulation, x, y);
+		}
+		for (int x = max(cx + h_in + 1, x_lo); x <= min(cx + h_out, x_hi); 
+				x++) {
+			markBoundary(simulation, x, y);
+		}
+	}
 }
 
-float gaussianPulse(float t, float t0, float spread) {
-	return exp(-pow(t / (t0 * spread), 2));
+void resetSmoothing(SmoothingScratch* smooth) {
+	for (int c = 0; c < MX_INDEX_BIN_PX * MX_INDEX_BIN_PX; c++) {
+		smooth->eps[c] = 1;
+		smooth->mu[c] = 1;
+		smooth->sigma[c] = 0;
+		smooth->partial[c] = false;
+	}
 }
 
-void iterateFieldsOnCPU(Field* field, Simulation* simulation) { 
-	int index;
-	float eps, mu;
-
-	// Update E field
-    for (int j = 1; j < simulation->height - 1; j++) {
-       	for (int i = 1; i < simulation->width - 1; i++) {
-			index = j * simulation->width + i;
-			eps = field->Epsilon[index];
-       	    field->Ez[index] += (simulation->dt / eps) 
-					* ((field->Hy[index] 
-					- field->Hy[index - 1]) 
-					/ simulation->dx - (field->Hx[index] 
-					- field->Hx[(j - 1) * simulation->width + i]) 
-					/ simulation->dy)
-					- (simulation->dt * field->Sigma[index] * field->Ez[index]
-					/ field->Epsilon[index]);
-       	}
-   	}
-
-	// Update H field
-	for (int j = 0; j < simulation->height - 1; j++) {
-		for (int i = 0; i < simulation->width; i++) {
-			index = j * simulation->width + i;
-			mu = field->Mu[index];
-			if (i < simulation->width - 1) {
-				field->Hx[index] -= simulation->dt 
-						/ (mu * simulation->dy) 
-						* (field->Ez[index + simulation->width] 
-						- field->Ez[index]);
-			}
-			if (j < simulation->height - 1) {
-				field->Hy[index] += simulation->dt 
-						/ (mu * simulation->dx) 
-						* (field->Ez[index + 1] - field->Ez[index]);
-			}
+void coverSample(SmoothingScratch* smooth, int c, int s, float rel_eps, 
+		float rel_mu, float sigma) {
+	int nsamples = smooth->samples * smooth->samples;
+
+	// Start a cell's samples off empty the first time an edge cuts it
+	if (!smooth->partial[c]) {
+		for (int i = 0; i < nsamples; i++) {
+			smooth->sample_eps[c * nsamples + i] = 1;
+			smooth->sample_mu[c * nsamples + i] = 1;
+			smooth->sample_sigma[c * nsamples + i] = 0;
 		}
+		smooth->partial[c] = true;
 	}
+	if (s < 0) return;
+	smooth->sample_eps[c * nsamples + s] *= rel_eps;
+	smooth->sample_mu[c * nsamples + s] *= rel_mu;
+	smooth->sample_sigma[c * nsamples + s] += sigma;
 }
 
-void iterateFieldsOnGPU(Field* field, Simulation* simulation) {
-	size_t global_size[2] = {simulation->width, simulation->height};
+void smoothTriangle(SmoothingScratch* smooth, MaterialTable* materials, 
+		int m, BoundingBox* tile) {
+	float rel_eps = materials->rel_eps[m];
+	float rel_mu = materials->rel_mu[m];
+	float sigma = materials->sigma[m];
+	TriangleParams* t = &materials->triangles[materials->param[m]];
 
-	clEnqueueWriteBuffer(simulation->queue, simulation->Epsilon_kbuf, CL_TRUE,
-			0, sizeof(float) * simulation->width * simulation->height, 
-			field->Epsilon, 0, NULL, NULL);	
-	clEnqueueWriteBuffer(simulation->queue, simulation->Mu_kbuf, CL_TRUE,
-			0, sizeof(float) * simulation->width * simulation->height, 
-			field->Mu, 0, NULL, NULL);	
-	clEnqueueWriteBuffer(simulation->queue, simulation->Ez_kbuf, CL_TRUE,
-			0, sizeof(float) * simulation->width * simulation->height, 
-			field->Ez, 0, NULL, NULL);	
-	clEnqueueWriteBuffer(simulation->queue, simulation->Hx_kbuf, CL_TRUE,
-			0, sizeof(float) * simulation->width * simulation->height, 
-			field->Hx, 0, NULL, NULL);	
-	clEnqueueWriteBuffer(simulation->queue, simulation->Hy_kbuf, CL_TRUE,
-			0, sizeof(float) * simulation->width * simulation->height, 
-			field->Hy, 0, NULL, NULL);	
-	clEnqueueWriteBuffer(simulation->queue, simulation->Sigma_kbuf, CL_TRUE,
-			0, sizeof(float) * simulation->width * simulation->height,
-			field->Sigma, 0, NULL, NULL);
+	BoundingBox* bbox = &materials->bbox[m];
+	int x_lo = max(bbox->x0, tile->x0);
+	int x_hi = min(bbox->x1, tile->x1);
+	int y_lo = max(bbox->y0, tile->y0);
+	int y_hi = min(bbox->y1, tile->y1);
 
-	clSetKernelArg(simulation->E_kernel, 0, sizeof(cl_mem), 
-			&simulation->Hx_kbuf);
-	clSetKernelArg(simulation->E_kernel, 1, sizeof(cl_mem), 
-			&simulation->Hy_kbuf);
-	clSetKernelArg(simulation->E_kernel, 2, sizeof(cl_mem), 
-			&simulation->Ez_kbuf);
-	clSetKernelArg(simulation->E_kernel, 3, sizeof(cl_mem), 
-			&simulation->Epsilon_kbuf);
-	clSetKernelArg(simulation->E_kernel, 4, sizeof(cl_mem), 
-			&simulation->Mu_kbuf);
-	clSetKernelArg(simulation->E_kernel, 5, sizeof(float), &simulation->dt);
-	clSetKernelArg(simulation->E_kernel, 6, sizeof(float), &simulation->dy);
-	clSetKernelArg(simulation->E_kernel, 7, sizeof(float), &simulation->dx);
-	clSetKernelArg(simulation->E_kernel, 8, sizeof(int), &simulation->width);
-	clSetKernelArg(simulation->E_kernel, 9, sizeof(int), &simulation->height);
-	clSetKernelArg(simulation->E_kernel, 10, sizeof(cl_mem), 
-			&simulation->Sigma_kbuf);
-
-	clEnqueueNDRangeKernel(simulation->queue, simulation->E_kernel, 2, NULL, 
-			global_size, NULL, 0, NULL, NULL);
-	clFinish(simulation->queue);
-	
-	clSetKernelArg(simulation->H_kernel, 0, sizeof(cl_mem), 
-			&simulation->Hx_kbuf);
-	clSetKernelArg(simulation->H_kernel, 1, sizeof(cl_mem), 
-			&simulation->Hy_kbuf);
-	clSetKernelArg(simulation->H_kernel, 2, sizeof(cl_mem), 
-			&simulation->Ez_kbuf);
-	clSetKernelArg(simulation->H_kernel, 3, sizeof(cl_mem), 
-			&simulation->Epsilon_kbuf);
-	clSetKernelArg(simulation->H_kernel, 4, sizeof(cl_mem), 
-			&simulation->Mu_kbuf);
-	clSetKernelArg(simulation->H_kernel, 5, sizeof(float), &simulation->dt);
-	clSetKernelArg(simulation->H_kernel, 6, sizeof(float), &simulation->dy);
-	clSetKernelArg(simulation->H_kernel, 7, sizeof(float), &simulation->dx);
-	clSetKernelArg(simulation->H_kernel, 8, sizeof(int), &simulation->width);
-	clSetKernelArg(simulation->H_kernel, 9, sizeof(int), &simulation->height);
-
-	clEnqueueNDRangeKernel(simulation->queue, simulation->H_kernel, 2, NULL, 
-			global_size, NULL, 0, NULL, NULL);
-	clFinish(simulation->queue);
-
-	clEnqueueReadBuffer(simulation->queue, simulation->Ez_kbuf, CL_TRUE, 
-			0, sizeof(float) * simulation->width * simulation->height, 
-			field->Ez, 0, NULL, NULL);
-	clEnqueueReadBuffer(simulation->queue, simulation->Hx_kbuf, CL_TRUE, 
-			0, sizeof(float) * simulation->width * simulation->height, 
-			field->Hx, 0, NULL, NULL);
-	clEnqueueReadBuffer(simulation->queue, simulation->Hy_kbuf, CL_TRUE, 
-			0, sizeof(float) * simulation->width * simulation->height, 
-			field->Hy, 0, NULL, NULL);
-}
-
-void updateFields(Field* field, Simulation* simulation, Source* sources) {
-	// Increment simulation time
-	simulation->time += simulation->dt;
-	simulation->frame++;
+	// Same edge functions as rasterizeTriangle(), oriented so the inside is 
+	// where all three are >= 0. A triangle with no area covers nothing.
+	long A1 = t->y1 - t->y2, B1 = t->x1 - t->x2;
+	long A2 = t->y2 - t->y3, B2 = t->x2 - t->x3;
+	long A3 = t->y3 - t->y1, B3 = t->x3 - t->x1;
+	long area = A1 * (t->x3 - t->x2) - B1 * (t->y3 - t->y2);
+	if (area == 0) return;
+	if (area < 0) {
+		A1 = -A1; B1 = -B1;
+		A2 = -A2; B2 = -B2;
+		A3 = -A3; B3 = -B3;
+	}
 
-	// Add contributions from user-specified sources
-	for (int i = 0; i < simulation->sourcec; i++) {
-		float sourceVal = 0.0f;
-		switch (sources[i].fxn) {
-			case SINELINFREQ:
-				// Calculate source value for a linear-frequency sinusoid
-				sourceVal = sin(2 * M_PI * sources[i].argv[2].value.floatVal 
-						* simulation->time 
-						+ sources[i].argv[3].value.floatVal);
-				int index = simulation->height 
-						* sources[i].argv[1].value.intVal
-						+ sources[i].argv[0].value.intVal;
-				
-				// Add source value to the specified field component
-				switch (sources[i].fc) {
-					case FC_EZ:
-						field->Ez[index] += sourceVal;
-						break;
-					case FC_HX:
-						field->Hx[index] += sourceVal;
-						break;
-					case FC_HY:
-						field->Hy[index] += sourceVal;
-						break;
-					default:
-						break;
+	// Over a cell an edge function varies by (|A| + |B|) / 2 either side 
+	// of its value at the center. Work in doubled units to stay exact.
+	long h1 = labs(A1) + labs(B1);
+	long h2 = labs(A2) + labs(B2);
+	long h3 = labs(A3) + labs(B3);
+
+	int n = smooth->samples;
+	long d1, d2, d3, s1, s2, s3;
+	int c, ox, oy;
+	for (int y = y_lo; y <= y_hi; y++) {
+		d1 = (x_lo - t->x2) * A1 - B1 * (y - t->y2);
+		d2 = (x_lo - t->x3) * A2 - B2 * (y - t->y3);
+		d3 = (x_lo - t->x1) * A3 - B3 * (y - t->y1);
+		for (int x = x_lo; x <= x_hi; x++) {
+			c = (y - tile->y0) * MX_INDEX_BIN_PX + x - tile->x0;
+			if (2 * d1 >= h1 && 2 * d2 >= h2 && 2 * d3 >= h3) {
+				// Whole cell inside
+				smooth->eps[c] *= rel_eps;
+				smooth->mu[c] *= rel_mu;
+				smooth->sigma[c] += sigma;
+			} else if (2 * d1 + h1 >= 0 && 2 * d2 + h2 >= 0 
+					&& 2 * d3 + h3 >= 0) {
+				// Cell cut by an edge. Sample (i, j) sits at an offset of 
+				// (2i + 1 - n) / 2n cells from the center; scale everything 
+				// by 2n to keep the test in integers.
+				coverSample(smooth, c, -1, 1, 1, 0);
+				for (int j = 0; j < n; j++) {
+					oy = 2 * j + 1 - n;
+					for (int i = 0; i < n; i++) {
+						ox = 2 * i + 1 - n;
+						s1 = 2 * n * d1 + A1 * ox - B1 * oy;
+						s2 = 2 * n * d2 + A2 * ox - B2 * oy;
+						s3 = 2 * n * d3 + A3 * ox - B3 * oy;
+						if (s1 >= 0 && s2 >= 0 && s3 >= 0) {
+							coverSample(smooth, c, j * n + i, rel_eps, 
+									rel_mu, sigma);
+						}
+					}
 				}
-				break;
-			default:
-				break;
+			}
+			d1 += A1;
+			d2 += A2;
+			d3 += A3;
 		}
 	}
+}
 
-	if (gpu_support) {
-		iterateFieldsOnGPU(field, simulation);
-	} else {
-		iterateFieldsOnCPU(field, simulation);
+void smoothCircle(SmoothingScratch* smooth, MaterialTable* materials, 
+		int m, BoundingBox* tile) {
+	float rel_eps = materials->rel_eps[m];
+	float rel_mu = materials->rel_mu[m];
+	float sigma = materials->sigma[m];
+	CircleParams* circle = &materials->circles[materials->param[m]];
+
+	BoundingBox* bbox = &materials->bbox[m];
+	int x_lo = max(bbox->x0, tile->x0);
+	int x_hi = min(bbox->x1, tile->x1);
+	int y_lo = max(bbox->y0, tile->y0);
+	int y_hi = min(bbox->y1, tile->y1);
+
+	// In doubled units a cell spans [X - 1, X + 1], so its farthest point 
+	// from the center is at (|X| + 1, |Y| + 1) and its nearest point at 
+	// (max(|X| - 1, 0), max(|Y| - 1, 0))
+	int n = smooth->samples;
+	long R2 = 4 * (long)circle->R * circle->R;
+	long nR2 = (long)n * n * R2;
+	long X, Y, near_x, near_y, sx, sy;
+	int c;
+	for (int y = y_lo; y <= y_hi; y++) {
+		Y = labs(2 * (long)(y - circle->y));
+		near_y = Y > 1 ? Y - 1 : 0;
+		for (int x = x_lo; x <= x_hi; x++) {
+			X = labs(2 * (long)(x - circle->x));
+			near_x = X > 1 ? X - 1 : 0;
+			c = (y - tile->y0) * MX_INDEX_BIN_PX + x - tile->x0;
+			if ((X + 1) * (X + 1) + (Y + 1) * (Y + 1) < R2) {
+				smooth->eps[c] *= rel_eps;
+				smooth->mu[c] *= rel_mu;
+				smooth->sigma[c] += sigma;
+			} else if (near_x * near_x + near_y * near_y < R2) {
+				coverSample(smooth, c, -1, 1, 1, 0);
+				for (int j = 0; j < n; j++) {
+					sy = 2 * n * (long)(y - circle->y) + 2 * j + 1 - n;
+					for (int i = 0; i < n; i++) {
+						sx = 2 * n * (long)(x - circle->x) + 2 * i + 1 - n;
+						if (sx * sx + sy * sy < nR2) {
+							coverSample(smooth, c, j * n + i, rel_eps, 
+									rel_mu, sigma);
+						}
+					}
+				}
+			}
+		}
 	}
-	
-	if (simulation->boundary_condition == BC_PEC) {
-		int index;
-		for (int i = 0; i < simulation->height; i++) {
-			for (int j = 0; j < simulation->width; j++) {
-				index = i * simulation->width + j;
-				if (i == 0 || i == simulation->height - 1 || j == 0 
-						|| j == simulation->width - 1) {
-					field->Ez[index] = 0; 
-					field->Hx[index] = 0;
-					field->Hy[index] = 0;
+}
+
+void applySmoothing(Field* field, Simulation* simulation, 
+		SmoothingScratch* smooth, BoundingBox* tile) {
+	int nsamples = smooth->samples * smooth->samples;
+	int c, index;
+	float eps, mu, sigma, sum_eps, sum_inv_mu, sum_sigma;
+	for (int y = tile->y0; y <= tile->y1; y++) {
+		for (int x = tile->x0; x <= tile->x1; x++) {
+			c = (y - tile->y0) * MX_INDEX_BIN_PX + x - tile->x0;
+			index = y * simulation->pitch + x;
+			eps = smooth->eps[c];
+			mu = smooth->mu[c];
+			sigma = smooth->sigma[c];
+
+			// Average permittivity and conductivity directly, and 
+			// permeability through its inverse
+			if (smooth->partial[c]) {
+				sum_eps = sum_inv_mu = sum_sigma = 0;
+				for (int s = c * nsamples; s < (c + 1) * nsamples; s++) {
+					sum_eps += smooth->sample_eps[s];
+					sum_inv_mu += 1 / smooth->sample_mu[s];
+					sum_sigma += smooth->sample_sigma[s];
 				}
+				eps *= sum_eps / nsamples;
+				mu *= nsamples / sum_inv_mu;
+				sigma += sum_sigma / nsamples;
 			}
+
+			field->Epsilon[index] *= eps;
+			field->Mu[index] *= mu;
+			field->Sigma[index] += sigma;
 		}
 	}
 }
 
-void visualizeOnCPU(Field* field, Simulation* simulation) { 
+SmoothingScratch* createSmoothing(int samples) {
+	SmoothingScratch* smooth = (SmoothingScratch*)malloc(
+			sizeof(SmoothingScratch));
+	if (smooth == NULL) return NULL;
+	size_t n = (size_t)samples * samples * MX_INDEX_BIN_PX * MX_INDEX_BIN_PX;
+	smooth->samples = samples;
+	smooth->sample_eps = (float*)malloc(n * sizeof(float));
+	smooth->sample_mu = (float*)malloc(n * sizeof(float));
+	smooth->sample_sigma = (float*)malloc(n * sizeof(float));
+	if (smooth->sample_eps == NULL || smooth->sample_mu == NULL 
+			|| smooth->sample_sigma == NULL) {
+		free(smooth->sample_eps);
+		free(smooth->sample_mu);
+		free(smooth->sample_sigma);
+		free(smooth);
+		return NULL;
+	}
+	return smooth;
+}
+
+void freeSmoothing(SmoothingScratch* smooth) {
+	if (smooth == NULL) return;
+	free(smooth->sample_eps);
+	free(smooth->sample_mu);
+	free(smooth->sample_sigma);
+	free(smooth);
+}
+
+// Puts a tile back to the background that rasterization starts from: 
+// vacuum, the boundary's conductivity and the material maps, with no 
+// material boundaries marked
+void clearTile(Field* field, Simulation* simulation, MapTable* maps, 
+		BoundingBox* tile) {
 	int index;
+	for (int y = tile->y0; y <= tile->y1; y++) {
+		for (int x = tile->x0; x <= tile->x1; x++) {
+			index = y * simulation->pitch + x;
+			field->Epsilon[index] = VACUUM_PERMITTIVITY;
+			field->Mu[index] = VACUUM_PERMEABILITY;
+			field->Sigma[index] = boundaryConductivity(simulation, x, y);
+		}
+		for (int w = tile->x0 / MX_MASK_WORD_BITS; 
+				w <= tile->x1 / MX_MASK_WORD_BITS; w++) {
+			simulation->matBoundMask[y * simulation->mask_pitch + w] = 0;
+		}
+	}
+	applyMaterialMaps(field, simulation, maps, tile);
+}
 
-	// Initialize min and max field values for normalization
-	float ezMin;
-	float hxMin;
-	__attribute__((unused)) float hyMin;
-	__attribute__((unused)) float ezMax;
-	float hxMax;
-	float hyMax;
-	ezMin = MAX_FIELD;
-	hxMin = MAX_FIELD;
-	hyMin = MAX_FIELD;
-	ezMax = MIN_FIELD;
-	hxMax = MIN_FIELD;
-	hyMax = MIN_FIELD;
-
-	// Find the min and max field values
-	for (int i = 0; i < simulation->width 
-			* simulation->height; ++i) {
-		if (field->Ez[i] < ezMin) ezMin = field->Ez[i];
-		if (field->Ez[i] < ezMin) ezMin = field->Ez[i];
-		if (field->Hx[i] < hxMin) hxMin = field->Hx[i];
-		if (field->Hx[i] > hxMax) hxMax = field->Hx[i];
-		if (field->Hy[i] > hyMax) hyMax = field->Hy[i];
-		if (field->Hy[i] > hyMax) hyMax = field->Hy[i];
-	}
-
-	// Normalize field values and store in the image buffer
-	for (int y = 0; y < simulation->height; ++y) {
-		for (int x = 0; x < simulation->width; ++x) {
-			index = y * simulation->width + x;
-			float ezVal = field->Ez[index];
-			float hxVal = field->Hx[index];
-			float hyVal = field->Hy[index];
-	
-			// Apply user-selected visualization function
-			switch (simulation->vis_fxn) {		
-				case VIS_TE_1:
-					float normVal = (ezVal - -1e1) / (1e2 - -1e1);
-					simulation->image[3 * index + 2] = normVal < 0.5 
-							? 2 * normVal : 1.0;
-					simulation->image[3 * index + 0] = normVal < 0.5 
-							? 2 * normVal : 2 * (1 - normVal);
-					simulation->image[3 * index + 1] = normVal > 0.5 
-							? 2 * (normVal - 0.5) : 0.0;
+void* rasterizeWorker(void* arg) {
+	RasterJob* job = ((RasterTask*)arg)->job;
+	SmoothingScratch* smooth = ((RasterTask*)arg)->smooth;
+	Simulation* simulation = job->simulation;
+	MaterialTable* materials = &job->scene->materials;
+	SpatialIndex* index = &job->scene->index;
+	BoundingBox tile;
+	int i, bin, m;
+
+	// Claim tiles until the list is exhausted. Each tile applies only the
+	// materials listed in its bin, in scene order, so the composition of
+	// overlapping materials is the same as for a serial pass. Tiles are a
+	// whole number of boundary mask words wide, so they never share one.
+	while ((i = atomic_fetch_add(&job->next_tile, 1)) < job->binc) {
+		bin = job->bins == NULL ? i : job->bins[i];
+		binTile(index, bin, simulation, &tile);
+		if (job->bins != NULL) {
+			clearTile(job->field, simulation, &job->scene->maps, &tile);
+		}
+		if (smooth != NULL) resetSmoothing(smooth);
+		for (int j = index->start[bin]; j < index->start[bin + 1]; j++) {
+			m = index->items[j];
+			switch (materials->geom[m]) {
+				case MG_TRIANGLE:
+					rasterizeTriangle(job->field, simulation, materials, m, 
+							&tile, smooth == NULL);
+					if (smooth != NULL) {
+						smoothTriangle(smooth, materials, m, &tile);
+					}
 					break;
-				case VIS_TE_2:
-					simulation->image[3 * index] = (ezVal*ezVal - MIN_FIELD) 
-							/ (MAX_FIELD - MIN_FIELD);
-					simulation->image[3 * index + 1] = (hxVal*hxVal 
-							- MIN_FIELD) / (MAX_FIELD - MIN_FIELD);
-					simulation->image[3 * index + 2] = (hyVal*hyVal 
-							- MIN_FIELD) / (MAX_FIELD - MIN_FIELD); 
+				case MG_CIRCLE:
+					rasterizeCircle(job->field, simulation, materials, m, 
+							&tile, smooth == NULL);
+					if (smooth != NULL) {
+						smoothCircle(smooth, materials, m, &tile);
+					}
 					break;
 				default:
 					break;
 			}
 		}
-	}
-	
-	// If material boundary rendering is enabled, draw them over the image
-	if (draw_material_boundaries) {
-		for (int i = 0; i < simulation->width * simulation->height; i++) {
-			if (simulation->matBoundMask[i] == 1) {
-				simulation->image[3 * i] = 0;
-				simulation->image[3 * i + 1] = 0;
-				simulation->image[3 * i + 2] = 0;
-			}
+		if (smooth != NULL) {
+			applySmoothing(job->field, simulation, smooth, &tile);
 		}
 	}
+	return NULL;
 }
 
-void visualizeOnGPU(Field* field, Simulation* simulation) { 
-	size_t global_size[2] = {simulation->width, simulation->height};
+// Rasterizes the scene's materials over binc bins, or over the whole grid 
+// if bins is NULL, sharing them out among the threads
+void rasterizeBins(Field* field, Simulation* simulation, Scene* scene, 
+		const int* bins, int binc) {
+	RasterJob job;
+	job.field = field;
+	job.simulation = simulation;
+	job.scene = scene;
+	job.bins = bins;
+	job.binc = binc;
+	atomic_init(&job.next_tile, 0);
 
-	cl_int err;
-	float minField, maxField;
-	switch (simulation->vis_fxn) {
-		case VIS_TE_1:
-			switch (err = clEnqueueWriteBuffer(simulation->queue, 
-					simulation->image_kbuf, CL_TRUE, 0, sizeof(float) 
-					* simulation->width * simulation->height * 3, 
-					simulation->image, 0 , NULL, NULL)) {
-				case CL_SUCCESS:
-					break;
-				default:
-					fprintf(stderr, "Error writing image_kbuf: %d\n", err);
-		
-			}
-			clEnqueueWriteBuffer(simulation->queue, simulation->Hx_kbuf, 
-					CL_TRUE, 0, sizeof(float) * simulation->width 
-					* simulation->height, field->Hx, 0 , NULL, NULL);
-			clEnqueueWriteBuffer(simulation->queue, simulation->Hy_kbuf, 
-					CL_TRUE, 0, sizeof(float) * simulation->width 
-					* simulation->height, field->Hy, 0 , NULL, NULL);
-			clEnqueueWriteBuffer(simulation->queue, simulation->Ez_kbuf, 
-					CL_TRUE, 0, sizeof(float) * simulation->width 
-					* simulation->height, field->Ez, 0 , NULL, NULL);
-
-			minField = -1e1;
-			maxField = 1e2;
-
-			clSetKernelArg(simulation->VIS_TE_1_kernel, 0, sizeof(cl_mem), 
-					&simulation->image_kbuf);
-			clSetKernelArg(simulation->VIS_TE_1_kernel, 1, sizeof(cl_mem),
-					&simulation->Hx_kbuf);
-			clSetKernelArg(simulation->VIS_TE_1_kernel, 2, sizeof(cl_mem),
-					&simulation->Hy_kbuf);
-			clSetKernelArg(simulation->VIS_TE_1_kernel, 3, sizeof(cl_mem),
-					&simulation->Ez_kbuf);
-			clSetKernelArg(simulation->VIS_TE_1_kernel, 4, sizeof(float),
-					&minField);
-			clSetKernelArg(simulation->VIS_TE_1_kernel, 5, sizeof(float),
-					&maxField);
-			clSetKernelArg(simulation->VIS_TE_1_kernel, 6, sizeof(int),
-					&simulation->width);
-
-			clEnqueueNDRangeKernel(simulation->queue, 
-					simulation->VIS_TE_1_kernel, 2, NULL, global_size, NULL, 
-					0, NULL, NULL);
-			clFinish(simulation->queue);
-			
-			clEnqueueReadBuffer(simulation->queue, simulation->image_kbuf, 
-					CL_TRUE, 0, sizeof(float) * simulation->width 
-					* simulation->height * 3, simulation->image, 0, NULL, 
-					NULL);
-			break;
-		case VIS_TE_2:
-			switch (err = clEnqueueWriteBuffer(simulation->queue, 
-					simulation->image_kbuf, CL_TRUE, 0, sizeof(float) 
-					* simulation->width * simulation->height * 3, 
-					simulation->image, 0 , NULL, NULL)) {
-				case CL_SUCCESS:
-					break;
-				default:
-					fprintf(stderr, "Error writing image_kbuf: %d\n", err);
-		
-			}
-			clEnqueueWriteBuffer(simulation->queue, simulation->Hx_kbuf, 
-					CL_TRUE, 0, sizeof(float) * simulation->width 
-					* simulation->height, field->Hx, 0 , NULL, NULL);
-			clEnqueueWriteBuffer(simulation->queue, simulation->Hy_kbuf, 
-					CL_TRUE, 0, sizeof(float) * simulation->width 
-					* simulation->height, field->Hy, 0 , NULL, NULL);
-			clEnqueueWriteBuffer(simulation->queue, simulation->Ez_kbuf, 
-					CL_TRUE, 0, sizeof(float) * simulation->width 
-					* simulation->height, field->Ez, 0 , NULL, NULL);
-
-			minField = (float)MIN_FIELD;
-			maxField = (float)MAX_FIELD;
-
-			clSetKernelArg(simulation->VIS_TE_2_kernel, 0, sizeof(cl_mem), 
-					&simulation->image_kbuf);
-			clSetKernelArg(simulation->VIS_TE_2_kernel, 1, sizeof(cl_mem),
-					&simulation->Hx_kbuf);
-			clSetKernelArg(simulation->VIS_TE_2_kernel, 2, sizeof(cl_mem),
-					&simulation->Hy_kbuf);
-			clSetKernelArg(simulation->VIS_TE_2_kernel, 3, sizeof(cl_mem),
-					&simulation->Ez_kbuf);
-			clSetKernelArg(simulation->VIS_TE_2_kernel, 4, sizeof(float),
-					&minField);
-			clSetKernelArg(simulation->VIS_TE_2_kernel, 5, sizeof(float),
-					&maxField);
-			clSetKernelArg(simulation->VIS_TE_2_kernel, 6, sizeof(int),
-					&simulation->width);
-
-			clEnqueueNDRangeKernel(simulation->queue, 
-					simulation->VIS_TE_2_kernel, 2, NULL, global_size, NULL, 
-					0, NULL, NULL);
-			clFinish(simulation->queue);
-			
-			clEnqueueReadBuffer(simulation->queue, simulation->image_kbuf, 
-					CL_TRUE, 0, sizeof(float) * simulation->width 
-					* simulation->height * 3, simulation->image, 0, NULL, 
-					NULL);
-			break;
-		default:
-			break;
+	// Each thread needs its own smoothing accumulators
+	RasterTask tasks[MX_MAX_THREADS];
+	bool smoothing = simulation->smoothing > 1;
+	for (int t = 0; t < simulation->threads; t++) {
+		tasks[t].job = &job;
+		tasks[t].smooth = NULL;
+		if (smoothing) {
+			tasks[t].smooth = createSmoothing(simulation->smoothing);
+			smoothing = tasks[t].smooth != NULL;
+		}
+	}
+	if (simulation->smoothing > 1 && !smoothing) {
+		fprintf(stderr, "Warning: Failed to allocate memory for material "
+				"smoothing - using hard boundaries.\n");
+		for (int t = 0; t < simulation->threads; t++) {
+			freeSmoothing(tasks[t].smooth);
+			tasks[t].smooth = NULL;
+		}
 	}
 
-	if (draw_material_boundaries) {
-		clEnqueueWriteBuffer(simulation->queue, simulation->image_kbuf, 
-				CL_TRUE, 0, sizeof(float) * simulation->width
-				* simulation->height * 3, simulation->image, 0, NULL, NULL);
-		clEnqueueWriteBuffer(simulation->queue, simulation->matBoundMask_kbuf,
-				CL_TRUE, 0, sizeof(float) * simulation->width 
-				* simulation->height, simulation->matBoundMask, 0, NULL,
-				NULL);	
-
-		clSetKernelArg(simulation->drawMatBounds_kernel, 0, sizeof(cl_mem),
-				&simulation->image_kbuf);
-		clSetKernelArg(simulation->drawMatBounds_kernel, 1, sizeof(cl_mem),
-				&simulation->matBoundMask_kbuf);
-		clSetKernelArg(simulation->drawMatBounds_kernel, 2, sizeof(int),
-				&simulation->width);
-		
-		clEnqueueNDRangeKernel(simulation->queue, 
-				simulation->drawMatBounds_kernel, 2, NULL, global_size, NULL,
-				0, NULL, NULL);
-		clFinish(simulation->queue);
-		
-		clEnqueueReadBuffer(simulation->queue, simulation->image_kbuf, 
-				CL_TRUE, 0, sizeof(float) * simulation->width 
-				* simulation->height * 3, simulation->image, 0, NULL, NULL);
+	// The calling thread works alongside the helpers; if a helper can't be
+	// started, the remaining threads simply claim more tiles
+	pthread_t workers[MX_MAX_THREADS];
+	int nworkers = 0;
+	for (int t = 1; t < simulation->threads; t++) {
+		if (startThread(&workers[nworkers], rasterizeWorker, &tasks[t], -1)
+				== 0) {
+			nworkers++;
+		}
+	}
+	rasterizeWorker(&tasks[0]);
+	for (int t = 0; t < nworkers; t++) {
+		pthread_join(workers[t], NULL);
+	}
+	for (int t = 0; t < simulation->threads; t++) {
+		freeSmoothing(tasks[t].smooth);
 	}
 }
 
-void updateImage(Field* field, Simulation* simulation, Source* sources) { 
-	updateFields(field, simulation, sources);	
-	
-	if (gpu_support) {
-		visualizeOnGPU(field, simulation);
-	} else {
-		visualizeOnCPU(field, simulation);
-	}
+void rasterizeMaterials(Field* field, Simulation* simulation, 
+		Scene* scene) {
+	printf("Applying material characteristics... ");
+	fflush(stdout);
+	rasterizeBins(field, simulation, scene, NULL, 
+			scene->index.cols * scene->index.rows);
+	printf("done.\n");
+}
 
-	// Update OpenGL texture with the new image data
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, simulation->width, 
-			simulation->height, 0, GL_RGB, GL_FLOAT, simulation->image);
+void initSimulation(Simulation* simulation) {
+	memset(simulation, 0, sizeof(Simulation));
+	simulation->width = -1;
+	simulation->height = -1;
+	simulation->time = 0.0f;
+	simulation->dx = 1e1;
+	simulation->dy = 1e1;
+	// Calculate timestep based on grid spacing and c - must satisfy 
+	// stability condition
+	simulation->dt = MX_DT_SCALE / (SPEED_OF_LIGHT * sqrt(1 
+			/ (simulation->dx * simulation->dx) + 1 / (simulation->dy 
+			* simulation->dy)));
+	simulation->vis_fxn = VIS_TE_1;
+	simulation->frame = 0;
+	simulation->step = 0;
+	simulation->boundary_condition = BC_UNK;
+	simulation->pml_layers = -1;
+	simulation->pml_conductivity = -1;
+	simulation->pml_sigma_polyorder = -1;
+	simulation->threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	simulation->smoothing = 1;
+	simulation->autotune = true;
+	simulation->bloch_sign[AX_X] = 1;
+	simulation->bloch_sign[AX_Y] = 1;
+	simulation->profiler.period = MX_PROFILE_DEF_PERIOD;
 }
 
-void computeMaterialBoundary(Simulation* simulation, Material* material) {
-	int index;
-	switch (material->geom) {
-		case MG_UNKNOWN:
- 			break;
-		case MG_TRIANGLE:
-			// Extract vertex coordinates
-			int x1, y1, x2, y2, x3, y3;
-			x1 = material->argv[3].value.intVal;
-			y1 = material->argv[4].value.intVal;
-			x2 = material->argv[5].value.intVal;
-			y2 = material->argv[6].value.intVal;
-			x3 = material->argv[7].value.intVal;
-			y3 = material->argv[8].value.intVal;
-			
-			// Compute coefficients for line equations corresponding to 
-			// the edges of the triangle
-			int A1, B1, C1, A2, B2, C2, A3, B3, C3;
-			A1 = y1 - y2;
-			B1 = x2 - x1;
-			C1 = (x1 * y2) - (x2 * y1);
-			A2 = y2 - y3;
-			B2 = x3 - x2;
-			C2 = (x2 * y3) - (x3 * y2);
-			A3 = y3 - y1;
-			B3 = x1 - x3;
-			C3 = (x3 * y1) - (x1 * y3);
-			
-			// Store the min and max extent of the triangle edges
-			int L1x1, L1x2, L1y1, L1y2;
-			int L2x1, L2x2, L2y1, L2y2;
-			int L3x1, L3x2, L3y1, L3y2;
-			L1x1 = min(x1, x2);
-			L1x2 = max(x1, x2);
-			L1y1 = min(y1, y2);
-			L1y2 = max(y1, y2);
-			L2x1 = min(x2, x3);
-			L2x2 = max(x2, x3);
-			L2y1 = min(y2, y3);
-			L2y2 = max(y2, y3);
-			L3x1 = min(x1, x3);
-			L3x2 = max(x1, x3);
-			L3y1 = min(y1, y3);
-			L3y2 = max(y1, y3);
-
-			float d1, d2, d3;
-			for (int y = 0; y < simulation->height; y++) {
-				for (int x = 0; x < simulation->width; x++) {
-					index = y * simulation->width + x;
-					
-					d1 = abs(A1 * x + B1 * y + C1) / sqrt(A1*A1 
-							+ B1*B1);
-					d2 = abs(A2 * x + B2 * y + C2) / sqrt(A2*A2 
-							+ B2*B2);
-					d3 = abs(A3 * x + B3 * y + C3) / sqrt(A3*A3 
-							+ B3*B3);
-					
-					if ((d1 < MX_MAT_BOUNDARY_PX 
-							&& !(x < L1x1 || x > L1x2 || y < L1y1 
-							|| y > L1y2))
-							|| (d2 < MX_MAT_BOUNDARY_PX 
-							&& !(x < L2x1 || x > L2x2 || y < L2y1 
-							|| y > L2y2))
-							|| (d3 < MX_MAT_BOUNDARY_PX
-							&& !(x < L3x1 || x > L3x2 || y < L3y1 
-							|| y > L3y2))) {
-						material->boundary[index] = 1;
-					} 
-				}
-			} 
-			break;
-		case MG_CIRCLE:
-			int xc, yc, R;
-			xc = material->argv[3].value.intVal;
-			yc = material->argv[4].value.intVal;
-			R = material->argv[5].value.intVal;
-			float d;
-			for (int y = 0; y < simulation->height; y++) {
-				for (int x = 0; x < simulation->width; x++) {
-					index = y * simulation->width + x;
-					d = (x - xc) * (x - xc);
-					d += (y - yc) * (y - yc);
-					d = sqrt(d);
-					if (fabs(d - R) < MX_MAT_BOUNDARY_PX) {
-						material->boundary[index] = 1;
-					}
-				}
-			}
-		default:
-			break;	
+// Maps length bytes, rounded up to whole huge pages, backed by reserved 
+// huge pages if there are any or else by transparent ones where possible.
+// Pages are left untouched for initFields. Returns NULL on failure.
+float* mapArena(size_t* length) {
+	*length = (*length + MX_HUGE_PAGE - 1) / MX_HUGE_PAGE * MX_HUGE_PAGE;
+	int prot = PROT_READ | PROT_WRITE;
+	char* arena;
+#ifdef MAP_HUGETLB
+	arena = mmap(NULL, *length, prot, MAP_PRIVATE | MAP_ANONYMOUS 
+			| MAP_HUGETLB, -1, 0);
+	if (arena != MAP_FAILED) return (float*)arena;
+#endif
+
+	// Transparent huge pages need aligned ranges, so map a page more than
+	// needed and trim it
+	arena = mmap(NULL, *length + MX_HUGE_PAGE, prot, 
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (arena == MAP_FAILED) return NULL;
+	size_t head = (MX_HUGE_PAGE - (uintptr_t)arena % MX_HUGE_PAGE) 
+			% MX_HUGE_PAGE;
+	if (head > 0) munmap(arena, head);
+	munmap(arena + head + *length, MX_HUGE_PAGE - head);
+	arena += head;
+#ifdef MADV_HUGEPAGE
+	madvise(arena, *length, MADV_HUGEPAGE);
+#endif
+	return (float*)arena;
+}
+
+void freeFields(Field* field, Simulation* simulation) {
+	freeStepPool(simulation->pool);
+	simulation->pool = NULL;
+	freeActivity(&simulation->activity);
+	if (field->arena != NULL) munmap(field->arena, field->arena_length);
+	free(simulation->matBoundMask);
+	simulation->matBoundMask = NULL;
+	memset(field, 0, sizeof(Field));
+}
+
+bool allocateFields(Field* field, Simulation* simulation) {
+	size_t n = gridFloats(simulation);
+	memset(field, 0, sizeof(Field));
+	field->arena_length = sizeof(float) * n * MX_FIELD_GRIDS;
+	field->arena = mapArena(&field->arena_length);
+
+	// Shared material boundary mask, one bit per cell
+	simulation->matBoundMask = (uint32_t*)calloc(simulation->mask_pitch 
+			* simulation->height, sizeof(uint32_t));
+	if (field->arena == NULL || simulation->matBoundMask == NULL) {
+		freeFields(field, simulation);
+		return false;
+	}
+
+	// initFields relies on sigma and the fields being adjacent
+	float** grids[MX_FIELD_GRIDS] = {&field->Epsilon, &field->Mu, 
+			&field->Sigma, &field->Ex, &field->Ey, &field->Ez, &field->Hx, 
+			&field->Hy, &field->Hz};
+	for (int g = 0; g < MX_FIELD_GRIDS; g++) {
+		*grids[g] = field->arena + g * n + simulation->origin;
+	}
+
+	// When the CPU is chosen to step the fields, its threads start now, so 
+	// that they can first touch their own rows. Otherwise they only start
+	// if the GPU can't be used, leaving the OpenCL driver's threads and the
+	// calling thread unpinned.
+	if (!trying_gpu && simulation->threads > 1 && simulation->pool == NULL) {
+		simulation->pool = createStepPool(simulation);
+		if (simulation->pool == NULL) simulation->threads = 1;
 	}
+	return true;
 }
 
-int main(int argc, char** argv) {
-	// Ensure a simulation description file has been provided
-	if (argc < 2) {
-		fprintf(stderr, "Invalid number of arguments.\n");
-		fprintf(stderr, "Usage: %s sim_file\n", argv[0]);
-		exit(EXIT_FAILURE);
+// Reads length bytes from offset, however many calls it takes
+bool readFileAt(int fd, void* buffer, size_t length, off_t offset) {
+	char* bytes = (char*)buffer;
+	while (length > 0) {
+		ssize_t count = pread(fd, bytes, length, offset);
+		if (count <= 0) return false;
+		bytes += count;
+		length -= count;
+		offset += count;
 	}
+	return true;
+}
 
-	// Initialize the simulation parameter data structure
-	Simulation simulation;
-	simulation.width = -1;
-	simulation.height = -1;
-	simulation.time = 0.0f;
-	simulation.dx = 1e1;
-	simulation.dy = 1e1;
-	// Calculate timestep based on grid spacing and c - must satisfy stability
-	// condition
-	simulation.dt = MX_DT_SCALE / (SPEED_OF_LIGHT * sqrt(1 / (simulation.dx 
-			* simulation.dx) + 1 / (simulation.dy * simulation.dy)));
-	simulation.sourcec = 0;	
-	simulation.vis_fxn = VIS_TE_1;
-	simulation.frame = 0;
-	simulation.boundary_condition = BC_UNK;
-	simulation.pml_layers = -1;
-	simulation.pml_conductivity = -1;
-	simulation.pml_sigma_polyorder = -1;
-
-	// Open the file for parsing
-	const int nsections = MX_SIMDEF_NSEC;
-	const char* sections[] = {"[Simulation]", "[Sources]", "[Materials]"};
-
-	Source sources[MX_MAX_SOURCES];  
-	Material materials[MX_MAX_MATERIALS];
-
-	for (int s = 0; s < nsections; s++) {
-		FILE* sim_file = fopen(argv[1], "r");
-		if (sim_file == NULL) {
-			fprintf(stderr, "Error opening file at %s.\n", argv[1]);
-			exit(EXIT_FAILURE);
+// Reads a cache hit's materials straight into the field arena, whose layout
+// the file shares, and its boundary mask. A missing, stale or mismatched 
+// file is simply a miss. One that can't be read in full leaves the grids 
+// back at vacuum for rasterization.
+bool loadSceneCache(SceneCache* cache, Field* field, Simulation* simulation) {
+	char* path = sceneCachePath(cache, "");
+	if (path == NULL) return false;
+	int fd = open(path, O_RDONLY);
+	struct stat info;
+	SceneCacheHeader header;
+	bool hit = fd >= 0 && fstat(fd, &info) == 0 
+			&& (size_t)info.st_size == sceneCacheLength(simulation)
+			&& readFileAt(fd, &header, sizeof(SceneCacheHeader), 0)
+			&& memcmp(header.magic, MX_CACHE_MAGIC, 4) == 0 
+			&& header.version == MX_CACHE_VERSION && header.key == cache->key
+			&& header.width == simulation->width 
+			&& header.height == simulation->height 
+			&& header.mask_pitch == simulation->mask_pitch
+			&& header.pitch == simulation->pitch;
+	if (hit) {
+		size_t grids = sizeof(float) * MX_MAP_GRIDS * gridFloats(simulation);
+		hit = readFileAt(fd, field->Epsilon - simulation->origin, grids, 
+				sizeof(SceneCacheHeader)) 
+				&& readFileAt(fd, simulation->matBoundMask, sizeof(uint32_t) 
+				* simulation->mask_pitch * simulation->height, 
+				sizeof(SceneCacheHeader) + grids);
+		if (hit) {
+			printf("Using rasterized materials from %s\n", path);
+		} else {
+			fprintf(stderr, "Warning: Failed to read scene cache %s\n", path);
+			memset(simulation->matBoundMask, 0, sizeof(uint32_t) 
+					* simulation->mask_pitch * simulation->height);
+			initFields(field, simulation);
 		}
-		
-		char line[MX_SIMFILE_MAX_LINEL]; 
-		enum { SEARCH, READ, DONE } state = SEARCH;
-
-		while (fgets(line, sizeof(line), sim_file) && state != DONE) {
-			line[strcspn(line, "\n")] = 0;
-			if (state == SEARCH) {
-				if (strcmp(line, sections[s]) == 0) state = READ;
-			} else if (state == READ) {
-				if (line[0] == '[' && line[strlen(line) - 1] == ']') {
-					state = DONE;
-				} else {
-					if (strcmp(line, "") == 0) continue;
-					if (strcmp(sections[s], "[Simulation]") == 0) {
-						char key[MX_SIMFILE_MAX_LINEL];
-						char ROL[MX_SIMFILE_MAX_LINEL];
-						if (sscanf(line, "%255s %[^\n]", key, ROL) < 1) {
-							fprintf(stderr, "Error: Invalid simulation\n");
-							fclose(sim_file);
-							exit(EXIT_FAILURE);
-						}
-						if (strcmp(key, "Width") == 0) {
-							if (sscanf(ROL, "%d", &simulation.width) != 1) {
-								fprintf(stderr, "Error: Invalid format for "
-										"Simulation.Width\n");
-								fclose(sim_file);
-								exit(EXIT_FAILURE);
-							}
-						} else if (strcmp(key, "Height") == 0) {
-							if (sscanf(ROL, "%d", &simulation.height) != 1) {
-								fprintf(stderr, "Error: Invalid format for "
-										"Simulation.Height\n");
-								fclose(sim_file);
-								exit(EXIT_FAILURE);
-							}
-						} else if (strcmp(key, "ComputeOn") == 0) {
-							if (strcmp(ROL, "CPU") == 0) {
-								trying_gpu = false;
-							}
-						} else if (strcmp(key, "Boundary") == 0) {
-							if (sscanf(ROL, "%255s %[^\n]", key, ROL) < 1) {
-								fprintf(stderr, "Error: Invalid boudnary "
-										"conditions.\n");
-								fclose(sim_file);
-								exit(EXIT_FAILURE);
-							}
-							if (strcmp(key, "Natural") == 0) {
-								printf("Using natural boundaries.\n");
-								simulation.boundary_condition = BC_NAT;
-							} else if (strcmp(key, "PEC") == 0) {
-								printf("Using PEC boundaries.\n");
-								simulation.boundary_condition = BC_PEC;
-							} else if (strcmp(key, "PML") == 0) {
-								printf("Using PML boundaries.\n");
-								simulation.boundary_condition = BC_PML;
-								if (strcmp(ROL, "PML") == 0) {
-									printf("No arguments specified for PML "
-											"boundary - using defaults.\n");
-								} else if (sscanf(ROL, "%d %f %d", 
-										&simulation.pml_layers,
-										&simulation.pml_conductivity,
-										&simulation.pml_sigma_polyorder) 
-										!= MX_BC_PML_ARGC) {
-									fprintf(stderr, "Warning: Improper number"
-											" of arguments specified for PML "
-											"boundary - using defaults.\n");
-									simulation.pml_layers = -1;
-									simulation.pml_conductivity = -1;
-									simulation.pml_sigma_polyorder = -1;
-								}
-							}
-						} else {
-							fprintf(stderr, "Warning: Unknown key: "
-									"Simulation.%s - ignoring\n", key);
-						}
-					} else if (strcmp(sections[s], "[Sources]") == 0) {
-						char key[MX_SIMFILE_MAX_LINEL];
-						char ROL[MX_SIMFILE_MAX_LINEL];
-						if (sscanf(line, "%255s %[^\n]", key, ROL) < 1) {
-							fprintf(stderr, "Error: Invalid simulation\n");
-							fclose(sim_file);
-							exit(EXIT_FAILURE);
-						}	
-						if (strcmp(key, "SineLinFreq") == 0) {
-							char fc_str[MX_FC_STRL]; 
-							Source source;
-							source.fxn = SINELINFREQ;
-							source.argc = MX_SRC_ARGC_SINELINFREQ;
-							source.argv[0].type = TYPE_INT;
-							source.argv[1].type = TYPE_INT;
-							source.argv[2].type = TYPE_FLOAT; 
-							source.argv[3].type = TYPE_FLOAT;
-							int x, y;
-							float f, phi;
-							if (sscanf(ROL, "%s %d %d %f %f", fc_str, 
-									&x, &y, &f, &phi) != 1 
-									+ MX_SRC_ARGC_SINELINFREQ) {
-								fprintf(stderr, "Error: Invalid format for "
-										"Source #%d: SineLinFreq\n", 
-										simulation.sourcec);
-								fclose(sim_file);
-								exit(EXIT_FAILURE);
-							}
-							if (strcmp(fc_str, "Ez") == 0) {
-								source.fc = FC_EZ;
-							} else if (strcmp(fc_str, "Hx") == 0) {
-								source.fc = FC_HX;
-							} else if (strcmp(fc_str, "Hy") == 0) {
-								source.fc = FC_HY;
-							} else {
-								fprintf(stderr, "Warning: Unknown field "
-										"component for Source #%d - "
-										"defaulting to Ez\n", 
-										simulation.sourcec);
-								source.fc = FC_EZ;
-								
-							}
-							source.argv[0].value.intVal = x;
-							source.argv[1].value.intVal = y;
-							source.argv[2].value.floatVal = f;
-							source.argv[3].value.floatVal = phi;
-							
-							sources[simulation.sourcec] = source;
-							simulation.sourcec++;
-						}
-					} else if (strcmp(sections[s], "[Materials]") == 0) {
-						char key[MX_SIMFILE_MAX_LINEL];
-						char ROL[MX_SIMFILE_MAX_LINEL];
-						if (sscanf(line, "%255s %[^\n]", key, ROL) < 1) {
-							fprintf(stderr, "Error: Invalid simulation\n");
-							fclose(sim_file);
-							exit(EXIT_FAILURE);
-						}
-						if (strcmp(key, "Triangle") == 0) {
-							Material material;
-							material.geom = MG_TRIANGLE;
-							material.argc = MX_MAT_ARGC_TRIANGLE;
-							material.argv[0].type = TYPE_FLOAT;
-							material.argv[1].type = TYPE_FLOAT;
-							material.argv[2].type = TYPE_FLOAT;
-							material.argv[3].type = TYPE_INT;
-							material.argv[4].type = TYPE_INT;
-							material.argv[5].type = TYPE_INT;
-							material.argv[6].type = TYPE_INT;
-							material.argv[7].type = TYPE_INT;
-							material.argv[8].type = TYPE_INT;
-							float rel_eps, rel_mu, sigma;
-							int x1, x2, x3, y1, y2, y3;
-							if (sscanf(ROL, "%f %f %f %d %d %d %d %d %d", 
-									&rel_eps, &rel_mu, &sigma, &x1, &y1, &x2, 
-									&y2, &x3, &y3) != MX_MAT_ARGC_TRIANGLE) {
-								fprintf(stderr, "Error: Invalid format for "
-										"Material #%d: Triangle\n", 
-										simulation.materialc);
-								fclose(sim_file);
-								exit(EXIT_FAILURE);
-							}
-							material.argv[0].value.floatVal = rel_eps;
-							material.argv[1].value.floatVal = rel_mu;
-							material.argv[2].value.floatVal = sigma;
-							material.argv[3].value.intVal = x1;
-							material.argv[4].value.intVal = y1;
-							material.argv[5].value.intVal = x2;
-							material.argv[6].value.intVal = y2;
-							material.argv[7].value.intVal = x3;
-							material.argv[8].value.intVal = y3;
-						
-							material.boundary = (int*)
-									calloc(simulation.width 
-									* simulation.height, sizeof(int));
-							if (material.boundary == NULL) {
-								fprintf(stderr, "Failed to allocate memory "
-										"for Material #%d's boundary mask.\n",
-										simulation.materialc);
-								for (int m = 0; m < simulation.materialc; 
-										m++) {
-									free(materials[m].boundary);
-								}
-								fclose(sim_file);
-								exit(EXIT_FAILURE);
-							}
-							computeMaterialBoundary(&simulation, &material);
-							materials[simulation.materialc] = material;
-							simulation.materialc++;
-						}
-						if (strcmp(key, "Circle") == 0) {
-							Material material;
-							material.geom = MG_CIRCLE;
-							material.argc = MX_MAT_ARGC_CIRCLE;
-							material.argv[0].type = TYPE_FLOAT;
-							material.argv[1].type = TYPE_FLOAT;
-							material.argv[2].type = TYPE_FLOAT;
-							material.argv[3].type = TYPE_INT;
-							material.argv[4].type = TYPE_INT;
-							material.argv[5].type = TYPE_INT;
-							float rel_eps, rel_mu, sigma;
-							int x, y, R;
-							if (sscanf(ROL, "%f %f %f %d %d %d", &rel_eps, 
-									&rel_mu, &sigma, &x, &y, &R) 
-									!= MX_MAT_ARGC_CIRCLE) {
-								fprintf(stderr, "Error: Invalid format for "
-										"Material #%d: Circle\n", 
-										simulation.materialc);
-								fclose(sim_file);
-								exit(EXIT_FAILURE);
-							}
-							material.argv[0].value.floatVal = rel_eps;
-							material.argv[1].value.floatVal = rel_mu;
-							material.argv[2].value.floatVal = sigma;
-							material.argv[2].value.intVal = x;
-							material.argv[3].value.intVal = y;
-							material.argv[4].value.intVal = R;
-
-							material.boundary = (int*)
-									calloc(simulation.width
-									* simulation.height, sizeof(int));
-							if (material.boundary == NULL) {
-								fprintf(stderr, "Failed to allocate memory "
-										"for Material #%d's boundary mask.\n",
-										simulation.materialc);
-								for (int m = 0; m < simulation.materialc;
-										m++) {
-									free(materials[m].boundary);
-								}
-								fclose(sim_file);
-								exit(EXIT_FAILURE);
-							}
-							computeMaterialBoundary(&simulation, &material);
-							materials[simulation.materialc] = material;
-							simulation.materialc++;
-						}
-					} else {
-						fprintf(stderr, "Unknown configuation section\n"); 
-					}
-				}
-			}
-		}		
-		fclose(sim_file);
 	}
+	if (fd >= 0) close(fd);
+	free(path);
+	return hit;
+}
 
-	if (simulation.boundary_condition == BC_UNK) {
-		fprintf(stderr, "Warning: No boundary conditions specified - "
-				"defaulting to natural.\n");
-		simulation.boundary_condition = BC_NAT;
-	} else if (simulation.boundary_condition == BC_PML) {
-		if (simulation.pml_layers == -1) 
-				simulation.pml_layers = MX_BC_PML_DEF_LAYERS;
-		if (simulation.pml_conductivity == -1) 
-				simulation.pml_conductivity = MX_BC_PML_DEF_SIGMA;
-		if (simulation.pml_sigma_polyorder == -1) 
-				simulation.pml_sigma_polyorder = MX_BC_PML_DEF_SIGPOLYORDER;
+// Allocates the fields and fills in every material and source. On failure
+// nothing is left allocated except the scene itself.
+bool buildScene(Field* field, Scene* scene, Simulation* simulation) {
+	// Rows of the material boundary mask are padded to whole words so that
+	// bands of rows never share a word
+	simulation->mask_pitch = (simulation->width + MX_MASK_WORD_BITS - 1) 
+			/ MX_MASK_WORD_BITS;
+
+	// Field rows are padded to whole cache lines, with a line of ghost 
+	// cells in front and room for at least one after
+	simulation->pitch = MX_ROW_ALIGN + (simulation->width + MX_ROW_ALIGN) 
+			/ MX_ROW_ALIGN * MX_ROW_ALIGN;
+	simulation->origin = simulation->pitch + MX_ROW_ALIGN;
+
+	if (!allocateFields(field, simulation)) {
+		fprintf(stderr, "Failed to allocate memory for field object.\n");
+		return false;
 	}
 
-	// Initialize GLFW
-	glfwSetErrorCallback(glfw_error_callback);
-	if (!glfwInit()) {
-		fprintf(stderr, "Failed to initialize glfw\n");
-		exit(EXIT_FAILURE);
+	// Initialize the field components and add any user-defined materials,
+	// reusing the rasterized materials of an identical earlier scene
+	initFields(field, simulation);
+	if (scene->cache.dir != NULL) {
+		scene->cache.key = sceneCacheKey(scene, simulation);
 	}
+	BoundingBox grid = {0, 0, simulation->width - 1, simulation->height - 1};
+	bool cached = scene->cache.dir != NULL 
+			&& loadSceneCache(&scene->cache, field, simulation);
+	if (!cached) applyMaterialMaps(field, simulation, &scene->maps, &grid);
+	if (!buildSpatialIndex(&scene->index, &scene->materials, 
+			simulation->width, simulation->height)) {
+		fprintf(stderr, "Failed to allocate memory for material index.\n");
+		freeFields(field, simulation);
+		return false;
+	}
+	if (!cached) {
+		rasterizeMaterials(field, simulation, scene);
+		if (scene->cache.dir != NULL) {
+			saveSceneCache(&scene->cache, field, simulation);
+		}
+	}
+	if (!compileSources(&scene->injection, &scene->sources, field, 
+			simulation)) {
+		fprintf(stderr, "Failed to allocate memory for source table.\n");
+		freeFields(field, simulation);
+		return false;
+	}
+	if (simulation->active_tiles && !initActivity(&simulation->activity, 
+			&scene->injection, simulation)) {
+		fprintf(stderr, "Failed to allocate memory for tile activity.\n");
+		freeFields(field, simulation);
+		return false;
+	}
+	return true;
+}
 
-	// Create a GLFW window for displaying simulation
-	GLFWwindow* window;
-	window = glfwCreateWindow(simulation.width, simulation.height, "Maxwell", 
-			NULL, NULL);
-	if (!window) {
-		fprintf(stderr, "Failed to create glfw window\n");
-		glfwTerminate();
-		exit(EXIT_FAILURE);
+bool sameBytes(const void* a, const void* b, size_t length) {
+	return length == 0 || memcmp(a, b, length) == 0;
+}
+
+bool sameMaterial(MaterialTable* a, MaterialTable* b, int m) {
+	if (a->geom[m] != b->geom[m] || a->rel_eps[m] != b->rel_eps[m] 
+			|| a->rel_mu[m] != b->rel_mu[m] || a->sigma[m] != b->sigma[m]) {
+		return false;
 	}
-	glfwMakeContextCurrent(window);
-	glfwSetKeyCallback(window, key_callback);
+	switch (a->geom[m]) {
+		case MG_TRIANGLE:
+			return sameBytes(&a->triangles[a->param[m]], 
+					&b->triangles[b->param[m]], sizeof(TriangleParams));
+		case MG_CIRCLE:
+			return sameBytes(&a->circles[a->param[m]], 
+					&b->circles[b->param[m]], sizeof(CircleParams));
+		default:
+			return true;
+	}
+}
 
-	// Allocate memory for field components
-	Field field;
-	float* Epsilon = (float*)malloc(simulation.width * simulation.height
-			* sizeof(float));
-	float* Mu = (float*)malloc(simulation.width * simulation.height
-			* sizeof(float));
-	float* Ex = (float*)malloc(simulation.width * simulation.height 
-			* sizeof(float));
-	float* Ey = (float*)malloc(simulation.width * simulation.height
-			* sizeof(float));
-	float* Ez = (float*)malloc(simulation.width * simulation.height 
-			* sizeof(float));
-	float* Hx = (float*)malloc(simulation.width * simulation.height 
-			* sizeof(float));
-	float* Hy = (float*)malloc(simulation.width * simulation.height 
-			* sizeof(float));
-	float* Hz = (float*)malloc(simulation.width * simulation.height
-			* sizeof(float));
-	float* Sigma = (float*)malloc(simulation.width * simulation.height
-			* sizeof(float));
-
-	if (Epsilon == NULL || Mu == NULL || Ex == NULL || Ey == NULL 
-			|| Ez == NULL || Hx == NULL || Hy == NULL || Hz == NULL
-			|| Sigma == NULL) {
-		fprintf(stderr, "Failed to allocate memory for field object.\n");
-		if (Epsilon != NULL) free(Epsilon);
-		if (Mu != NULL) free(Mu);
-		if (Ex != NULL) free(Ex);
-		if (Ey != NULL) free(Ey);
-		if (Ez != NULL) free(Ez);
-		if (Hx != NULL) free(Hx);
-		if (Hy != NULL) free(Hy);
-		if (Hz != NULL) free(Hz);
-		if (Sigma != NULL) free(Sigma);
-		for (int m = 0; m < simulation.materialc; m++) {
-			free(materials[m].boundary);
+bool sameMap(MaterialMap* a, MaterialMap* b) {
+	return a->quantity == b->quantity && a->type == b->type 
+			&& a->si_units == b->si_units && a->file_width == b->file_width
+			&& a->file_height == b->file_height && a->x == b->x 
+			&& a->y == b->y && a->width == b->width && a->height == b->height
+			&& a->identity == b->identity;
+}
+
+bool sameSources(SourceTable* a, SourceTable* b) {
+	size_t n = a->count;
+	return a->count == b->count && a->sinec == b->sinec 
+			&& a->pulsec == b->pulsec && a->filec == b->filec 
+			&& a->samplec == b->samplec && a->linec == b->linec
+			&& sameBytes(a->fxn, b->fxn, n * sizeof(SourceFunction))
+			&& sameBytes(a->fc, b->fc, n * sizeof(FieldComponent))
+			&& sameBytes(a->x, b->x, n * sizeof(int))
+			&& sameBytes(a->y, b->y, n * sizeof(int))
+			&& sameBytes(a->param, b->param, n * sizeof(int))
+			&& sameBytes(a->sines, b->sines, 
+			a->sinec * sizeof(SineLinFreqParams))
+			&& sameBytes(a->pulses, b->pulses, a->pulsec * sizeof(PulseParams))
+			&& sameBytes(a->files, b->files, a->filec * sizeof(WaveFileParams))
+			&& sameBytes(a->file_samples, b->file_samples, 
+			a->samplec * sizeof(float))
+			&& sameBytes(a->lines, b->lines, 
+			a->linec * sizeof(LineSourceParams));
+}
+
+void markBins(bool* dirty, SpatialIndex* index, BoundingBox* box, 
+		Simulation* simulation) {
+	BoundingBox bins;
+	if (!binRange(box, simulation->width, simulation->height, &bins)) return;
+	for (int by = bins.y0; by <= bins.y1; by++) {
+		for (int bx = bins.x0; bx <= bins.x1; bx++) {
+			dirty[by * index->cols + bx] = true;
 		}
-		glfwDestroyWindow(window);
-		glfwTerminate();
-		exit(EXIT_FAILURE);
 	}
+}
 
-	field.Epsilon = Epsilon;
-	field.Mu = Mu;
-	field.Ex = Ex;
-	field.Ey = Ey;
-	field.Ez = Ez;
-	field.Hx = Hx;
-	field.Hy = Hy;
-	field.Hz = Hz;
-	field.Sigma = Sigma;
+// Lists, in ascending order, the bins of the grid whose materials may 
+// differ between two scenes on it: those under any material or map that 
+// was added, removed or changed, both where it was and where it is. 
+// Materials and maps are matched by their place in the scene, and every 
+// bin is listed if all is set. Returns NULL if out of memory.
+int* diffMaterials(Scene* old, Scene* fresh, Simulation* simulation, 
+		bool all, int* binc) {
+	SpatialIndex* index = &old->index;
+	int nbins = index->cols * index->rows;
+	bool* dirty = (bool*)calloc(nbins, sizeof(bool));
+	int* bins = (int*)malloc(sizeof(int) * max(nbins, 1));
+	if (dirty == NULL || bins == NULL) {
+		free(dirty);
+		free(bins);
+		return NULL;
+	}
 
-	// Initialize the field components and add any user-defined materials
-	initFields(&field, &simulation);
-	addMaterials(&field, &simulation, materials);
+	MaterialTable* a = &old->materials;
+	MaterialTable* b = &fresh->materials;
+	for (int m = 0; m < max(a->count, b->count); m++) {
+		if (m < a->count && m < b->count && sameMaterial(a, b, m)) continue;
+		if (m < a->count) markBins(dirty, index, &a->bbox[m], simulation);
+		if (m < b->count) markBins(dirty, index, &b->bbox[m], simulation);
+	}
 
-	// Allocate memory for simulation image buffer
-	simulation.image = (float*)malloc(3 * simulation.width 
-			* simulation.height * sizeof(float));
-	if (simulation.image == NULL) {
-		fprintf(stderr, "Failed to allocate memory for simulation image "
-				"buffer.\n");
-		free(Epsilon);
-		free(Mu);
-		free(Ex);
-		free(Ey);
-		free(Ez);
-		free(Hx);
-		free(Hy);
-		free(Hz);
-		for (int m = 0; m < simulation.materialc; m++) {
-			free(materials[m].boundary);
+	// Every indexed map reads the palette
+	MapTable* maps[2] = {&old->maps, &fresh->maps};
+	bool palette = !sameBytes(maps[0]->palette_set, maps[1]->palette_set, 
+			sizeof(maps[0]->palette_set)) 
+			|| !sameBytes(maps[0]->palette_eps, maps[1]->palette_eps, 
+			sizeof(maps[0]->palette_eps)) 
+			|| !sameBytes(maps[0]->palette_mu, maps[1]->palette_mu, 
+			sizeof(maps[0]->palette_mu)) 
+			|| !sameBytes(maps[0]->palette_sigma, maps[1]->palette_sigma, 
+			sizeof(maps[0]->palette_sigma));
+	MaterialMap* map;
+	BoundingBox box;
+	for (int j = 0; j < max(maps[0]->count, maps[1]->count); j++) {
+		if (j < maps[0]->count && j < maps[1]->count 
+				&& sameMap(&maps[0]->maps[j], &maps[1]->maps[j]) 
+				&& !(palette && maps[0]->maps[j].quantity == MQ_INDEXED)) {
+			continue;
+		}
+		for (int k = 0; k < 2; k++) {
+			if (j >= maps[k]->count) continue;
+			map = &maps[k]->maps[j];
+			box.x0 = map->x;
+			box.y0 = map->y;
+			box.x1 = map->x + map->width - 1;
+			box.y1 = map->y + map->height - 1;
+			markBins(dirty, index, &box, simulation);
 		}
-		glfwDestroyWindow(window);
-		glfwTerminate();
-		exit(EXIT_FAILURE);
 	}
 
-	// Initialize OpenCL
+	*binc = 0;
+	for (int bin = 0; bin < nbins; bin++) {
+		if (all || dirty[bin]) bins[(*binc)++] = bin;
+	}
+	free(dirty);
+	return bins;
+}
+
+// Sets up the device, kernels and buffers and uploads the scene, falling 
+// back to the CPU on any failure
+bool initOpenCL(Field* field, Scene* scene, Simulation* simulation) {
 	cl_platform_id platform;
 	cl_device_id device;
-	cl_context context;
-	cl_command_queue queue;
-	cl_program program;
-	cl_kernel E_kernel;
-	cl_kernel H_kernel;
+	cl_context context = NULL;
+	cl_command_queue queue = NULL;
+	cl_program program = NULL;
+	cl_kernel E_kernels[TC_MAX] = {NULL};
+	cl_kernel H_kernels[TC_MAX] = {NULL};
+	cl_kernel H_image_kernels[TC_MAX] = {NULL};
 	cl_kernel VIS_TE_1_kernel;
 	cl_kernel VIS_TE_2_kernel;
 	cl_kernel drawMatBounds_kernel;
+	cl_kernel inject_kernel;
+	cl_kernel PEC_kernel = NULL;
+	cl_kernel markLive_kernel = NULL;
+	cl_kernel wrapH_kernel = NULL;
+	cl_kernel wrapEz_kernel = NULL;
+	TileActivity* activity = &simulation->activity;
 	cl_int err;
 
+	gpu_support = trying_gpu;
 	if (trying_gpu) {
 		printf("Attempting to set up GPU... ");
 	} else {
@@ -1167,7 +4290,7 @@ int main(int argc, char** argv) {
 	}
 
 	size_t kernelSize;
-	char* kernelSource;
+	char* kernelSource = NULL;
 	if (gpu_support) {
 		fseek(kernel_file, 0, SEEK_END);
 		kernelSize = ftell(kernel_file);
@@ -1176,46 +4299,57 @@ int main(int argc, char** argv) {
 	
 		if (!kernelSource) {
 			fprintf(stderr, "Error allocating memory for kernel source.\n");
-			fclose(kernel_file);
-			free(Epsilon);
-			free(Mu);
-			free(Ex);
-			free(Ey);
-			free(Ez);
-			free(Hx);
-			free(Hy);
-			free(Hz);
-			for (int m = 0; m < simulation.materialc; m++) {
-				free(materials[m].boundary);
-			}
-			glfwDestroyWindow(window);
-			glfwTerminate();
-			exit(EXIT_FAILURE);
+			gpu_support = false;
+		} else {
+			fread(kernelSource, 1, kernelSize, kernel_file);
+			kernelSource[kernelSize] = '\0';
 		}
-		fread(kernelSource, 1, kernelSize, kernel_file);
-		kernelSource[kernelSize] = '\0';
 		fclose(kernel_file);
-	}	
+	}
 
+	// The field updates are specialized for this grid through the build 
+	// options, and the built program is cached for later runs
+	char options[MX_BUILD_OPTIONS_MAXL];
+	char* binary_path = NULL;
+	bool from_binary = false;
 	if (gpu_support) {
+		programBuildOptions(simulation, options, sizeof(options));
+		binary_path = programCachePath(device, kernelSource, options);
+		if (binary_path != NULL) {
+			program = loadProgramBinary(context, device, binary_path);
+		}
+		if (program != NULL && clBuildProgram(program, 1, &device, options, 
+				NULL, NULL) != CL_SUCCESS) {
+			clReleaseProgram(program);
+			program = NULL;
+		}
+		from_binary = program != NULL;
+		if (from_binary) free(kernelSource);
+	}
+
+	if (gpu_support && !from_binary) {
 		size_t kernelSourceSize = strlen(kernelSource);
 		const char* kernelSourceArr[] = {kernelSource};
 		program = clCreateProgramWithSource(context, 1, kernelSourceArr, 
 				&kernelSourceSize, &err);
+		free(kernelSource);
 		switch (err) {
 			case CL_SUCCESS:
 				break;
 			default:
 				fprintf(stderr, "Error creating program from OpenCL kernel."
 						"\n");
-				free(kernelSource);
 				gpu_support = false;
 		}
 	}
 	
-	if (gpu_support) {
-	    switch (err = clBuildProgram(program, 1, &device, NULL, NULL, NULL)) {
+	if (gpu_support && !from_binary) {
+		switch (err = clBuildProgram(program, 1, &device, options, NULL, 
+				NULL)) {
 			case CL_SUCCESS:
+				if (binary_path != NULL) {
+					saveProgramBinary(program, binary_path);
+				}
 				break;
 			default:
 				fprintf(stderr, "Error building OpenCL program: %d\n", err);
@@ -1227,135 +4361,230 @@ int main(int argc, char** argv) {
 				if (log == NULL) {
 					fprintf(stderr, "Failed to allocate memory for OpenCL "
 							"kernel build log.\n");
-					free(kernelSource);
-					free(Epsilon);
-					free(Mu);
-					free(Ex);
-					free(Ey);
-					free(Ez);
-					free(Hx);
-					free(Hy);
-					free(Hz);
-					for (int m = 0; m < simulation.materialc; m++) {
-						free(materials[m].boundary);
-					}
-					glfwDestroyWindow(window);
-					glfwTerminate();
-					exit(EXIT_FAILURE);
+				} else {
+					clGetProgramBuildInfo(program, device, 
+							CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+					fprintf(stderr, "Build log:\n%s\n", log);
+					free(log);
 				}
-				clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 
-						log_size, log, NULL);
-				fprintf(stderr, "Build log:\n%s\n", log);
-				free(kernelSource);
+				gpu_support = false;
+		}
+	}
+
+	free(binary_path);
+
+	for (int c = 0; c < TC_MAX && gpu_support; c++) {
+		E_kernels[c] = clCreateKernel(program, E_kernel_names[c], &err);
+		if (err == CL_SUCCESS && H_kernel_names[c] != NULL) {
+			H_kernels[c] = clCreateKernel(program, H_kernel_names[c], &err);
+		}
+		if (err == CL_SUCCESS && H_image_kernel_names[c] != NULL) {
+			H_image_kernels[c] = clCreateKernel(program, 
+					H_image_kernel_names[c], &err);
+		}
+		switch (err) {
+			case CL_SUCCESS:
+				break;
+			default:
+				fprintf(stderr, "Error creating OpenCL kernel: %d\n", err);
+				gpu_support = false;
+		}
+	}
+
+	if (gpu_support) {
+		VIS_TE_1_kernel = clCreateKernel(program, "visualizeTE1", &err);
+		switch (err) {
+			case CL_SUCCESS:
+				break;
+			default:
+				fprintf(stderr, "Error creating visualization kernel: TE1\n");
+				gpu_support = false;
+		}
+	}
+
+	if (gpu_support) {
+		VIS_TE_2_kernel = clCreateKernel(program, "visualizeTE2", &err);
+		switch (err) {
+			case CL_SUCCESS:
+				break;
+			default:
+				fprintf(stderr, "Error creating visualization kernel: TE2\n");
 				gpu_support = false;
 		}
 	}
 
 	if (gpu_support) {
-		E_kernel = clCreateKernel(program, "updateEFields", &err);
+		drawMatBounds_kernel = clCreateKernel(program, 
+				"drawMaterialBoundaries", &err);
 		switch (err) {
 			case CL_SUCCESS:
 				break;
 			default:
-				fprintf(stderr, "Error creating OpenCL kernel: %d\n", err);
-				free(kernelSource);
+				fprintf(stderr, "Error creating material boundary rendering "
+						"kernel.\n");
 				gpu_support = false;
 		}
 	}
-	
+
 	if (gpu_support) {
-		H_kernel = clCreateKernel(program, "updateHFields", &err);
+		inject_kernel = clCreateKernel(program, "injectSources", &err);
 		switch (err) {
 			case CL_SUCCESS:
 				break;
 			default:
-				fprintf(stderr, "Error creating OpenCL kernel: %d\n", err);
-				free(kernelSource);
+				fprintf(stderr, "Error creating source injection kernel.\n");
 				gpu_support = false;
 		}
 	}
 
-	if (gpu_support) {
-		VIS_TE_1_kernel = clCreateKernel(program, "visualizeTE1", &err);
+	if (gpu_support && activity->list != NULL) {
+		markLive_kernel = clCreateKernel(program, "markLiveTiles", &err);
 		switch (err) {
 			case CL_SUCCESS:
 				break;
 			default:
-				fprintf(stderr, "Error creating visualization kernel: TE1\n");
-				free(kernelSource);
+				fprintf(stderr, "Error creating tile activity kernel.\n");
 				gpu_support = false;
 		}
 	}
 
-	if (gpu_support) {
-		VIS_TE_2_kernel = clCreateKernel(program, "visualizeTE2", &err);
+	if (gpu_support && (simulation->periodic[AX_X] 
+			|| simulation->periodic[AX_Y] || simulation->mirrored[AX_X] 
+			|| simulation->mirrored[AX_Y])) {
+		wrapH_kernel = clCreateKernel(program, "wrapH", &err);
+		if (err == CL_SUCCESS) {
+			wrapEz_kernel = clCreateKernel(program, "wrapEz", &err);
+		}
 		switch (err) {
 			case CL_SUCCESS:
 				break;
 			default:
-				fprintf(stderr, "Error creating visualization kernel: TE2\n");
-				free(kernelSource);
+				fprintf(stderr, "Error creating periodic and mirror "
+						"boundary kernels.\n");
 				gpu_support = false;
 		}
 	}
 
-	if (gpu_support) {
-		drawMatBounds_kernel = clCreateKernel(program, 
-				"drawMaterialBoundaries", &err);
+	if (gpu_support && simulation->boundary_condition == BC_PEC) {
+		PEC_kernel = clCreateKernel(program, "applyPEC", &err);
 		switch (err) {
 			case CL_SUCCESS:
 				break;
 			default:
-				fprintf(stderr, "Error creating material boundary rendering "
-						"kernel.\n");
-				free(kernelSource);
+				fprintf(stderr, "Error creating PEC boundary kernel.\n");
 				gpu_support = false;
 		}
 	}
 	
+	// Tiles of the grid sorted by the update variants they need, which 
+	// depend only on the materials
+	int* E_tiles = NULL;
+	int* H_tiles = NULL;
+	if (gpu_support) {
+		E_tiles = sortTiles(field, simulation, false, 
+				simulation->E_tile_start);
+		H_tiles = sortTiles(field, simulation, true, 
+				simulation->H_tile_start);
+		if (E_tiles == NULL || H_tiles == NULL) {
+			fprintf(stderr, "Failed to allocate memory for tile lists.\n");
+			gpu_support = false;
+		}
+	}
+
 	if (gpu_support) {
+		// Field buffers mirror the arena's grids, ghost cells included
+		size_t grid_size = sizeof(float) * gridFloats(simulation);
 		cl_mem Epsilon_kbuf = clCreateBuffer(context, CL_MEM_READ_WRITE, 
-				sizeof(float) * simulation.width * simulation.height, NULL, 
-				&err);
+				grid_size, NULL, &err);
 		cl_mem Mu_kbuf = clCreateBuffer(context, CL_MEM_READ_WRITE, 
-				sizeof(float) * simulation.width * simulation.height, NULL, 
-				&err);
+				grid_size, NULL, &err);
 		cl_mem Ez_kbuf = clCreateBuffer(context, CL_MEM_READ_WRITE, 
-				sizeof(float) * simulation.width * simulation.height, NULL, 
-				&err);
+				grid_size, NULL, &err);
 		cl_mem Hx_kbuf = clCreateBuffer(context, CL_MEM_READ_WRITE, 
-				sizeof(float) * simulation.width * simulation.height, NULL, 
-				&err);
+				grid_size, NULL, &err);
 		cl_mem Hy_kbuf = clCreateBuffer(context, CL_MEM_READ_WRITE, 
-				sizeof(float) * simulation.width * simulation.height, NULL, 
-				&err);
+				grid_size, NULL, &err);
 		cl_mem image_kbuf = clCreateBuffer(context, CL_MEM_READ_WRITE,
-				sizeof(float) * simulation.width * simulation.height * 3, 
+				sizeof(float) * imageWidth(simulation) 
+				* imageHeight(simulation) * 3, NULL, &err);
+		cl_mem matBoundMask_kbuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+				sizeof(uint32_t) * simulation->mask_pitch * simulation->height,
 				NULL, &err);
-		cl_mem matBoundMask_kbuf = clCreateBuffer(context, CL_MEM_READ_WRITE,
-				sizeof(float) * simulation.width * simulation.height, NULL,
-				&err);
 		cl_mem Sigma_kbuf = clCreateBuffer(context, CL_MEM_READ_WRITE,
-				sizeof(float) * simulation.width * simulation.height, NULL,
-				&err);		
-
-		simulation.Epsilon_kbuf = Epsilon_kbuf;
-		simulation.Mu_kbuf = Mu_kbuf;
-		simulation.Ez_kbuf = Ez_kbuf;
-		simulation.Hx_kbuf = Hx_kbuf;
-		simulation.Hy_kbuf = Hy_kbuf;
-		simulation.image_kbuf = image_kbuf;	
-		simulation.matBoundMask_kbuf = matBoundMask_kbuf;
-		simulation.Sigma_kbuf = Sigma_kbuf;
-		simulation.context = context;
-		simulation.queue = queue;
-		simulation.program = program;
-		simulation.E_kernel = E_kernel;
-		simulation.H_kernel = H_kernel;
-		simulation.VIS_TE_1_kernel = VIS_TE_1_kernel;
-		simulation.VIS_TE_2_kernel = VIS_TE_2_kernel;
-		simulation.drawMatBounds_kernel = drawMatBounds_kernel;
+				grid_size, NULL, &err);		
+		int tilec = simulation->E_tile_start[TC_MAX];
+		cl_mem Etiles_kbuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+				2 * sizeof(int) * tilec, NULL, &err);
+		cl_mem Htiles_kbuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+				2 * sizeof(int) * tilec, NULL, &err);
+		cl_mem live_kbuf = activity->list == NULL ? NULL 
+				: clCreateBuffer(context, CL_MEM_READ_WRITE, 
+				sizeof(int) * tilec, NULL, &err);
+
+		simulation->Epsilon_kbuf = Epsilon_kbuf;
+		simulation->Mu_kbuf = Mu_kbuf;
+		simulation->Ez_kbuf = Ez_kbuf;
+		simulation->Hx_kbuf = Hx_kbuf;
+		simulation->Hy_kbuf = Hy_kbuf;
+		simulation->image_kbuf = image_kbuf;	
+		simulation->matBoundMask_kbuf = matBoundMask_kbuf;
+		simulation->Sigma_kbuf = Sigma_kbuf;
+		simulation->context = context;
+		simulation->queue = queue;
+		simulation->program = program;
+		memcpy(simulation->E_kernels, E_kernels, sizeof(E_kernels));
+		memcpy(simulation->H_kernels, H_kernels, sizeof(H_kernels));
+		memcpy(simulation->H_image_kernels, H_image_kernels, 
+				sizeof(H_image_kernels));
+		simulation->VIS_TE_1_kernel = VIS_TE_1_kernel;
+		simulation->VIS_TE_2_kernel = VIS_TE_2_kernel;
+		simulation->drawMatBounds_kernel = drawMatBounds_kernel;
+		simulation->inject_kernel = inject_kernel;
+		simulation->PEC_kernel = PEC_kernel;
+		simulation->markLive_kernel = markLive_kernel;
+		simulation->wrapH_kernel = wrapH_kernel;
+		simulation->wrapEz_kernel = wrapEz_kernel;
+		simulation->device = device;
+		simulation->Etiles_kbuf = Etiles_kbuf;
+		simulation->Htiles_kbuf = Htiles_kbuf;
+		simulation->live_kbuf = live_kbuf;
+		createSourceBuffers(simulation, &scene->injection);
+
+		// The boundary mask, tiles and source table only change when the 
+		// simulation file is reloaded, which uploads just what changed
+		clEnqueueWriteBuffer(queue, matBoundMask_kbuf, CL_TRUE, 0, 
+				sizeof(uint32_t) * simulation->mask_pitch * simulation->height,
+				simulation->matBoundMask, 0, NULL, NULL);
+		clEnqueueWriteBuffer(queue, Etiles_kbuf, CL_TRUE, 0, 
+				2 * sizeof(int) * tilec, E_tiles, 0, NULL, NULL);
+		clEnqueueWriteBuffer(queue, Htiles_kbuf, CL_TRUE, 0, 
+				2 * sizeof(int) * tilec, H_tiles, 0, NULL, NULL);
+		int* E_start = simulation->E_tile_start;
+		int* H_start = simulation->H_tile_start;
+		printf("Update tiles: E %d vacuum, %d dielectric, %d lossy; "
+				"H %d vacuum, %d magnetic.\n", E_start[1] - E_start[0], 
+				E_start[2] - E_start[1], E_start[3] - E_start[2], 
+				H_start[1] - H_start[0], H_start[2] - H_start[1]);
+		uploadSources(simulation, &scene->injection);
+		uploadFields(field, simulation);
+		setKernelArgs(simulation);
+		if (autotuneKernels(simulation)) resetFields(field, simulation);
 	}
+
+	// Under ActiveTiles, each check narrows the full lists down to the 
+	// active tiles, so they are kept
+	if (gpu_support && activity->list != NULL) {
+		activity->E_tiles = E_tiles;
+		activity->H_tiles = H_tiles;
+		memcpy(activity->E_start, simulation->E_tile_start, 
+				sizeof(activity->E_start));
+		memcpy(activity->H_start, simulation->H_tile_start, 
+				sizeof(activity->H_start));
+		E_tiles = NULL;
+		H_tiles = NULL;
+	}
+	free(E_tiles);
+	free(H_tiles);
 	
 	if (trying_gpu) {
 		if (gpu_support) {
@@ -1363,36 +4592,940 @@ int main(int argc, char** argv) {
 		} else {
 			printf("Failed. Falling back to CPU.\n");
 		}
-	} 
-
-	// Aggregate together all material boundaries
-	float* matBoundMask = (float*)calloc(simulation.width * simulation.height,
-			sizeof(float));
-	if (matBoundMask == NULL) {
-		fprintf(stderr, "Failed to allocate memory for aggregated material "
-				"boundary mask.\n");
-		if (gpu_support) free(kernelSource);
-		free(Epsilon);
-		free(Mu);
-		free(Ex);
-		free(Ey);
-		free(Ez);
-		free(Hx);
-		free(Hy);
-		free(Hz);
-		for (int m = 0; m < simulation.materialc; m++) {
-			free(materials[m].boundary);
+	}
+	return gpu_support;
+}
+
+void releaseOpenCL(Simulation* simulation) {
+	cl_mem buffers[] = {
+		simulation->Ez_kbuf, simulation->Hx_kbuf, simulation->Hy_kbuf, 
+		simulation->Epsilon_kbuf, simulation->Mu_kbuf, simulation->image_kbuf,
+		simulation->matBoundMask_kbuf, simulation->Sigma_kbuf, 
+		simulation->Etiles_kbuf, simulation->Htiles_kbuf, 
+		simulation->live_kbuf
+	};
+	cl_kernel kernels[] = {
+		simulation->E_kernels[TC_VACUUM], simulation->E_kernels[TC_DIELECTRIC],
+		simulation->E_kernels[TC_LOSSY], simulation->H_kernels[TC_VACUUM], 
+		simulation->H_kernels[TC_DIELECTRIC], 
+		simulation->H_image_kernels[TC_VACUUM], 
+		simulation->H_image_kernels[TC_DIELECTRIC], 
+		simulation->VIS_TE_1_kernel, simulation->VIS_TE_2_kernel, 
+		simulation->drawMatBounds_kernel, simulation->inject_kernel,
+		simulation->PEC_kernel, simulation->markLive_kernel,
+		simulation->wrapH_kernel, simulation->wrapEz_kernel
+	};
+	for (size_t b = 0; b < sizeof(buffers) / sizeof(cl_mem); b++) {
+		if (buffers[b] != NULL) clReleaseMemObject(buffers[b]);
+	}
+	releaseSourceBuffers(simulation);
+	for (size_t k = 0; k < sizeof(kernels) / sizeof(cl_kernel); k++) {
+		if (kernels[k] != NULL) clReleaseKernel(kernels[k]);
+	}
+	if (simulation->program != NULL) clReleaseProgram(simulation->program);
+	if (simulation->queue != NULL) clReleaseCommandQueue(simulation->queue);
+	if (simulation->context != NULL) clReleaseContext(simulation->context);
+	free(simulation->tuning_path);
+	simulation->tuning_path = NULL;
+}
+
+// Probes a cell of the image, which in a reflection is read from the grid
+// cell it mirrors
+void reportProbe(Field* field, Simulation* simulation, Scene* scene, int x, 
+		int y) {
+	if (x < 0 || y < 0 || x >= imageWidth(simulation) 
+			|| y >= imageHeight(simulation)) {
+		return;
+	}
+	int m = (x >= simulation->width) + 2 * (y >= simulation->height);
+	int gx = m & 1 ? 2 * simulation->width - 1 - x : x;
+	int gy = m & 2 ? 2 * simulation->height - 1 - y : y;
+	int index = gy * simulation->pitch + gx;
+	float Ez, Hx, Hy;
+
+	// The device holds the only current copy of the dynamic fields, so the
+	// host's is refreshed where the reflection reads it
+	if (gpu_support) {
+		int cells[3] = {index, index - (m & 2 ? simulation->pitch : 0), 
+				index - (m & 1)};
+		cl_mem bufs[3] = {simulation->Ez_kbuf, simulation->Hx_kbuf, 
+				simulation->Hy_kbuf};
+		float* grids[3] = {field->Ez, field->Hx, field->Hy};
+		for (int f = 0; f < 3; f++) {
+			clEnqueueReadBuffer(simulation->queue, bufs[f], CL_TRUE, 
+					sizeof(float) * (simulation->origin + cells[f]), 
+					sizeof(float), grids[f] + cells[f], 0, NULL, NULL);
+		}
+	}
+	reflectCell(field, simulation, gx, gy, m, &x, &y, &Ez, &Hx, &Hy);
+	printf("Probe at (%d, %d): Ez = %g, Hx = %g, Hy = %g, eps_r = %g, "
+			"mu_r = %g, sigma = %g\n", x, y, Ez, Hx, Hy, 
+			field->Epsilon[index] / VACUUM_PERMITTIVITY, 
+			field->Mu[index] / VACUUM_PERMEABILITY, field->Sigma[index]);
+
+	int found[MX_PROBE_MAX_MATERIALS];
+	int nfound = queryMaterials(scene, simulation->width, simulation->height,
+			gx, gy, found, MX_PROBE_MAX_MATERIALS);
+	for (int i = 0; i < min(nfound, MX_PROBE_MAX_MATERIALS); i++) {
+		int m = found[i];
+		printf("  Material #%d: %s, eps_r = %g, mu_r = %g, sigma = %g\n", 
+				m, scene->materials.geom[m] == MG_TRIANGLE ? "Triangle" 
+				: "Circle", scene->materials.rel_eps[m], 
+				scene->materials.rel_mu[m], scene->materials.sigma[m]);
+	}
+	if (nfound > MX_PROBE_MAX_MATERIALS) {
+		printf("  ... and %d more\n", nfound - MX_PROBE_MAX_MATERIALS);
+	}
+	if (nfound == 0) printf("  No materials\n");
+}
+
+void parserMessage(SimParser* parser, const char* level, const char* format,
+		...) {
+	va_list args;
+	va_start(args, format);
+	fprintf(stderr, "%s:%d: %s: ", parser->path, parser->line, level);
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+bool nextLine(SimParser* parser) {
+	if (parser->line_end != NULL) {
+		if (parser->line_end == parser->end) return false;
+		parser->pos = parser->line_end + 1;
+	}
+	if (parser->pos >= parser->end) return false;
+	parser->line++;
+
+	// Comments run from '#' to the end of the line
+	const char* newline = memchr(parser->pos, '\n', 
+			parser->end - parser->pos);
+	parser->line_end = newline != NULL ? newline : parser->end;
+	const char* comment = memchr(parser->pos, '#', 
+			parser->line_end - parser->pos);
+	parser->token_end = comment != NULL ? comment : parser->line_end;
+	return true;
+}
+
+bool nextToken(SimParser* parser, Token* token) {
+	while (parser->pos < parser->token_end && isspace((unsigned char)
+			*parser->pos)) {
+		parser->pos++;
+	}
+	if (parser->pos == parser->token_end) return false;
+	token->start = parser->pos;
+	while (parser->pos < parser->token_end && !isspace((unsigned char)
+			*parser->pos)) {
+		parser->pos++;
+	}
+	token->length = parser->pos - token->start;
+	return true;
+}
+
+bool tokenIs(Token* token, const char* word) {
+	return (size_t)token->length == strlen(word) 
+			&& memcmp(token->start, word, token->length) == 0;
+}
+
+// The mapping isn't NUL-terminated, so numbers are converted from a short 
+// copy of their token
+bool nextInt(SimParser* parser, int* value) {
+	Token token;
+	char number[MX_NUMBER_MAXL];
+	char* end;
+	if (!nextToken(parser, &token) || token.length >= MX_NUMBER_MAXL) {
+		return false;
+	}
+	memcpy(number, token.start, token.length);
+	number[token.length] = '\0';
+	long parsed = strtol(number, &end, 10);
+	if (*end != '\0' || parsed < INT_MIN || parsed > INT_MAX) return false;
+	*value = (int)parsed;
+	return true;
+}
+
+bool nextFloat(SimParser* parser, float* value) {
+	Token token;
+	char number[MX_NUMBER_MAXL];
+	char* end;
+	if (!nextToken(parser, &token) || token.length >= MX_NUMBER_MAXL) {
+		return false;
+	}
+	memcpy(number, token.start, token.length);
+	number[token.length] = '\0';
+	*value = strtof(number, &end);
+	return *end == '\0';
+}
+
+void endLine(SimParser* parser) {
+	Token token;
+	if (nextToken(parser, &token)) {
+		parserMessage(parser, "Warning", "Ignoring extra arguments from "
+				"'%.*s'", token.length, token.start);
+	}
+}
+
+bool moreTokens(SimParser* parser) {
+	while (parser->pos < parser->token_end && isspace((unsigned char)
+			*parser->pos)) {
+		parser->pos++;
+	}
+	return parser->pos < parser->token_end;
+}
+
+bool parseSimulationKey(SimParser* parser, Token* key, Scene* scene, 
+		Simulation* simulation) {
+	Token value;
+	if (tokenIs(key, "Width")) {
+		if (!nextInt(parser, &simulation->width)) {
+			parserMessage(parser, "Error", "Invalid format for "
+					"Simulation.Width");
+			return false;
+		}
+	} else if (tokenIs(key, "Height")) {
+		if (!nextInt(parser, &simulation->height)) {
+			parserMessage(parser, "Error", "Invalid format for "
+					"Simulation.Height");
+			return false;
+		}
+	} else if (tokenIs(key, "Threads")) {
+		if (!nextInt(parser, &simulation->threads) 
+				|| simulation->threads < 1) {
+			parserMessage(parser, "Error", "Invalid format for "
+					"Simulation.Threads");
+			return false;
+		}
+	} else if (tokenIs(key, "Smoothing")) {
+		if (!nextInt(parser, &simulation->smoothing) 
+				|| simulation->smoothing < 1 
+				|| simulation->smoothing > MX_SMOOTHING_MAX) {
+			parserMessage(parser, "Error", "Invalid format for "
+					"Simulation.Smoothing");
+			return false;
+		}
+	} else if (tokenIs(key, "ComputeOn")) {
+		if (nextToken(parser, &value) && tokenIs(&value, "CPU")) {
+			trying_gpu = false;
+		}
+	} else if (tokenIs(key, "Periodic")) {
+		Axis axis;
+		float phase = 0;
+		if (!nextToken(parser, &value) || (!tokenIs(&value, "x") 
+				&& !tokenIs(&value, "y")) || (moreTokens(parser) 
+				&& !nextFloat(parser, &phase))) {
+			parserMessage(parser, "Error", "Invalid format for "
+					"Simulation.Periodic");
+			return false;
+		}
+
+		// The fields are real, so a Bloch phase can only flip their sign
+		axis = tokenIs(&value, "x") ? AX_X : AX_Y;
+		phase = fmodf(fabsf(phase), 360);
+		if (phase != 0 && phase != 180) {
+			parserMessage(parser, "Error", "Simulation.Periodic phase must "
+					"be 0 or 180 degrees");
+			return false;
+		}
+		simulation->periodic[axis] = true;
+		simulation->bloch_sign[axis] = phase == 180 ? -1 : 1;
+		printf("Using %s boundaries along %c.\n", phase == 180 
+				? "antiperiodic" : "periodic", axis == AX_X ? 'x' : 'y');
+	} else if (tokenIs(key, "Symmetry")) {
+		Token parity;
+		if (!nextToken(parser, &value) || (!tokenIs(&value, "x") 
+				&& !tokenIs(&value, "y")) || !nextToken(parser, &parity) 
+				|| (!tokenIs(&parity, "Even") && !tokenIs(&parity, "Odd"))) {
+			parserMessage(parser, "Error", "Invalid format for "
+					"Simulation.Symmetry");
+			return false;
+		}
+		Axis axis = tokenIs(&value, "x") ? AX_X : AX_Y;
+		simulation->mirrored[axis] = true;
+		simulation->mirror_sign[axis] = tokenIs(&parity, "Odd") ? -1 : 1;
+		printf("Using an %s mirror plane across %c.\n", 
+				tokenIs(&parity, "Odd") ? "odd" : "even", 
+				axis == AX_X ? 'x' : 'y');
+	} else if (tokenIs(key, "ActiveTiles")) {
+		if (!nextToken(parser, &value)) {
+			parserMessage(parser, "Error", "Invalid format for "
+					"Simulation.ActiveTiles");
+			return false;
+		}
+		if (tokenIs(&value, "On")) {
+			simulation->active_tiles = true;
+		} else if (tokenIs(&value, "Off")) {
+			simulation->active_tiles = false;
+		} else {
+			parserMessage(parser, "Warning", "Unknown ActiveTiles setting: "
+					"%.*s - ignoring", value.length, value.start);
+		}
+	} else if (tokenIs(key, "Colorize")) {
+		if (!nextToken(parser, &value)) {
+			parserMessage(parser, "Error", "Invalid format for "
+					"Simulation.Colorize");
+			return false;
+		}
+		if (tokenIs(&value, "Fused")) {
+			simulation->fused_colorize = true;
+		} else if (tokenIs(&value, "Separate")) {
+			simulation->fused_colorize = false;
+		} else {
+			parserMessage(parser, "Warning", "Unknown colorize mode: %.*s - "
+					"ignoring", value.length, value.start);
+		}
+	} else if (tokenIs(key, "Boundary")) {
+		if (!nextToken(parser, &value)) {
+			parserMessage(parser, "Error", "Invalid boundary conditions.");
+			return false;
+		}
+		if (tokenIs(&value, "Natural")) {
+			printf("Using natural boundaries.\n");
+			simulation->boundary_condition = BC_NAT;
+		} else if (tokenIs(&value, "PEC")) {
+			printf("Using PEC boundaries.\n");
+			simulation->boundary_condition = BC_PEC;
+		} else if (tokenIs(&value, "PML")) {
+			printf("Using PML boundaries.\n");
+			simulation->boundary_condition = BC_PML;
+			if (!nextInt(parser, &simulation->pml_layers)) {
+				printf("No arguments specified for PML boundary - using "
+						"defaults.\n");
+				simulation->pml_layers = -1;
+			} else if (!nextFloat(parser, &simulation->pml_conductivity) 
+					|| !nextInt(parser, &simulation->pml_sigma_polyorder)) {
+				parserMessage(parser, "Warning", "Improper number of "
+						"arguments specified for PML boundary - using "
+						"defaults.");
+				simulation->pml_layers = -1;
+				simulation->pml_conductivity = -1;
+				simulation->pml_sigma_polyorder = -1;
+			}
+		} else {
+			parserMessage(parser, "Warning", "Unknown boundary: %.*s - "
+					"ignoring", value.length, value.start);
+		}
+	} else if (tokenIs(key, "Profile")) {
+		if (moreTokens(parser) && (!nextFloat(parser, 
+				&simulation->profiler.period) 
+				|| simulation->profiler.period < 0)) {
+			parserMessage(parser, "Error", "Invalid format for "
+					"Simulation.Profile");
+			return false;
+		}
+		simulation->profiler.enabled = true;
+	} else if (tokenIs(key, "Autotune")) {
+		if (!nextToken(parser, &value)) {
+			parserMessage(parser, "Error", "Invalid format for "
+					"Simulation.Autotune");
+			return false;
+		}
+		simulation->autotune = !tokenIs(&value, "Off");
+		free(simulation->tuning_path);
+		simulation->tuning_path = NULL;
+		if (simulation->autotune) {
+			simulation->tuning_path = strndup(value.start, value.length);
+			if (simulation->tuning_path == NULL) {
+				parserMessage(parser, "Error", "Failed to allocate memory "
+						"for Simulation.Autotune");
+				return false;
+			}
+		}
+	} else if (tokenIs(key, "SceneCache")) {
+		if (!nextToken(parser, &value)) {
+			parserMessage(parser, "Error", "Invalid format for "
+					"Simulation.SceneCache");
+			return false;
+		}
+		free(scene->cache.dir);
+		scene->cache.dir = strndup(value.start, value.length);
+		if (scene->cache.dir == NULL) {
+			parserMessage(parser, "Error", "Failed to allocate memory for "
+					"Simulation.SceneCache");
+			return false;
+		}
+	} else {
+		parserMessage(parser, "Warning", "Unknown key: Simulation.%.*s - "
+				"ignoring", key->length, key->start);
+		return true;
+	}
+	endLine(parser);
+	return true;
+}
+
+bool nextFieldComponent(SimParser* parser, FieldComponent* fc, 
+		int source) {
+	Token token;
+	if (!nextToken(parser, &token)) return false;
+	if (tokenIs(&token, "Ez")) {
+		*fc = FC_EZ;
+	} else if (tokenIs(&token, "Hx")) {
+		*fc = FC_HX;
+	} else if (tokenIs(&token, "Hy")) {
+		*fc = FC_HY;
+	} else {
+		parserMessage(parser, "Warning", "Unknown field component for "
+				"Source #%d - defaulting to Ez", source);
+		*fc = FC_EZ;
+	}
+	return true;
+}
+
+bool nextLineDirection(SimParser* parser, LineDirection* direction) {
+	Token token;
+	if (!nextToken(parser, &token)) return false;
+	if (tokenIs(&token, "+x")) {
+		*direction = LD_POS_X;
+	} else if (tokenIs(&token, "-x")) {
+		*direction = LD_NEG_X;
+	} else if (tokenIs(&token, "+y")) {
+		*direction = LD_POS_Y;
+	} else if (tokenIs(&token, "-y")) {
+		*direction = LD_NEG_Y;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+bool parseSourceKey(SimParser* parser, Token* key, Scene* scene, 
+		Simulation* simulation) {
+	SourceTable* sources = &scene->sources;
+	FieldComponent fc;
+	int x, y, i = 0;
+	bool valid;
+	if (tokenIs(key, "SineLinFreq")) {
+		SineLinFreqParams sine;
+		valid = nextFieldComponent(parser, &fc, sources->count) 
+				&& nextInt(parser, &x) && nextInt(parser, &y) 
+				&& nextFloat(parser, &sine.frequency) 
+				&& nextFloat(parser, &sine.phase);
+		if (valid) i = addSineLinFreq(sources, fc, x, y, sine);
+	} else if (tokenIs(key, "GaussianPulse")) {
+		PulseParams pulse = {0};
+		valid = nextFieldComponent(parser, &fc, sources->count) 
+				&& nextInt(parser, &x) && nextInt(parser, &y) 
+				&& nextFloat(parser, &pulse.amplitude) 
+				&& nextFloat(parser, &pulse.delay) 
+				&& nextFloat(parser, &pulse.width) && pulse.width > 0;
+		if (valid) i = addPulse(sources, GAUSSIANPULSE, fc, x, y, pulse);
+	} else if (tokenIs(key, "ModulatedGaussian")) {
+		PulseParams pulse;
+		valid = nextFieldComponent(parser, &fc, sources->count) 
+				&& nextInt(parser, &x) && nextInt(parser, &y) 
+				&& nextFloat(parser, &pulse.amplitude) 
+				&& nextFloat(parser, &pulse.delay) 
+				&& nextFloat(parser, &pulse.width) 
+				&& nextFloat(parser, &pulse.frequency) 
+				&& nextFloat(parser, &pulse.phase) && pulse.width > 0;
+		if (valid) {
+			i = addPulse(sources, MODULATEDGAUSSIAN, fc, x, y, pulse);
+		}
+	} else if (tokenIs(key, "Ricker")) {
+		PulseParams pulse = {0};
+		valid = nextFieldComponent(parser, &fc, sources->count) 
+				&& nextInt(parser, &x) && nextInt(parser, &y) 
+				&& nextFloat(parser, &pulse.amplitude) 
+				&& nextFloat(parser, &pulse.delay) 
+				&& nextFloat(parser, &pulse.frequency) 
+				&& pulse.frequency > 0;
+		if (valid) i = addPulse(sources, RICKER, fc, x, y, pulse);
+	} else if (tokenIs(key, "File")) {
+		WaveFileParams file;
+		Token path;
+		valid = nextFieldComponent(parser, &fc, sources->count) 
+				&& nextInt(parser, &x) && nextInt(parser, &y) 
+				&& nextFloat(parser, &file.amplitude) 
+				&& nextFloat(parser, &file.period) && file.period >= 0 
+				&& nextToken(parser, &path);
+		if (valid) {
+			// A period of 0 means one sample per step
+			if (file.period == 0) file.period = simulation->dt;
+			char* wave_path = strndup(path.start, path.length);
+			if (wave_path == NULL || !loadWaveFile(sources, wave_path, 
+					&file)) {
+				parserMessage(parser, "Error", "Failed to load waveform for "
+						"Source #%d", sources->count);
+				free(wave_path);
+				return false;
+			}
+			free(wave_path);
+			i = addWaveFile(sources, fc, x, y, file);
+		}
+	} else if (tokenIs(key, "LineSource")) {
+		LineSourceParams line;
+		valid = nextLineDirection(parser, &line.direction) 
+				&& nextInt(parser, &line.position) 
+				&& nextInt(parser, &line.start) 
+				&& nextInt(parser, &line.end) 
+				&& nextFloat(parser, &line.amplitude) 
+				&& nextFloat(parser, &line.frequency) 
+				&& nextFloat(parser, &line.phase) 
+				&& nextFloat(parser, &line.angle) 
+				&& nextFloat(parser, &line.waist) 
+				&& fabsf(line.angle) < 90;
+		if (valid) i = addLineSource(sources, line);
+	} else {
+		parserMessage(parser, "Warning", "Unknown key: Sources.%.*s - "
+				"ignoring", key->length, key->start);
+		return true;
+	}
+	if (!valid) {
+		parserMessage(parser, "Error", "Invalid format for Source #%d: %.*s",
+				sources->count, key->length, key->start);
+		return false;
+	}
+	if (i < 0) {
+		parserMessage(parser, "Error", "Failed to allocate memory for Source "
+				"#%d.", sources->count);
+		return false;
+	}
+	endLine(parser);
+	return true;
+}
+
+bool parseMaterialMap(SimParser* parser, Token* key, Scene* scene, 
+		Simulation* simulation) {
+	MaterialMap map;
+	memset(&map, 0, sizeof(MaterialMap));
+	map.quantity = MQ_INDEXED;
+	map.width = -1;
+	map.height = -1;
+
+	// Map Epsilon|Mu|Sigma path [x y [width height]], or IndexedMap path ...
+	Token token;
+	bool valid = true;
+	if (tokenIs(key, "Map")) {
+		valid = nextToken(parser, &token);
+		if (valid && tokenIs(&token, "Epsilon")) {
+			map.quantity = MQ_EPSILON;
+		} else if (valid && tokenIs(&token, "Mu")) {
+			map.quantity = MQ_MU;
+		} else if (valid && tokenIs(&token, "Sigma")) {
+			map.quantity = MQ_SIGMA;
+		} else {
+			valid = false;
+		}
+	}
+	Token path;
+	valid = valid && nextToken(parser, &path);
+	if (valid && moreTokens(parser)) {
+		valid = nextInt(parser, &map.x) && nextInt(parser, &map.y);
+		if (valid && moreTokens(parser)) {
+			valid = nextInt(parser, &map.width) 
+					&& nextInt(parser, &map.height) && map.width > 0 
+					&& map.height > 0;
+		}
+	}
+	if (!valid) {
+		parserMessage(parser, "Error", "Invalid format for Material map #%d:"
+				" %.*s", scene->maps.count, key->length, key->start);
+		return false;
+	}
+
+	char* map_path = strndup(path.start, path.length);
+	if (map_path == NULL || !openMaterialMap(&map, map_path, simulation)) {
+		parserMessage(parser, "Error", "Failed to load Material map #%d", 
+				scene->maps.count);
+		free(map_path);
+		return false;
+	}
+	free(map_path);
+	if (addMaterialMap(&scene->maps, map) < 0) {
+		munmap(map.mapping, map.length);
+		parserMessage(parser, "Error", "Failed to allocate memory for "
+				"Material map #%d.", scene->maps.count);
+		return false;
+	}
+	endLine(parser);
+	return true;
+}
+
+bool parseMaterialKey(SimParser* parser, Token* key, Scene* scene, 
+		Simulation* simulation) {
+	MaterialTable* materials = &scene->materials;
+	float rel_eps, rel_mu, sigma;
+	int m = 0;
+	bool valid;
+	if (tokenIs(key, "Triangle")) {
+		TriangleParams tri;
+		valid = nextFloat(parser, &rel_eps) && nextFloat(parser, &rel_mu) 
+				&& nextFloat(parser, &sigma) && nextInt(parser, &tri.x1) 
+				&& nextInt(parser, &tri.y1) && nextInt(parser, &tri.x2) 
+				&& nextInt(parser, &tri.y2) && nextInt(parser, &tri.x3) 
+				&& nextInt(parser, &tri.y3);
+		if (valid) m = addTriangle(materials, rel_eps, rel_mu, sigma, tri);
+	} else if (tokenIs(key, "Circle")) {
+		CircleParams circle;
+		valid = nextFloat(parser, &rel_eps) && nextFloat(parser, &rel_mu) 
+				&& nextFloat(parser, &sigma) && nextInt(parser, &circle.x) 
+				&& nextInt(parser, &circle.y) && nextInt(parser, &circle.R);
+		if (valid) m = addCircle(materials, rel_eps, rel_mu, sigma, circle);
+	} else if (tokenIs(key, "Map") || tokenIs(key, "IndexedMap")) {
+		return parseMaterialMap(parser, key, scene, simulation);
+	} else if (tokenIs(key, "MapIndex")) {
+		int i;
+		valid = nextInt(parser, &i) && nextFloat(parser, &rel_eps) 
+				&& nextFloat(parser, &rel_mu) && nextFloat(parser, &sigma) 
+				&& setMapIndex(&scene->maps, i, rel_eps, rel_mu, sigma);
+		if (!valid) {
+			parserMessage(parser, "Error", "Invalid format for MapIndex - "
+					"expected an index below %d and eps_r mu_r sigma", 
+					MX_MAP_PALETTE);
+			return false;
+		}
+	} else {
+		parserMessage(parser, "Warning", "Unknown key: Materials.%.*s - "
+				"ignoring", key->length, key->start);
+		return true;
+	}
+	if (!valid) {
+		parserMessage(parser, "Error", "Invalid format for Material #%d: "
+				"%.*s", materials->count, key->length, key->start);
+		return false;
+	}
+	if (m < 0) {
+		parserMessage(parser, "Error", "Failed to allocate memory for "
+				"Material #%d.", materials->count);
+		return false;
+	}
+	endLine(parser);
+	return true;
+}
+
+// A mirror plane lies across the middle of its axis, between the two 
+// central cells, and the grid keeps the half in front of it
+bool foldMirrors(Simulation* simulation, const char* path) {
+	int* lengths[AX_MAX] = {&simulation->width, &simulation->height};
+	const char* names[AX_MAX] = {"Width", "Height"};
+	for (int a = 0; a < AX_MAX; a++) {
+		if (!simulation->mirrored[a]) continue;
+		if (simulation->periodic[a]) {
+			fprintf(stderr, "%s: Error: Simulation.Symmetry and "
+					"Simulation.Periodic can't share the %c axis\n", path,
+					a == AX_X ? 'x' : 'y');
+			return false;
+		}
+		if (*lengths[a] < 2 || *lengths[a] % 2 != 0) {
+			fprintf(stderr, "%s: Error: Simulation.Symmetry %c needs an "
+					"even Simulation.%s\n", path, a == AX_X ? 'x' : 'y', 
+					names[a]);
+			return false;
+		}
+		*lengths[a] /= 2;
+	}
+	return true;
+}
+
+bool parseSimFile(const char* path, Simulation* simulation, Scene* scene) {
+	int fd = open(path, O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0) {
+		fprintf(stderr, "Error opening file at %s.\n", path);
+		if (fd >= 0) close(fd);
+		return false;
+	}
+
+	// Map the whole file and walk it once; an empty file has nothing to map
+	char* data = NULL;
+	if (info.st_size > 0) {
+		data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "Error reading file at %s.\n", path);
+			close(fd);
+			return false;
+		}
+		madvise(data, info.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	SimParser parser = {0};
+	parser.path = path;
+	parser.pos = data;
+	parser.end = data + info.st_size;
+
+	enum { NONE, SIMULATION, SOURCES, MATERIALS, UNKNOWN } section = NONE;
+	Token key;
+	bool ok = true;
+	while (ok && nextLine(&parser)) {
+		if (!nextToken(&parser, &key)) continue;
+
+		// Section headers are a bracketed name alone on a line
+		if (key.start[0] == '[') {
+			if (tokenIs(&key, "[Simulation]")) {
+				section = SIMULATION;
+			} else if (tokenIs(&key, "[Sources]")) {
+				section = SOURCES;
+			} else if (tokenIs(&key, "[Materials]")) {
+				section = MATERIALS;
+			} else {
+				parserMessage(&parser, "Warning", "Unknown configuration "
+						"section %.*s - ignoring", key.length, key.start);
+				section = UNKNOWN;
+			}
+			endLine(&parser);
+			continue;
+		}
+
+		switch (section) {
+			case SIMULATION:
+				ok = parseSimulationKey(&parser, &key, scene, simulation);
+				break;
+			case SOURCES:
+				ok = parseSourceKey(&parser, &key, scene, simulation);
+				break;
+			case MATERIALS:
+				ok = parseMaterialKey(&parser, &key, scene, simulation);
+				break;
+			case NONE:
+				parserMessage(&parser, "Warning", "Line outside of any "
+						"section - ignoring");
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (data != NULL) munmap(data, info.st_size);
+	return ok && foldMirrors(simulation, path);
+}
+
+// Fills in the defaults for settings the simulation file left out. Returns
+// false if it describes an empty grid.
+bool checkSimulation(Simulation* simulation) {
+	if (simulation->width < 1 || simulation->height < 1) {
+		fprintf(stderr, "Error: Simulation.Width and Simulation.Height must "
+				"be positive\n");
+		return false;
+	}
+
+	if (simulation->threads < 1) simulation->threads = 1;
+	if (simulation->threads > MX_MAX_THREADS) {
+		simulation->threads = MX_MAX_THREADS;
+	}
+
+	if (simulation->boundary_condition == BC_UNK) {
+		fprintf(stderr, "Warning: No boundary conditions specified - "
+				"defaulting to natural.\n");
+		simulation->boundary_condition = BC_NAT;
+	} else if (simulation->boundary_condition == BC_PML) {
+		if (simulation->pml_layers == -1) 
+				simulation->pml_layers = MX_BC_PML_DEF_LAYERS;
+		if (simulation->pml_conductivity == -1) 
+				simulation->pml_conductivity = MX_BC_PML_DEF_SIGMA;
+		if (simulation->pml_sigma_polyorder == -1) 
+				simulation->pml_sigma_polyorder = MX_BC_PML_DEF_SIGPOLYORDER;
+	}
+	return true;
+}
+
+// Whether two simulations share a grid, with the same boundaries around it
+bool sameGrid(Simulation* a, Simulation* b) {
+	return a->width == b->width && a->height == b->height 
+			&& a->boundary_condition == b->boundary_condition 
+			&& a->pml_layers == b->pml_layers 
+			&& a->pml_conductivity == b->pml_conductivity 
+			&& a->pml_sigma_polyorder == b->pml_sigma_polyorder 
+			&& sameBytes(a->periodic, b->periodic, sizeof(a->periodic)) 
+			&& sameBytes(a->bloch_sign, b->bloch_sign, sizeof(a->bloch_sign))
+			&& sameBytes(a->mirrored, b->mirrored, sizeof(a->mirrored)) 
+			&& sameBytes(a->mirror_sign, b->mirror_sign, 
+			sizeof(a->mirror_sign));
+}
+
+// Applies an edited simulation file to the running simulation, which 
+// carries on from its current step. Only the bins under materials or maps
+// that changed are rasterized and uploaded again, and the sources are only
+// compiled again if they or the materials changed. A file that fails to 
+// parse, or that changes the grid, leaves the scene as it was; of the 
+// other Simulation settings, only Smoothing takes effect before a restart.
+bool reloadScene(const char* path, Field* field, Scene* scene, 
+		Simulation* simulation) {
+	Simulation parsed;
+	Scene fresh;
+	initSimulation(&parsed);
+	memset(&fresh, 0, sizeof(Scene));
+	bool ok = parseSimFile(path, &parsed, &fresh) && checkSimulation(&parsed);
+	free(parsed.tuning_path);
+	if (ok && !sameGrid(&parsed, simulation)) {
+		fprintf(stderr, "Error: %s changes the grid or its boundaries, "
+				"which needs a restart\n", path);
+		ok = false;
+	}
+
+	// A change of smoothing touches every cell an edge cuts
+	int binc = 0;
+	int* bins = NULL;
+	if (ok) {
+		bins = diffMaterials(scene, &fresh, simulation, 
+				parsed.smoothing != simulation->smoothing, &binc);
+		ok = bins != NULL && buildSpatialIndex(&fresh.index, 
+				&fresh.materials, simulation->width, simulation->height);
+		if (!ok) {
+			fprintf(stderr, "Failed to allocate memory for material "
+					"index.\n");
+		}
+	}
+	if (!ok) {
+		fprintf(stderr, "Keeping the current scene.\n");
+		free(bins);
+		freeScene(&fresh);
+		return false;
+	}
+
+	simulation->smoothing = parsed.smoothing;
+	if (binc > 0) {
+		rasterizeBins(field, simulation, &fresh, bins, binc);
+		if (gpu_support) {
+			uploadMaterialBins(field, simulation, &fresh.index, bins, binc);
+			if (!resortTiles(field, simulation)) {
+				fprintf(stderr, "Warning: Failed to allocate memory for tile "
+						"lists - the device steps the new materials as the "
+						"old ones.\n");
+			}
+		}
+	}
+
+	// Line sources take their amplitudes from the materials under them. 
+	// Device buffers are only replaced if the compiled table changed shape.
+	SourceInjection* old = &scene->injection;
+	SourceInjection* injection = &fresh.injection;
+	bool compile = binc > 0 || !sameSources(&scene->sources, &fresh.sources);
+	bool compiled = compile && compileSources(injection, &fresh.sources, 
+			field, simulation);
+	if (compiled) {
+		advanceInjection(injection, simulation->step);
+		if (gpu_support) {
+			if (injection->cellc != old->cellc 
+					|| injection->wavec != old->wavec 
+					|| injection->tablec != old->tablec 
+					|| injection->samplec != old->samplec) {
+				releaseSourceBuffers(simulation);
+				createSourceBuffers(simulation, injection);
+			}
+			uploadSources(simulation, injection);
+		}
+		if (simulation->activity.list != NULL) {
+			seedActivity(&simulation->activity, injection, simulation);
+			simulation->activity.next_check = 0;
+		}
+	} else {
+		if (compile) {
+			fprintf(stderr, "Failed to allocate memory for source table - "
+					"keeping the old sources.\n");
 		}
+		freeInjection(injection);
+		SourceTable sources = fresh.sources;
+		fresh.sources = scene->sources;
+		scene->sources = sources;
+		fresh.injection = *old;
+		memset(old, 0, sizeof(SourceInjection));
+	}
+
+	int nbins = scene->index.cols * scene->index.rows;
+	freeScene(scene);
+	*scene = fresh;
+	if (binc > 0 && scene->cache.dir != NULL) {
+		scene->cache.key = sceneCacheKey(scene, simulation);
+		saveSceneCache(&scene->cache, field, simulation);
+	}
+	printf("Reloaded %s: rasterized %d of %d bins again%s.\n", path, binc, 
+			nbins, compiled ? " and recompiled the sources" : "");
+	free(bins);
+	return true;
+}
+
+void watchFile(FileWatch* watch, const char* path) {
+	struct stat info;
+	watch->path = path;
+	watch->identity = stat(path, &info) == 0 ? fileIdentity(&info) : 0;
+	watch->pending = watch->identity;
+	watch->next_poll = wallTime() + MX_WATCH_PERIOD;
+}
+
+// Whether the file has been edited, and then left alone for a period, 
+// since this last returned true. A missing file is waited out.
+bool fileEdited(FileWatch* watch) {
+	struct stat info;
+	double now = wallTime();
+	if (now < watch->next_poll) return false;
+	watch->next_poll = now + MX_WATCH_PERIOD;
+	uint64_t identity = stat(watch->path, &info) == 0 ? fileIdentity(&info) 
+			: 0;
+	bool settled = identity == watch->pending;
+	watch->pending = identity;
+	if (!settled || identity == 0 || identity == watch->identity) {
+		return false;
+	}
+	watch->identity = identity;
+	return true;
+}
+
+#ifndef MX_BENCH
+int main(int argc, char** argv) {
+	// Ensure a simulation description file has been provided
+	if (argc < 2) {
+		fprintf(stderr, "Invalid number of arguments.\n");
+		fprintf(stderr, "Usage: %s sim_file\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	// Initialize the simulation parameter data structure
+	Simulation simulation;
+	initSimulation(&simulation);
+
+	// Parse the simulation file straight into the scene
+	Scene scene;
+	memset(&scene, 0, sizeof(Scene));
+	if (!parseSimFile(argv[1], &simulation, &scene) 
+			|| !checkSimulation(&simulation)) {
+		freeScene(&scene);
+		exit(EXIT_FAILURE);
+	}
+
+	// Initialize GLFW
+	glfwSetErrorCallback(glfw_error_callback);
+	if (!glfwInit()) {
+		fprintf(stderr, "Failed to initialize glfw\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Create a GLFW window for displaying simulation
+	GLFWwindow* window;
+	window = glfwCreateWindow(imageWidth(&simulation), 
+			imageHeight(&simulation), "Maxwell", NULL, NULL);
+	if (!window) {
+		fprintf(stderr, "Failed to create glfw window\n");
+		glfwTerminate();
+		exit(EXIT_FAILURE);
+	}
+	glfwMakeContextCurrent(window);
+	glfwSetKeyCallback(window, key_callback);
+	glfwSetMouseButtonCallback(window, mouse_button_callback);
+
+	// Allocate the fields and add the scene's materials and sources
+	Field field;
+	if (!buildScene(&field, &scene, &simulation)) {
+		freeScene(&scene);
 		glfwDestroyWindow(window);
 		glfwTerminate();
 		exit(EXIT_FAILURE);
 	}
-	for (int m = 0; m < simulation.materialc; m++) {
-		for (int i = 0; i < simulation.width * simulation.height; i++) {
-			matBoundMask[i] = matBoundMask[i] || materials[m].boundary[i];
-		}
+
+	// Allocate memory for simulation image buffer
+	simulation.image = (float*)malloc(3 * imageWidth(&simulation) 
+			* imageHeight(&simulation) * sizeof(float));
+	if (simulation.image == NULL) {
+		fprintf(stderr, "Failed to allocate memory for simulation image "
+				"buffer.\n");
+		freeFields(&field, &simulation);
+		freeScene(&scene);
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		exit(EXIT_FAILURE);
 	}
-	simulation.matBoundMask = matBoundMask;
+
+	// Initialize OpenCL
+	initOpenCL(&field, &scene, &simulation);
 
 	GLuint texture;
 	glGenTextures(1, &texture);
@@ -1401,35 +5534,59 @@ int main(int argc, char** argv) {
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-	simulation.start_time = clock();
+	// Edits to the simulation file are applied as it runs
+	FileWatch watch;
+	watchFile(&watch, argv[1]);
+
+	simulation.start_time = wallTime();
+	if (simulation.profiler.enabled) resetProfile(&simulation);
 	
 	// Begin main simulation loop
 	while (!glfwWindowShouldClose(window)) {
 		if (report_framerate) {
-			double framerate = ((double) (clock() - simulation.start_time)) 
-					/ CLOCKS_PER_SEC;
-			framerate = simulation.frame / framerate;
+			double framerate = simulation.frame / (wallTime() 
+					- simulation.start_time);
 			printf("Simulation averaging %d FPS since last interrupt.\n", 
 					(int)framerate);
 			report_framerate = false;
 		}
+		if (toggle_profiling) {
+			printf("%s profiling.\n", simulation.profiler.enabled 
+					? "Disabling" : "Enabling");
+			setProfiling(&simulation, !simulation.profiler.enabled);
+			toggle_profiling = false;
+		}
 		if (cycle_vis) {
 			simulation.vis_fxn++;
 			if (simulation.vis_fxn == VIS_MAX) simulation.vis_fxn = 0;
 			cycle_vis = false;
 		}
+		if (fileEdited(&watch)) {
+			printf("Reloading %s.\n", argv[1]);
+			reloadScene(argv[1], &field, &scene, &simulation);
+		}
 		if (reset_sim) {
-			initFields(&field, &simulation);
+			resetFields(&field, &simulation);
+			resetInjection(&scene.injection, &simulation);
 			simulation.time = 0.0f;
-			updateImage(&field, &simulation, sources);
+			simulation.step = 0;
+			updateImage(&field, &simulation, &scene.injection);
 			reset_sim = false;
 		}
+		if (probe_requested) {
+			// The texture's first row is drawn at the bottom of the window
+			reportProbe(&field, &simulation, &scene, 
+					(int)(probe_x * imageWidth(&simulation)), 
+					imageHeight(&simulation) - 1 
+					- (int)(probe_y * imageHeight(&simulation)));
+			probe_requested = false;
+		}
 		if (just_resumed) {
-			simulation.start_time = clock();
+			simulation.start_time = wallTime();
 			simulation.frame = 0;
 			just_resumed = false;
 		}
-		if (sim_running) updateImage(&field, &simulation, sources);
+		if (sim_running) updateImage(&field, &simulation, &scene.injection);
 		
 		glClear(GL_COLOR_BUFFER_BIT);
 		
@@ -1443,34 +5600,26 @@ int main(int argc, char** argv) {
 		glEnd();
 		glDisable(GL_TEXTURE_2D);
 
+		double start = profileStart(&simulation);
 		glfwSwapBuffers(window);
+		profileEnd(&simulation, PH_SWAP, start);
+		endProfileFrame(&simulation);
 
 		glfwPollEvents();
 	}
 
 	// Clean up, release allocated resources
+	setProfiling(&simulation, false);
 	glfwDestroyWindow(window);
 	glfwTerminate();
 
-	free(Epsilon);
-	free(Mu);
-	free(Ex);
-	free(Ey);
-	free(Ez);
-	free(Hx);
-	free(Hy);
-	free(Hz);
-
-	for (int m = 0; m < simulation.materialc; m++) {
-		free(materials[m].boundary);
-	}
-
-	if (gpu_support) free(kernelSource);
-
+	releaseOpenCL(&simulation);
+	freeFields(&field, &simulation);
 	free(simulation.image);
-	free(matBoundMask);
+	freeScene(&scene);
 
 	printf("Goodbye!\n");
 		
 	exit(EXIT_SUCCESS);
 }
+#endif
@@ -1,15 +1,29 @@
 #ifndef MAXWELL_H
 #define MAXWELL_H
 
+// For thread affinity
+#define _GNU_SOURCE
+
 #include <GLFW/glfw3.h>
 #define CL_TARGET_OPENCL_VERSION 300
 #include <CL/cl.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define SPEED_OF_LIGHT 299792458.0
 #define VACUUM_PERMITTIVITY 8.854e-12
@@ -20,27 +34,55 @@
 #define MIN_FIELD 0
 #define MX_DT_SCALE 0.9
 
-#define MX_MAX_MATERIALS 1000
-#define MX_MAX_MAT_ARGS 10
-#define MX_MAT_ARGC_TRIANGLE 9
-#define MX_MAT_ARGC_CIRCLE 6
-
 #define MX_MAT_BOUNDARY_PX 1
+#define MX_MASK_WORD_BITS 32
+// Bins double as rasterization tiles, so they must span whole mask words
+#define MX_INDEX_BIN_PX 32
+#define MX_PROBE_MAX_MATERIALS 16
+#define MX_SMOOTHING_MAX 8
+#define MX_MAX_THREADS 256
 
-#define MX_STRING_ARGL 255
-#define MX_MAX_SRC_ARGS 10
-#define MX_SIMFILE_MAX_LINEL 256
-#define MX_SIMDEF_NSEC 3
-#define MX_MAX_SOURCES 1000
-#define MX_FC_STRL 10
+#define MX_NUMBER_MAXL 64
+#define MX_GRID_MAGIC "MXGD"
+#define MX_GRID_HEADER_BYTES 20
+#define MX_GRID_SI_UNITS 0x1
+#define MX_MAP_GRIDS 3
+// Field and material grids share one arena, and every grid and row in it 
+// starts on a cache line. Rows have a line of ghost cells before them and 
+// at least one ghost cell after, and grids a ghost row above and below.
+#define MX_ARENA_ALIGN 64
+#define MX_ROW_ALIGN (MX_ARENA_ALIGN / (int)sizeof(float))
+#define MX_FIELD_GRIDS 9
+// The arena is mapped in whole huge pages
+#define MX_HUGE_PAGE (2UL << 20)
+#define MX_MAP_PALETTE 256
+#define MX_CACHE_MAGIC "MXSC"
+#define MX_CACHE_VERSION 2
+#define MX_FNV_OFFSET 0xcbf29ce484222325ULL
+#define MX_FNV_PRIME 0x100000001b3ULL
+#define MX_SCENE_MIN_CAPACITY 64
 
-#define MX_SRC_ARGC_SINELINFREQ 4
+#define MX_LINE_RAMP_PERIODS 5
+#define MX_WAVE_CUTOFF 1e-7
+#define MX_WAVE_MAX_SAMPLES (1 << 24)
+#define MX_INJECT_GROUPS 3
 
 #define MX_BC_DEFAULT BC_NAT
 #define MX_BC_PML_DEF_LAYERS 100
 #define MX_BC_PML_DEF_SIGMA 1e-4
 #define MX_BC_PML_DEF_SIGPOLYORDER 1
-#define MX_BC_PML_ARGC 3
+
+#define MX_PROFILE_BUCKETS 128
+#define MX_PROFILE_SUBBUCKETS 4
+#define MX_PROFILE_EVENTS 64
+#define MX_PROFILE_DEF_PERIOD 5
+#define MX_STREAM_LENGTH (1L << 24)
+#define MX_STREAM_REPEATS 5
+#define MX_TUNE_REPEATS 5
+#define MX_TUNE_LINE_MAXL 512
+#define MX_TILE_PX 32
+#define MX_BUILD_OPTIONS_MAXL 512
+#define MX_WATCH_PERIOD 0.5
 
 typedef enum {
 	VIS_TE_1 = 0,
@@ -55,6 +97,12 @@ typedef enum {
 	BC_PML
 } BoundaryCondition;
 
+typedef enum {
+	AX_X = 0,
+	AX_Y,
+	AX_MAX
+} Axis;
+
 typedef struct {
 	float* Epsilon;
 	float* Mu;
@@ -67,8 +115,105 @@ typedef struct {
 	float ezMin;
 	float ezMax;
 	float* Sigma;
+	// One mapping behind every grid above, each of which points at its
+	// cell (0, 0)
+	float* arena;
+	size_t arena_length;
 } Field;
 
+// Phases of a frame, as timed by the profiler. The first four make up a 
+// time step.
+typedef enum {
+	PH_INJECT = 0,
+	PH_E,
+	PH_H,
+	PH_BOUNDARY,
+	PH_TRANSFER,
+	PH_COLORIZE,
+	PH_TEXTURE,
+	PH_SWAP,
+	PH_FRAME,
+	PH_MAX
+} ProfilePhase;
+
+// Durations in nanoseconds, binned by quarter octave: bucket b counts 
+// durations from 2^(b/4) up to 2^((b+1)/4) ns
+typedef struct {
+	long count;
+	double total;
+	double min;
+	double max;
+	unsigned buckets[MX_PROFILE_BUCKETS];
+} Histogram;
+
+// Each frame contributes one sample per phase it ran, summed over all of 
+// that phase's work. Host work is timed with the monotonic clock; device 
+// commands record events, which are read once the frame has finished. 
+// Every period seconds the means since the last stats line are printed.
+typedef struct {
+	bool enabled;
+	float period;
+	double frame_start;
+	double last_line;
+	double frame[PH_MAX];
+	bool seen[PH_MAX];
+	int eventc;
+	cl_event events[MX_PROFILE_EVENTS];
+	ProfilePhase event_phase[MX_PROFILE_EVENTS];
+	double line_total[PH_MAX];
+	long line_count[PH_MAX];
+	Histogram phases[PH_MAX];
+	// Measured on the first report, in bytes per second
+	double peak_bandwidth;
+} Profiler;
+
+// Kernels whose work-group shape is chosen by the autotuner
+typedef enum {
+	TK_E = 0,
+	TK_H,
+	TK_VIS_TE_1,
+	TK_VIS_TE_2,
+	TK_MAT_BOUNDS,
+	TK_MAX
+} TunedKernel;
+
+// Field update variants, from cheapest to most general. Each GPU tile 
+// gets the cheapest variant that is exact for all of its cells; the H 
+// update has no lossy variant.
+typedef enum {
+	TC_VACUUM = 0,
+	TC_DIELECTRIC,
+	TC_LOSSY,
+	TC_MAX
+} TileClass;
+
+// Under Simulation.ActiveTiles, the CPU and GPU only step the tiles of 
+// MX_TILE_PX cells that fields could have reached, numbered row by row. 
+// A tile is live if it holds a source cell or a nonzero field, and active 
+// if it or a neighbor is live. Nothing travels more than a cell per step, 
+// so liveness is rechecked every MX_TILE_PX steps, and inactive tiles hold
+// zero fields throughout.
+typedef struct {
+	int columns;
+	int rows;
+	bool* seed;
+	int* live;
+	bool* active;
+	// Active tiles in order, count of them
+	int* list;
+	int count;
+	int next_check;
+	// The GPU's class-sorted tile lists in full, and room for the active 
+	// part of one
+	int* E_tiles;
+	int* H_tiles;
+	int E_start[TC_MAX + 1];
+	int H_start[TC_MAX + 1];
+	int* compact;
+} TileActivity;
+
+typedef struct StepPool StepPool;
+
 typedef struct {
 	int width;
 	int height;
@@ -76,16 +221,30 @@ typedef struct {
 	float dt;
 	float dx;
 	float dy;
-	int sourcec;
-	int materialc;
+	int threads;
+	int smoothing;
 	VisualizationFunction vis_fxn;
 	float* image;
-	float* matBoundMask;
+	uint32_t* matBoundMask;
+	int mask_pitch;
+	// Field rows are pitch floats apart, and cell (0, 0) is origin floats 
+	// into each grid of the arena
+	int pitch;
+	int origin;
 	int frame;
+	int step;
+	// With fused_colorize, the step that ends each frame colors the image 
+	// as it updates H, and emit_image is set for that step
+	bool fused_colorize;
+	bool emit_image;
+	bool active_tiles;
+	TileActivity activity;
 	int pml_layers;
 	float pml_conductivity;
 	int pml_sigma_polyorder;
-	clock_t start_time;
+	double start_time;
+	StepPool* pool;
+	Profiler profiler;
 	cl_mem Ez_kbuf;
 	cl_mem Hx_kbuf;
 	cl_mem Hy_kbuf;
@@ -94,38 +253,128 @@ typedef struct {
 	cl_mem image_kbuf;
 	cl_mem matBoundMask_kbuf;
 	cl_mem Sigma_kbuf;
+	cl_mem sourceCells_kbuf;
+	cl_mem sourceFirst_kbuf;
+	cl_mem phasorRe_kbuf;
+	cl_mem phasorIm_kbuf;
+	cl_mem rotationRe_kbuf;
+	cl_mem rotationIm_kbuf;
+	cl_mem amplitude_kbuf;
+	cl_mem ramp_kbuf;
+	cl_mem tableFirst_kbuf;
+	cl_mem tableOffset_kbuf;
+	cl_mem tableLength_kbuf;
+	cl_mem samples_kbuf;
+	// Tile origins as (x, y) pairs, grouped by class: class c's tiles start
+	// at tile_start[c]
+	cl_mem Etiles_kbuf;
+	cl_mem Htiles_kbuf;
+	cl_mem live_kbuf;
+	int E_tile_start[TC_MAX + 1];
+	int H_tile_start[TC_MAX + 1];
 	cl_context context;
+	cl_device_id device;
 	cl_command_queue queue;
 	cl_program program;
-	cl_kernel E_kernel;
-	cl_kernel H_kernel;
+	cl_kernel E_kernels[TC_MAX];
+	cl_kernel H_kernels[TC_MAX];
+	// H updates that also color the frame's pixels
+	cl_kernel H_image_kernels[TC_MAX];
 	cl_kernel VIS_TE_1_kernel;
 	cl_kernel VIS_TE_2_kernel;
 	cl_kernel drawMatBounds_kernel;
+	cl_kernel inject_kernel;
+	cl_kernel PEC_kernel;
+	cl_kernel markLive_kernel;
+	cl_kernel wrapH_kernel;
+	cl_kernel wrapEz_kernel;
+	// Chosen work-group shapes, {0, 0} for the driver's, and the global 
+	// sizes padded to match
+	bool autotune;
+	char* tuning_path;
+	size_t local_size[TK_MAX][2];
+	size_t global_size[TK_MAX][2];
 	BoundaryCondition boundary_condition;
+	// Axes whose opposite edges wrap onto each other, in place of the 
+	// boundary condition there, and the Bloch factor applied across them
+	bool periodic[AX_MAX];
+	int bloch_sign[AX_MAX];
+	// Axes with a mirror plane across their middle, which keep only the 
+	// low half in the grid, and whether Ez is even (1) or odd (-1) in it
+	bool mirrored[AX_MAX];
+	int mirror_sign[AX_MAX];
 } Simulation;
 
+typedef struct {
+	StepPool* pool;
+	int thread;
+} StepTask;
+
 typedef enum {
-	TYPE_INT,
-	TYPE_DOUBLE,
-	TYPE_FLOAT,
-	TYPE_STRING
-} ArgType;
+	SK_INIT = 0,
+	SK_COPY,
+	SK_TRIAD
+} StreamKernel;
 
-typedef union {
-	int intVal;
-	double doubleVal;
-	float floatVal;
-	char stringVal[MX_STRING_ARGL];
-} ArgValue;
+// One thread's share of a STREAM-style bandwidth measurement
+typedef struct {
+	StreamKernel kernel;
+	float* a;
+	float* b;
+	float* c;
+	long first;
+	long last;
+} StreamTask;
+
+// A half-step kernel as the roofline model sees it, per cell
+typedef struct {
+	const char* name;
+	double bytes;
+	double flops;
+} KernelCost;
+
+typedef enum {
+	SJ_STEP = 0,
+	SJ_STEP_TILES,
+	SJ_INIT
+} StepJob;
 
+// Tiles shared out for one half-step. Each thread starts on its own slice 
+// of the list, then steals from the others' slices.
 typedef struct {
-	ArgType type;
-	ArgValue value;
-} Argument;
+	const int* tiles;
+	int count;
+	atomic_int next[MX_MAX_THREADS];
+} TileQueue;
+
+// Threads that share each CPU time step, one band of rows apiece. The 
+// calling thread is thread 0 and the workers sleep between jobs. Every 
+// thread is pinned to a CPU, with consecutive bands on the same socket 
+// where possible. Pools started with the fields, under ComputeOn CPU, also
+// first touch their bands' rows in each grid.
+struct StepPool {
+	Field* field;
+	Simulation* simulation;
+	int threads;
+	StepJob job;
+	TileQueue E_queue;
+	TileQueue H_queue;
+	bool quit;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int waiting;
+	unsigned generation;
+	pthread_t workers[MX_MAX_THREADS];
+	StepTask tasks[MX_MAX_THREADS];
+};
 
 typedef enum {
-	SINELINFREQ
+	SINELINFREQ,
+	GAUSSIANPULSE,
+	MODULATEDGAUSSIAN,
+	RICKER,
+	WAVEFILE,
+	LINESOURCE
 } SourceFunction;
 
 typedef enum {
@@ -140,11 +389,116 @@ typedef enum {
 } FieldComponent;
 
 typedef struct {
-	SourceFunction fxn;
-	FieldComponent fc;
-	int argc;
-	Argument argv[MX_MAX_SRC_ARGS];
-} Source;
+	float frequency;
+	float phase;
+} SineLinFreqParams;
+
+// Shared by the Gaussian, modulated Gaussian and Ricker pulses. Times are 
+// in seconds; a Ricker wavelet uses frequency as its peak frequency.
+typedef struct {
+	float amplitude;
+	float delay;
+	float width;
+	float frequency;
+	float phase;
+} PulseParams;
+
+// Samples first through first + count - 1 of the table's file samples, 
+// with sample i applied at t = (i + 1) * period
+typedef struct {
+	float amplitude;
+	float period;
+	int first;
+	int count;
+} WaveFileParams;
+
+typedef enum {
+	LD_POS_X,
+	LD_NEG_X,
+	LD_POS_Y,
+	LD_NEG_Y
+} LineDirection;
+
+// A one-sided total-field/scattered-field line. The incident wave travels 
+// in the given direction, tilted by angle degrees, and exists from row or 
+// column position onwards; the line spans cells start through end along it.
+// A waist (in cells) gives the amplitude a Gaussian profile about the center.
+typedef struct {
+	LineDirection direction;
+	int position;
+	int start;
+	int end;
+	float amplitude;
+	float frequency;
+	float phase;
+	float angle;
+	float waist;
+} LineSourceParams;
+
+// Sources are stored as parallel arrays. Each source's parameters live in
+// the record array for its function, at index param[i].
+typedef struct {
+	int count;
+	int capacity;
+	SourceFunction* fxn;
+	FieldComponent* fc;
+	int* x;
+	int* y;
+	int* param;
+	int sinec;
+	int sine_capacity;
+	SineLinFreqParams* sines;
+	int pulsec;
+	int pulse_capacity;
+	PulseParams* pulses;
+	int filec;
+	int file_capacity;
+	WaveFileParams* files;
+	int samplec;
+	int sample_capacity;
+	float* file_samples;
+	int linec;
+	int line_capacity;
+	LineSourceParams* lines;
+} SourceTable;
+
+// Sources compiled for injection, as parallel arrays. Cells are grouped by
+// field component (Ez, Hx, Hy); group g covers cells group_start[g] through
+// group_start[g + 1] - 1. Cell c sums waveforms first[c] through 
+// first[c + 1] - 1, each a phasor rotated by one time step per update and
+// scaled by its amplitude (eased in over its first ramp steps, if any), and
+// tabled waveforms table_first[c] through table_first[c + 1] - 1. Tabled 
+// waveform w holds its value for step k at samples[table_offset[w] + k - 1],
+// and is zero after table_length[w] steps.
+typedef struct {
+	int group_start[MX_INJECT_GROUPS + 1];
+	int cellc;
+	int* cell;
+	int* first;
+	int wavec;
+	float* phasor_re;
+	float* phasor_im;
+	float* rotation_re;
+	float* rotation_im;
+	float* amplitude;
+	int* ramp;
+	float* start_re;
+	float* start_im;
+	int* table_first;
+	int tablec;
+	int* table_offset;
+	int* table_length;
+	int samplec;
+	float* samples;
+} SourceInjection;
+
+typedef struct {
+	long key;
+	int source;
+	float amplitude;
+	float phase;
+	int ramp;
+} InjectionKey;
 
 typedef enum {
 	MG_UNKNOWN,
@@ -153,13 +507,216 @@ typedef enum {
 } MaterialGeometry;
 
 typedef struct {
-	MaterialGeometry geom;
-	float rel_eps;
-	float rel_mu;
-	float sigma;
-	int argc;
-	Argument argv[MX_MAX_MAT_ARGS];
-	int* boundary;
-} Material;
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+} BoundingBox;
+
+typedef struct {
+	int x1;
+	int y1;
+	int x2;
+	int y2;
+	int x3;
+	int y3;
+} TriangleParams;
+
+typedef struct {
+	int x;
+	int y;
+	int R;
+} CircleParams;
+
+// Materials are stored as parallel arrays in scene order. Each material's
+// geometry lives in the record array for its shape, at index param[m].
+typedef struct {
+	int count;
+	int capacity;
+	MaterialGeometry* geom;
+	int* param;
+	float* rel_eps;
+	float* rel_mu;
+	float* sigma;
+	BoundingBox* bbox;
+	int trianglec;
+	int triangle_capacity;
+	TriangleParams* triangles;
+	int circlec;
+	int circle_capacity;
+	CircleParams* circles;
+} MaterialTable;
+
+// Uniform grid over the simulation space. Bin b lists the materials whose
+// bounding boxes overlap it, in scene order, as items[start[b]] through
+// items[start[b + 1] - 1].
+typedef struct {
+	int cols;
+	int rows;
+	int* start;
+	int* items;
+} SpatialIndex;
+
+_Static_assert(MX_INDEX_BIN_PX % MX_MASK_WORD_BITS == 0, 
+		"Index bins must span whole boundary mask words");
+
+// The first three quantities name the field grid a map replaces; an 
+// indexed map replaces all three through the palette
+typedef enum {
+	MQ_EPSILON = 0,
+	MQ_MU,
+	MQ_SIGMA,
+	MQ_INDEXED
+} MapQuantity;
+
+typedef enum {
+	GT_FLOAT32 = 0,
+	GT_UINT8
+} GridType;
+
+// A raster material file, mapped for the lifetime of the scene. Cells are 
+// stored row by row in increasing y, starting at data. The map covers the 
+// width x height cells from (x, y), sampled nearest-neighbor from its 
+// file_width x file_height values.
+typedef struct {
+	MapQuantity quantity;
+	GridType type;
+	bool si_units;
+	int file_width;
+	int file_height;
+	int x;
+	int y;
+	int width;
+	int height;
+	char* mapping;
+	size_t length;
+	const char* data;
+	// Hash of the file's device, inode, size and modification time
+	uint64_t identity;
+} MaterialMap;
+
+// Maps are applied in scene order over the vacuum background, before any 
+// geometric materials.
+typedef struct {
+	int count;
+	int capacity;
+	MaterialMap* maps;
+	bool palette_set[MX_MAP_PALETTE];
+	float palette_eps[MX_MAP_PALETTE];
+	float palette_mu[MX_MAP_PALETTE];
+	float palette_sigma[MX_MAP_PALETTE];
+} MapTable;
+
+// Rasterized materials saved under dir, in a file named for a hash of 
+// everything that affects them. The file is a SceneCacheHeader followed by
+// the epsilon, mu and sigma grids, laid out as in the field arena, and the
+// boundary mask, so a hit is read straight into place.
+typedef struct {
+	char* dir;
+	uint64_t key;
+} SceneCache;
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint64_t key;
+	int32_t width;
+	int32_t height;
+	int32_t mask_pitch;
+	int32_t pitch;
+} SceneCacheHeader;
+
+typedef struct {
+	SourceTable sources;
+	SourceInjection injection;
+	MaterialTable materials;
+	MapTable maps;
+	SceneCache cache;
+	SpatialIndex index;
+} Scene;
+
+// Cursor over a memory-mapped simulation file. Tokens point into the 
+// mapping rather than being copied; tokens on the current line end at 
+// token_end, which stops short of any comment.
+typedef struct {
+	const char* path;
+	const char* pos;
+	const char* end;
+	const char* line_end;
+	const char* token_end;
+	int line;
+} SimParser;
+
+typedef struct {
+	const char* start;
+	int length;
+} Token;
+
+// Bins to rasterize, in the scene's spatial index, or NULL for every bin 
+// of a freshly initialized grid. Listed bins are cleared back to the 
+// background first.
+typedef struct {
+	Field* field;
+	Simulation* simulation;
+	Scene* scene;
+	const int* bins;
+	int binc;
+	atomic_int next_tile;
+} RasterJob;
+
+// Per-thread accumulators for sub-cell material smoothing over one tile.
+// Materials covering a whole cell multiply into its eps/mu/sigma factors;
+// cells cut by an edge also get samples^2 sub-cell samples each.
+typedef struct {
+	int samples;
+	float eps[MX_INDEX_BIN_PX * MX_INDEX_BIN_PX];
+	float mu[MX_INDEX_BIN_PX * MX_INDEX_BIN_PX];
+	float sigma[MX_INDEX_BIN_PX * MX_INDEX_BIN_PX];
+	bool partial[MX_INDEX_BIN_PX * MX_INDEX_BIN_PX];
+	float* sample_eps;
+	float* sample_mu;
+	float* sample_sigma;
+} SmoothingScratch;
+
+typedef struct {
+	RasterJob* job;
+	SmoothingScratch* smooth;
+} RasterTask;
+
+// A file polled for edits every MX_WATCH_PERIOD seconds. An edit counts 
+// once the file has stayed the same for a whole period, so that a save in
+// progress isn't read halfway through.
+typedef struct {
+	const char* path;
+	uint64_t identity;
+	uint64_t pending;
+	double next_poll;
+} FileWatch;
+
+// Solver entry points, shared with the benchmark (bench.c), which links 
+// against maxwell.c built with MX_BENCH
+extern bool gpu_support;
+extern bool trying_gpu;
+
+int min(int a, int b);
+int max(int a, int b);
+double wallTime(void);
+KernelCost kernelCost(Simulation* simulation, ProfilePhase phase);
+bool measureHostBandwidth(int threads, double* copy, double* triad);
+double measureDeviceBandwidth(Simulation* simulation);
+void initSimulation(Simulation* simulation);
+int addSineLinFreq(SourceTable* sources, FieldComponent fc, int x, int y, 
+		SineLinFreqParams sine);
+int addTriangle(MaterialTable* materials, float rel_eps, float rel_mu, 
+		float sigma, TriangleParams triangle);
+int addCircle(MaterialTable* materials, float rel_eps, float rel_mu, 
+		float sigma, CircleParams circle);
+bool buildScene(Field* field, Scene* scene, Simulation* simulation);
+bool initOpenCL(Field* field, Scene* scene, Simulation* simulation);
+void updateFields(Field* field, Simulation* simulation, 
+		SourceInjection* injection);
+void releaseOpenCL(Simulation* simulation);
+void freeFields(Field* field, Simulation* simulation);
+void freeScene(Scene* scene);
 
 #endif